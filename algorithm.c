@@ -1007,6 +1007,7 @@ static const int eth_future_epochs = 6;
 static cl_int queue_ethash_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_unused cl_uint threads)
 {
   struct pool *pool = blk->work->pool;
+  struct work_ethash *eth = work_ethash(blk->work);
   eth_dag_t *dag;
   cl_kernel *kernel;
   unsigned int num = 0;
@@ -1023,10 +1024,10 @@ static cl_int queue_ethash_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
   }
   dag = &blk->work->thr->cgpu->eth_dag;
   cg_ilock(&dag->lock);
-  if (dag->current_epoch != blk->work->eth_epoch) {
-    cl_ulong CacheSize = EthGetCacheSize(blk->work->eth_epoch);
+  if (dag->current_epoch != eth->eth_epoch) {
+    cl_ulong CacheSize = EthGetCacheSize(eth->eth_epoch);
     cg_ulock(&dag->lock);
-    if (dag->dag_buffer == NULL || blk->work->eth_epoch > dag->max_epoch) {
+    if (dag->dag_buffer == NULL || eth->eth_epoch > dag->max_epoch) {
       if (dag->dag_buffer != NULL) {
 	cg_dlock(&pool->data_lock);
         clReleaseMemObject(dag->dag_buffer);
@@ -1039,7 +1040,7 @@ static cl_int queue_ethash_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
 	dag->pool = pool;
 	cg_dwlock(&pool->data_lock);
       }
-      dag->max_epoch = blk->work->eth_epoch + eth_future_epochs;
+      dag->max_epoch = eth->eth_epoch + eth_future_epochs;
       dag->dag_buffer = clCreateBuffer(clState->context, CL_MEM_READ_WRITE, EthGetDAGSize(dag->max_epoch), NULL, &status);
       if (status != CL_SUCCESS) {
 	cg_runlock(&pool->data_lock);
@@ -1075,7 +1076,7 @@ static cl_int queue_ethash_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
     CL_SET_ARG(CacheSize64);
     CL_SET_ARG(Isolate);
 
-    cl_ulong DAGSize = EthGetDAGSize(blk->work->eth_epoch);
+    cl_ulong DAGSize = EthGetDAGSize(eth->eth_epoch);
     size_t DAGItems = (size_t) (DAGSize / 64);
     status |= clEnqueueNDRangeKernel(clState->commandQueue, clState->GenerateDAG, 1, NULL, &DAGItems, NULL, 0, NULL, NULL);
     clFinish(clState->commandQueue);
@@ -1086,7 +1087,7 @@ static cl_int queue_ethash_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
       applog(LOG_ERR, "Error %d: Setting args for the DAG kernel and/or executing it.", status);
       return status;
     }
-    dag->current_epoch = blk->work->eth_epoch;
+    dag->current_epoch = eth->eth_epoch;
     cg_dwlock(&dag->lock);
   }
   else {
@@ -1097,14 +1098,14 @@ static cl_int queue_ethash_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
   memcpy(&le_target, blk->work->device_target + 24, 8);
   mutex_lock(&eth_nonce_lock);
   HighNonce = eth_nonce++;
-  blk->work->Nonce = (cl_ulong) HighNonce << 32;
+  eth->Nonce = (cl_ulong) HighNonce << 32;
   mutex_unlock(&eth_nonce_lock);
 
   num = 0;
   kernel = &clState->kernel;
 
   // Not nodes now (64 bytes), but DAG entries (128 bytes)
-  cl_ulong DAGSize = EthGetDAGSize(blk->work->eth_epoch);
+  cl_ulong DAGSize = EthGetDAGSize(eth->eth_epoch);
   cl_uint ItemsArg = DAGSize / 128;
 
   // DO NOT flip80.
@@ -1114,7 +1115,7 @@ static cl_int queue_ethash_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
   CL_SET_ARG(clState->CLbuffer0);
   CL_SET_ARG(dag->dag_buffer);
   CL_SET_ARG(ItemsArg);
-  CL_SET_ARG(blk->work->Nonce);
+  CL_SET_ARG(eth->Nonce);
   CL_SET_ARG(le_target);
   CL_SET_ARG(Isolate);
 
@@ -1132,8 +1133,8 @@ static cl_int queue_cryptonight_kernel(_clState *clState, dev_blk_ctx *blk, __ma
 {
 	cl_kernel *kernel = &clState->kernel;
 	unsigned int num = 0;
-	cl_int status = 0, tgt32 = (blk->work->XMRTarget);
-	cl_ulong le_target = ((cl_ulong)(blk->work->XMRTarget));
+	cl_int status = 0, tgt32 = (work_cn(blk->work)->XMRTarget);
+	cl_ulong le_target = ((cl_ulong)(work_cn(blk->work)->XMRTarget));
 
 	//le_target = *(cl_ulong *)(blk->work->device_target + 24);
 	memcpy(clState->cldata, blk->work->data, 76);
@@ -1197,7 +1198,7 @@ static cl_int queue_equihash_kernel(_clState *clState, dev_blk_ctx *blk, __maybe
   size_t worksize = clState->wsize;
 
   uint64_t mid_hash[8];
-  equihash_calc_mid_hash(mid_hash, blk->work->equihash_data);
+  equihash_calc_mid_hash(mid_hash, work_equihash(blk->work)->equihash_data);
   status = clEnqueueWriteBuffer(clState->commandQueue, clState->MidstateBuf, CL_TRUE, 0, sizeof(mid_hash), mid_hash, 0, NULL, NULL);
   uint32_t dbg[2] = {0};
   status |= clEnqueueWriteBuffer(clState->commandQueue, clState->padbuffer8, CL_TRUE, 0, sizeof(dbg), &dbg, 0, NULL, NULL);
@@ -81,11 +81,49 @@ void precalc_hash_blake256(dev_blk_ctx *blk, uint32_t *state, uint32_t *pdata)
 	blk->ctx_g = ctx_blake.H[6];
 	blk->ctx_h = ctx_blake.H[7];
 
+	memcpy(blk->blake256_mid, ctx_blake.H, sizeof(blk->blake256_mid));
+	blk->blake256_mid_valid = true;
+
 	blk->cty_a = pdata[16];
 	blk->cty_b = pdata[17];
 	blk->cty_c = pdata[18];
 }
 
+/* Blake256 state after the first 64 bytes of the big endian header. That
+ * prefix is the same for every nonce of a work item, so it is worked out
+ * once and kept in work->blk for the host checks of each nonce found. */
+const uint32_t *blake256_midstate(struct work *work)
+{
+	dev_blk_ctx *blk = &work->blk;
+
+	if (!blk->blake256_mid_valid) {
+		sph_blake256_context ctx_blake;
+		uint32_t data[16];
+
+		be32enc_vect(data, (const uint32_t *)work->data, 16);
+
+		sph_blake256_init(&ctx_blake);
+		sph_blake256(&ctx_blake, data, 64);
+
+		memcpy(blk->blake256_mid, ctx_blake.H, sizeof(blk->blake256_mid));
+		blk->blake256_mid_valid = true;
+	}
+
+	return blk->blake256_mid;
+}
+
+/* Finish Blake256 of an 80 byte header from its midstate, hashing only the
+ * 16 byte tail (already big endian, nonce last). */
+void blake256_midstate_close(void *hash, const uint32_t *midstate, const void *tail)
+{
+	sph_blake256_context ctx_blake;
+
+	sph_blake256_init(&ctx_blake);
+	memcpy(ctx_blake.H, midstate, sizeof(ctx_blake.H));
+	ctx_blake.T0 = 512;
+	sph_blake256(&ctx_blake, tail, 16);
+	sph_blake256_close(&ctx_blake, hash);
+}
 
 static const uint32_t diff1targ = 0x0000ffff;
 
@@ -5,6 +5,8 @@
 
 extern int blake256_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t nonce);
 extern void precalc_hash_blake256(dev_blk_ctx *blk, uint32_t *state, uint32_t *pdata);
+extern const uint32_t *blake256_midstate(struct work *work);
+extern void blake256_midstate_close(void *hash, const uint32_t *midstate, const void *tail);
 extern void blake256_regenhash(struct work *work);
 
 #endif /* BLAKE256_H */
\ No newline at end of file
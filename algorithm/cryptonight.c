@@ -307,7 +307,7 @@ void cryptonight_regenhash(struct work *work)
 	uint32_t *nonce = (uint32_t *)(work->data + 39);
 	uint32_t *ohash = (uint32_t *)(work->hash);
 	
-	work->XMRNonce = *nonce;
+	work_cn(work)->XMRNonce = *nonce;
 	
 	memcpy(data, work->data, 19 * 4);
 		
@@ -269,9 +269,9 @@ uint32_t equihash_verify_sol(struct work *work, sols_t *sols, int sol_i)
   for (i = 0; i < (1 << PARAM_K); i++)
     inputs[i] = htobe32(inputs[i]);
     
-  CompressArray((unsigned char*) inputs, 512*4, work->equihash_data + 143, 1344, 21, 1);
+  CompressArray((unsigned char*) inputs, 512*4, work_equihash(work)->equihash_data + 143, 1344, 21, 1);
   
-  gen_hash(work->equihash_data, 1344 + 143, work->hash); 
+  gen_hash(work_equihash(work)->equihash_data, 1344 + 143, work->hash); 
   
   if (*(uint64_t*) (work->hash + 24) < *(uint64_t*) (work->target + 24)) {
     submit_tested_work(work->thr, work);
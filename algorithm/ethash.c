@@ -117,10 +117,12 @@ void LightEthash(uint8_t *__restrict OutHash, uint8_t *__restrict MixHash, const
 
 void ethash_regenhash(struct work *work)
 {
-  work->Nonce += *((uint32_t *)(work->data + 32));
-  applog(LOG_DEBUG, "Regenhash: First qword of input: 0x%016llX.", work->Nonce);
+  struct work_ethash *eth = work_ethash(work);
+
+  eth->Nonce += *((uint32_t *)(work->data + 32));
+  applog(LOG_DEBUG, "Regenhash: First qword of input: 0x%016llX.", eth->Nonce);
   cg_rlock(&work->pool->data_lock);
-  LightEthash(work->hash, work->mixhash, work->data,(Node*) work->pool->eth_cache.dag_cache, work->eth_epoch, work->Nonce);
+  LightEthash(work->hash, eth->mixhash, work->data,(Node*) work->pool->eth_cache.dag_cache, eth->eth_epoch, eth->Nonce);
   cg_runlock(&work->pool->data_lock);
   
   char *DbgHash = bin2hex(work->hash, 32);
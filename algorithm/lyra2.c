@@ -24,6 +24,14 @@
 #include "lyra2.h"
 #include "sponge.h"
 
+#ifdef _MSC_VER
+#define LYRA2_INLINE __forceinline
+#define LYRA2_TLS __declspec(thread)
+#else
+#define LYRA2_INLINE inline __attribute__((always_inline))
+#define LYRA2_TLS __thread
+#endif
+
 /**
  * Executes Lyra2 based on the G function from Blake2b. This version supports salts and passwords
  * whose combined length is smaller than the size of the memory matrix, (i.e., (nRows x nCols x b) bits,
@@ -31,6 +39,12 @@
  * integer parameters (treated as type "unsigned int") in the order they are provided, plus the value
  * of nCols, (i.e., basil = kLen || pwdlen || saltlen || timeCost || nRows || nCols).
  *
+ * Always inlined so the fixed parameter versions below get their loops and
+ * row index arithmetic resolved at compile time. The memory matrix is the
+ * caller's and must hold LYRA2_MATRIX_INT64(nRows, nCols) words; it does
+ * not need clearing since every row is written before it is read.
+ *
+ * @param wholeMatrix The memory matrix
  * @param K The derived key to be output by the algorithm
  * @param kLen Desired key length
  * @param pwd User password
@@ -40,10 +54,8 @@
  * @param timeCost Parameter to determine the processing time (T)
  * @param nRows Number or rows of the memory matrix (R)
  * @param nCols Number of columns of the memory matrix (C)
- *
- * @return 0 if the key is generated correctly; -1 if there is an error (usually due to lack of memory for allocation)
  */
-int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols) {
+static LYRA2_INLINE void lyra2_run(uint64_t *wholeMatrix, void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols) {
 
     //============================= Basic variables ============================//
     int64_t row = 2; //index of row to be processed
@@ -56,33 +68,14 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
     int64_t i; //auxiliary iteration counter
     //==========================================================================/
 
-    //========== Initializing the Memory Matrix and pointers to it =============//
-    //Tries to allocate enough space for the whole memory matrix
-
     const int64_t ROW_LEN_INT64 = BLOCK_LEN_INT64 * nCols;
-    const int64_t ROW_LEN_BYTES = ROW_LEN_INT64 * 8;
     // for Lyra2REv2, nCols = 4, v1 was using 8
 //    const int64_t BLOCK_LEN = ((nCols == 4) || (nCols == 16) ) ? BLOCK_LEN_BLAKE2_SAFE_INT64 : BLOCK_LEN_BLAKE2_SAFE_BYTES;
 	const int64_t BLOCK_LEN = BLOCK_LEN_BLAKE2_SAFE_INT64;
-    i = (int64_t) ((int64_t) nRows * (int64_t) ROW_LEN_BYTES);
-	uint64_t *wholeMatrix = (uint64_t*)malloc(i);
-    if (wholeMatrix == NULL) {
-      return -1;
-    }
-	memset(wholeMatrix, 0, i);
+    uint64_t *ptrWord;
 
-    //Allocates pointers to each row of the matrix
-	uint64_t **memMatrix = (uint64_t**)malloc(nRows * sizeof (uint64_t*));
-    if (memMatrix == NULL) {
-      return -1;
-    }
-    //Places the pointers in the correct positions
-    uint64_t *ptrWord = wholeMatrix;
-    for (i = 0; i < nRows; i++) {
-      memMatrix[i] = ptrWord;
-      ptrWord += ROW_LEN_INT64;
-    }
-    //==========================================================================/
+    //Row i of the memory matrix
+#define M(i) (wholeMatrix + (i) * ROW_LEN_INT64)
 
     //============= Getting the password + salt + basil padded with 10*1 ===============//
     //OBS.:The memory matrix will temporarily hold the password: not for saving memory,
@@ -124,10 +117,7 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
 
     //======================= Initializing the Sponge State ====================//
     //Sponge state: 16 uint64_t, BLOCK_LEN_INT64 words of them for the bitrate (b) and the remainder for the capacity (c)
-	uint64_t *state = (uint64_t*)malloc(16 * sizeof (uint64_t));
-    if (state == NULL) {
-      return -1;
-    }
+    uint64_t state[16];
     initState(state);
     //==========================================================================/
 
@@ -141,12 +131,12 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
 
     //Initializes M[0] and M[1]
 
-    reducedSqueezeRow0(state, memMatrix[0], nCols); //The locally copied password is most likely overwritten here
-    reducedDuplexRow1(state, memMatrix[0], memMatrix[1], nCols);
+    reducedSqueezeRow0(state, M(0), nCols); //The locally copied password is most likely overwritten here
+    reducedDuplexRow1(state, M(0), M(1), nCols);
 
     do {
       //M[row] = rand; //M[row*] = M[row*] XOR rotW(rand)
-      reducedDuplexRowSetup(state, memMatrix[prev], memMatrix[rowa], memMatrix[row], nCols);
+      reducedDuplexRowSetup(state, M(prev), M(rowa), M(row), nCols);
 
 
       //updates the value of row* (deterministically picked during Setup))
@@ -179,7 +169,7 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
   	    //------------------------------------------------------------------------------------------
 
   	    //Performs a reduced-round duplexing operation over M[row*] XOR M[prev], updating both M[row*] and M[row]
-  	    reducedDuplexRow(state, memMatrix[prev], memMatrix[rowa], memMatrix[row], nCols);
+  	    reducedDuplexRow(state, M(prev), M(rowa), M(row), nCols);
 
   	    //update prev: it now points to the last row ever computed
   	    prev = row;
@@ -196,20 +186,72 @@ int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *
 
     //============================ Wrap-up Phase ===============================//
     //Absorbs the last block of the memory matrix
-    absorbBlock(state, memMatrix[rowa]);
+    absorbBlock(state, M(rowa));
 
     //Squeezes the key
     squeeze(state, (unsigned char*)K, kLen);
     //==========================================================================/
+#undef M
+}
 
-    //========================= Freeing the memory =============================//
-    free(memMatrix);
-    free(wholeMatrix);
+/**
+ * Lyra2 with a memory matrix kept per thread and only ever grown, so
+ * repeated calls with the same parameters do not allocate.
+ *
+ * @return 0 if the key is generated correctly; -1 if there is an error (usually due to lack of memory for allocation)
+ */
+int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols) {
+    static LYRA2_TLS uint64_t *matrix;
+    static LYRA2_TLS uint64_t matrixWords;
+    const uint64_t words = LYRA2_MATRIX_INT64(nRows, nCols);
 
-    //Wiping out the sponge's internal state before freeing it
-    memset(state, 0, 16 * sizeof (uint64_t));
-    free(state);
-    //==========================================================================/
+    if (words > matrixWords) {
+      uint64_t *grown = (uint64_t*)realloc(matrix, words * sizeof (uint64_t));
+      if (grown == NULL) {
+        return -1;
+      }
+      matrix = grown;
+      matrixWords = words;
+    }
 
+    lyra2_run(matrix, K, kLen, pwd, pwdlen, salt, saltlen, timeCost, nRows, nCols);
     return 0;
 }
+
+/**
+ * Lyra2 over a matrix provided by the caller, for hashing threads that keep
+ * their own scratch memory. matrix must hold LYRA2_MATRIX_INT64(nRows, nCols)
+ * words.
+ */
+void LYRA2_matrix(uint64_t *matrix, void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols) {
+    lyra2_run(matrix, K, kLen, pwd, pwdlen, salt, saltlen, timeCost, nRows, nCols);
+}
+
+/**
+ * Lyra2Z: 32 byte key from a 32 byte input used as both password and salt,
+ * T = 8, R = 8, C = 8. The matrix is on the stack.
+ */
+void LYRA2Z(void *K, const void *in) {
+    uint64_t matrix[LYRA2_MATRIX_INT64(8, 8)];
+
+    lyra2_run(matrix, K, 32, in, 32, in, 32, 8, 8, 8);
+}
+
+/**
+ * Lyra2REv2: 32 byte key from a 32 byte input used as both password and
+ * salt, T = 1, R = 4, C = 4. The matrix is on the stack.
+ */
+void LYRA2REV2(void *K, const void *in) {
+    uint64_t matrix[LYRA2_MATRIX_INT64(4, 4)];
+
+    lyra2_run(matrix, K, 32, in, 32, in, 32, 1, 4, 4);
+}
+
+/**
+ * Picks the sponge implementation before the first hash instead of on it.
+ *
+ * @return The name of the implementation in use
+ */
+const char *LYRA2_init(void) {
+    return sponge_init();
+}
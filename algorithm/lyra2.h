@@ -37,6 +37,15 @@ typedef unsigned char byte;
         #define BLOCK_LEN_BYTES (BLOCK_LEN_INT64 * 8)    //Block length, in bytes
 #endif
 
+//Words in the memory matrix for nRows x nCols
+#define LYRA2_MATRIX_INT64(nRows, nCols) ((nRows) * (nCols) * BLOCK_LEN_INT64)
+
+const char *LYRA2_init(void);
 int LYRA2(void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols);
+void LYRA2_matrix(uint64_t *matrix, void *K, uint64_t kLen, const void *pwd, uint64_t pwdlen, const void *salt, uint64_t saltlen, uint64_t timeCost, uint64_t nRows, uint64_t nCols);
+
+//Fixed parameter versions, allocation free
+void LYRA2Z(void *K, const void *in);
+void LYRA2REV2(void *K, const void *in);
 
 #endif /* LYRA2_H_ */
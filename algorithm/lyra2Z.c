@@ -39,6 +39,7 @@
 #include "sph/sph_bmw.h"
 #include "sph/sph_cubehash.h"
 #include "lyra2.h"
+#include "blake256.h"
 
 /*
  * Encode a length len/4 vector of (uint32_t) into a length len vector of
@@ -67,7 +68,7 @@ inline void lyra2Zhash(void *state, const void *input)
 	//	printf("cpu hashA %08x %08x %08x %08x  %08x %08x %08x %08x\n",
 	//		hashA[0], hashA[1], hashA[2], hashA[3], hashA[4], hashA[5], hashA[6], hashA[7]);
 
-	LYRA2(hashB, 32, hashA, 32, hashA, 32, 8, 8, 8);
+	LYRA2Z(hashB, hashA);
 
 	//printf("cpu hashB %08x %08x %08x %08x  %08x %08x %08x %08x\n",
 	//hashB[0],hashB[1],hashB[2],hashB[3], hashB[4], hashB[5], hashB[6], hashB[7]);
@@ -112,7 +113,7 @@ inline void lyra2Zhash2(void *state, const void *input)
 	applog(LOG_ERR, "lyra2Zhash2: blake hash: %s", ob_hex);
 	free(ob_hex);
 
-	LYRA2(hashB, 32, hashA, 32, hashA, 32, 8, 8, 8);
+	LYRA2Z(hashB, hashA);
 
 	ob_hex = bin2hex((unsigned char *)hashB, 32);
 	applog(LOG_ERR, "lyra2Zhash2: lyra2 hash: %s", ob_hex);
@@ -149,16 +150,20 @@ int lyra2Z_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t non
 	return 1;
 }
 
+/* Only the 16 byte header tail changes between nonces, so Blake256 resumes
+ * from the work's cached midstate rather than hashing all 80 bytes. */
 void lyra2Z_regenhash(struct work *work)
 {
-        uint32_t data[20];
+        uint32_t tail[4], hashA[8];
         uint32_t *nonce = (uint32_t *)(work->data + 76);
         uint32_t *ohash = (uint32_t *)(work->hash);
+        const uint32_t *midstate = blake256_midstate(work);
 
-        be32enc_vect(data, (const uint32_t *)work->data, 19);
-        data[19] = htobe32(*nonce);
+        be32enc_vect(tail, (const uint32_t *)work->data + 16, 3);
+        tail[3] = htobe32(*nonce);
 
-        lyra2Zhash(ohash, data);
+        blake256_midstate_close(hashA, midstate, tail);
+        LYRA2Z(ohash, hashA);
 }
 
 bool scanhash_lyra2Z(struct thr_info *thr, const unsigned char __maybe_unused *pmidstate,
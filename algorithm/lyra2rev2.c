@@ -75,7 +75,7 @@ inline void lyra2rev2hash(void *state, const void *input)
 	sph_cubehash256(&ctx_cube, hashB, 32);
 	sph_cubehash256_close(&ctx_cube, hashA);
 
-	LYRA2(hashB, 32, hashA, 32, hashA, 32, 1, 4, 4);
+	LYRA2REV2(hashB, hashA);
 
 	sph_skein256_init(&ctx_skein);
     sph_skein256 (&ctx_skein, hashB, 32);
@@ -24,6 +24,26 @@
 #include "sponge.h"
 #include "lyra2.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPONGE_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * The permutation and the row operations that take nearly all of Lyra2's
+ * time, in one implementation per instruction set. The scalar ones below
+ * are the reference the others are checked against.
+ */
+struct sponge_impl {
+    const char *name;
+    void (*blake2b)(uint64_t *v);
+    void (*squeezeRow0)(uint64_t* state, uint64_t* rowOut, uint64_t nCols);
+    void (*duplexRow1)(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, uint64_t nCols);
+    void (*duplexRowSetup)(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols);
+    void (*duplexRow)(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols);
+};
+
+static const struct sponge_impl *sponge;
 
 
 /**
@@ -38,6 +58,10 @@
  * @param state         The 1024-bit array to be initialized
  */
 void initState(uint64_t state[/*16*/]) {
+    //Every Lyra2 run starts here, so this is where the implementation gets picked
+    if (sponge == NULL)
+      sponge_init();
+
     //First 512 bis are zeros
     memset(state, 0, 64); 
     //Remainder BLOCK_LEN_BLAKE2_SAFE_BYTES are reserved to the IV
@@ -56,7 +80,7 @@ void initState(uint64_t state[/*16*/]) {
  * 
  * @param v     A 1024-bit (16 uint64_t) array to be processed by Blake2b's G function
  */
-static void blake2bLyra(uint64_t *v) {
+static void blake2bLyra_ref(uint64_t *v) {
     ROUND_LYRA(0);
     ROUND_LYRA(1);
     ROUND_LYRA(2);
@@ -94,7 +118,7 @@ void squeeze(uint64_t *state, byte *out, unsigned int len) {
     //Squeezes full blocks
     for (i = 0; i < fullBlocks; i++) {
 	memcpy(ptr, state, BLOCK_LEN_BYTES);
-	blake2bLyra(state);
+	sponge->blake2b(state);
 	ptr += BLOCK_LEN_BYTES;
     }
 
@@ -125,7 +149,7 @@ void absorbBlock(uint64_t *state, const uint64_t *in) {
     state[11] ^= in[11];
 
     //Applies the transformation f to the sponge's state
-    blake2bLyra(state);
+    sponge->blake2b(state);
 }
 
 /**
@@ -147,7 +171,7 @@ void absorbBlockBlake2Safe(uint64_t *state, const uint64_t *in) {
     state[7] ^= in[7];
 
     //Applies the transformation f to the sponge's state
-    blake2bLyra(state);
+    sponge->blake2b(state);
 }
 
 /** 
@@ -158,7 +182,7 @@ void absorbBlockBlake2Safe(uint64_t *state, const uint64_t *in) {
  * @param state     The current state of the sponge 
  * @param rowOut    Row to receive the data squeezed
  */
-void reducedSqueezeRow0(uint64_t* state, uint64_t* rowOut, uint64_t nCols) {
+static void reducedSqueezeRow0_ref(uint64_t* state, uint64_t* rowOut, uint64_t nCols) {
     uint64_t* ptrWord = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to M[0][C-1]
     int i;
     //M[row][C-1-col] = H.reduced_squeeze()    
@@ -193,7 +217,7 @@ void reducedSqueezeRow0(uint64_t* state, uint64_t* rowOut, uint64_t nCols) {
  * @param rowIn		Row to feed the sponge
  * @param rowOut	Row to receive the sponge's output
  */
-void reducedDuplexRow1(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, uint64_t nCols) {
+static void reducedDuplexRow1_ref(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, uint64_t nCols) {
     uint64_t* ptrWordIn = rowIn;				//In Lyra2: pointer to prev
     uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
     int i;
@@ -253,7 +277,7 @@ void reducedDuplexRow1(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, uint6
  * @param rowOut         Row receiving the output
  *
  */
-void reducedDuplexRowSetup(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+static void reducedDuplexRowSetup_ref(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
     uint64_t* ptrWordIn = rowIn;				//In Lyra2: pointer to prev
     uint64_t* ptrWordInOut = rowInOut;				//In Lyra2: pointer to row*
     uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
@@ -327,7 +351,7 @@ void reducedDuplexRowSetup(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut,
  * @param rowOut         Row receiving the output
  *
  */
-void reducedDuplexRow(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+static void reducedDuplexRow_ref(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
     uint64_t* ptrWordInOut = rowInOut; //In Lyra2: pointer to row*
     uint64_t* ptrWordIn = rowIn; //In Lyra2: pointer to prev
     uint64_t* ptrWordOut = rowOut; //In Lyra2: pointer to row
@@ -388,6 +412,144 @@ void reducedDuplexRow(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint
 }
 
 
+static const struct sponge_impl sponge_scalar = {
+    "scalar", blake2bLyra_ref, reducedSqueezeRow0_ref, reducedDuplexRow1_ref,
+    reducedDuplexRowSetup_ref, reducedDuplexRow_ref
+};
+
+#ifdef SPONGE_X86
+
+//AVX2: rotations by whole bytes are shuffles, by 63 a shift and an add
+#define SIMD_FN(name) name##_avx2
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define SIMD_ROTR32(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define SIMD_ROTR24(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10, \
+    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10))
+#define SIMD_ROTR16(x) _mm256_shuffle_epi8(x, _mm256_setr_epi8( \
+    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9, \
+    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9))
+#define SIMD_ROTR63(x) _mm256_or_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x))
+#include "sponge_simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_ROTR32
+#undef SIMD_ROTR24
+#undef SIMD_ROTR16
+#undef SIMD_ROTR63
+
+//AVX-512VL: the same on 256-bit vectors with native 64-bit rotates
+#define SIMD_FN(name) name##_avx512
+#define SIMD_TARGET __attribute__((target("avx2,avx512f,avx512vl")))
+#define SIMD_ROTR32(x) _mm256_ror_epi64(x, 32)
+#define SIMD_ROTR24(x) _mm256_ror_epi64(x, 24)
+#define SIMD_ROTR16(x) _mm256_ror_epi64(x, 16)
+#define SIMD_ROTR63(x) _mm256_ror_epi64(x, 63)
+#include "sponge_simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_ROTR32
+#undef SIMD_ROTR24
+#undef SIMD_ROTR16
+#undef SIMD_ROTR63
+
+static const struct sponge_impl sponge_avx2 = {
+    "AVX2", blake2bLyra_avx2, reducedSqueezeRow0_avx2, reducedDuplexRow1_avx2,
+    reducedDuplexRowSetup_avx2, reducedDuplexRow_avx2
+};
+
+static const struct sponge_impl sponge_avx512 = {
+    "AVX-512VL", blake2bLyra_avx512, reducedSqueezeRow0_avx512, reducedDuplexRow1_avx512,
+    reducedDuplexRowSetup_avx512, reducedDuplexRow_avx512
+};
+
+#endif /* SPONGE_X86 */
+
+#define SPONGE_TEST_COLS 8
+#define SPONGE_TEST_ROW (SPONGE_TEST_COLS * BLOCK_LEN_INT64)
+
+/**
+ * Runs every operation of impl and of the scalar code over the same
+ * pseudorandom state and rows, including the row* == row case of the
+ * wandering phase, and compares the results bit for bit.
+ *
+ * @return 1 if impl matches the scalar code
+ */
+static int sponge_selftest(const struct sponge_impl *impl) {
+    uint64_t state[2][16], rows[2][3 * SPONGE_TEST_ROW];
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    int i, k;
+
+    for (k = 0; k < 2; k++) {
+      const struct sponge_impl *s = k ? impl : &sponge_scalar;
+      uint64_t *st = state[k], *r = rows[k];
+
+      //Same xorshift sequence for both
+      x = 0x9e3779b97f4a7c15ULL;
+      for (i = 0; i < 16; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        st[i] = x;
+      }
+      for (i = 0; i < 3 * SPONGE_TEST_ROW; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        r[i] = x;
+      }
+
+      s->blake2b(st);
+      s->squeezeRow0(st, r, SPONGE_TEST_COLS);
+      s->duplexRow1(st, r, r + SPONGE_TEST_ROW, SPONGE_TEST_COLS);
+      s->duplexRowSetup(st, r + SPONGE_TEST_ROW, r, r + 2 * SPONGE_TEST_ROW, SPONGE_TEST_COLS);
+      s->duplexRow(st, r, r + SPONGE_TEST_ROW, r + 2 * SPONGE_TEST_ROW, SPONGE_TEST_COLS);
+      s->duplexRow(st, r + 2 * SPONGE_TEST_ROW, r, r, SPONGE_TEST_COLS);
+      s->duplexRow(st, r, r + SPONGE_TEST_ROW, r + 2 * SPONGE_TEST_ROW, 4);
+    }
+
+    return !memcmp(state[0], state[1], sizeof(state[0])) && !memcmp(rows[0], rows[1], sizeof(rows[0]));
+}
+
+/**
+ * Picks the fastest implementation the CPU supports that passes the self
+ * test. Called on the first Lyra2 hash; calling it early from the main
+ * thread avoids threads racing to make the same choice.
+ *
+ * @return The name of the implementation in use
+ */
+const char *sponge_init(void) {
+    if (sponge != NULL)
+      return sponge->name;
+
+#ifdef SPONGE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx2") && sponge_selftest(&sponge_avx512))
+      sponge = &sponge_avx512;
+    else if (__builtin_cpu_supports("avx2") && sponge_selftest(&sponge_avx2))
+      sponge = &sponge_avx2;
+    else
+#endif
+      sponge = &sponge_scalar;
+
+    return sponge->name;
+}
+
+//---- Dispatch to the selected implementation
+
+void reducedSqueezeRow0(uint64_t* state, uint64_t* rowOut, uint64_t nCols) {
+    sponge->squeezeRow0(state, rowOut, nCols);
+}
+
+void reducedDuplexRow1(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, uint64_t nCols) {
+    sponge->duplexRow1(state, rowIn, rowOut, nCols);
+}
+
+void reducedDuplexRowSetup(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+    sponge->duplexRowSetup(state, rowIn, rowInOut, rowOut, nCols);
+}
+
+void reducedDuplexRow(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+    sponge->duplexRow(state, rowIn, rowInOut, rowOut, nCols);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
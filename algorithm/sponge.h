@@ -74,6 +74,7 @@ static inline uint64_t rotr64( const uint64_t w, const unsigned c ){
 
 
 //---- Housekeeping
+const char *sponge_init(void);
 void initState(uint64_t state[/*16*/]);
 
 //---- Squeezes
@@ -0,0 +1,196 @@
+/**
+ * Vectorised Blake2b sponge for Lyra2, included by sponge.c once per
+ * instruction set it is built for. The sponge state is held as four rows of
+ * four words, G runs on all four columns at once and the rows are rotated
+ * to work on the diagonals. A Lyra2 block is exactly the first three rows.
+ *
+ * Define before including:
+ *   SIMD_FN(name)   name of the function for this instruction set
+ *   SIMD_TARGET     function attribute enabling the instruction set
+ *   SIMD_ROTR32/24/16/63(x)  64-bit rotations right
+ *
+ * Results must be bit for bit those of the scalar code in sponge.c, which
+ * sponge_init() checks before an implementation is used.
+ *
+ * This software is hereby placed in the public domain.
+ */
+
+#define SIMD_G(a, b, c, d) \
+  do { \
+    a = _mm256_add_epi64(a, b); \
+    d = SIMD_ROTR32(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi64(c, d); \
+    b = SIMD_ROTR24(_mm256_xor_si256(b, c)); \
+    a = _mm256_add_epi64(a, b); \
+    d = SIMD_ROTR16(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi64(c, d); \
+    b = SIMD_ROTR63(_mm256_xor_si256(b, c)); \
+  } while(0)
+
+/*One round: columns, then diagonals by rotating rows 1 to 3 into place*/
+#define SIMD_ROUND(v0, v1, v2, v3) \
+  do { \
+    SIMD_G(v0, v1, v2, v3); \
+    v1 = _mm256_permute4x64_epi64(v1, _MM_SHUFFLE(0, 3, 2, 1)); \
+    v2 = _mm256_permute4x64_epi64(v2, _MM_SHUFFLE(1, 0, 3, 2)); \
+    v3 = _mm256_permute4x64_epi64(v3, _MM_SHUFFLE(2, 1, 0, 3)); \
+    SIMD_G(v0, v1, v2, v3); \
+    v1 = _mm256_permute4x64_epi64(v1, _MM_SHUFFLE(2, 1, 0, 3)); \
+    v2 = _mm256_permute4x64_epi64(v2, _MM_SHUFFLE(1, 0, 3, 2)); \
+    v3 = _mm256_permute4x64_epi64(v3, _MM_SHUFFLE(0, 3, 2, 1)); \
+  } while(0)
+
+/*rotW: the 12 word block rotated left by one word, r = {s11, s0, ..., s10}*/
+#define SIMD_ROTW(r0, r1, r2, s0, s1, s2) \
+  do { \
+    __m256i p0 = _mm256_permute4x64_epi64(s0, _MM_SHUFFLE(2, 1, 0, 3)); \
+    __m256i p1 = _mm256_permute4x64_epi64(s1, _MM_SHUFFLE(2, 1, 0, 3)); \
+    __m256i p2 = _mm256_permute4x64_epi64(s2, _MM_SHUFFLE(2, 1, 0, 3)); \
+    r0 = _mm256_blend_epi32(p0, p2, 0x03); \
+    r1 = _mm256_blend_epi32(p1, p0, 0x03); \
+    r2 = _mm256_blend_epi32(p2, p1, 0x03); \
+  } while(0)
+
+#define SIMD_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define SIMD_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+
+#define SIMD_LOAD_STATE(s) \
+  __m256i v0 = SIMD_LOAD(s), v1 = SIMD_LOAD(s + 4), v2 = SIMD_LOAD(s + 8), v3 = SIMD_LOAD(s + 12)
+
+#define SIMD_STORE_STATE(s) \
+  do { \
+    SIMD_STORE(s, v0); \
+    SIMD_STORE(s + 4, v1); \
+    SIMD_STORE(s + 8, v2); \
+    SIMD_STORE(s + 12, v3); \
+  } while(0)
+
+static SIMD_TARGET void SIMD_FN(blake2bLyra)(uint64_t *v) {
+    SIMD_LOAD_STATE(v);
+    int i;
+
+    for (i = 0; i < 12; i++)
+      SIMD_ROUND(v0, v1, v2, v3);
+
+    SIMD_STORE_STATE(v);
+}
+
+static SIMD_TARGET void SIMD_FN(reducedSqueezeRow0)(uint64_t* state, uint64_t* rowOut, uint64_t nCols) {
+    uint64_t* ptrWord = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to M[0][C-1]
+    SIMD_LOAD_STATE(state);
+    int i;
+
+    for (i = 0; i < nCols; i++) {
+      SIMD_STORE(ptrWord, v0);
+      SIMD_STORE(ptrWord + 4, v1);
+      SIMD_STORE(ptrWord + 8, v2);
+      ptrWord -= BLOCK_LEN_INT64;
+
+      SIMD_ROUND(v0, v1, v2, v3);
+    }
+
+    SIMD_STORE_STATE(state);
+}
+
+static SIMD_TARGET void SIMD_FN(reducedDuplexRow1)(uint64_t *state, uint64_t *rowIn, uint64_t *rowOut, uint64_t nCols) {
+    uint64_t* ptrWordIn = rowIn;				//In Lyra2: pointer to prev
+    uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
+    SIMD_LOAD_STATE(state);
+    int i;
+
+    for (i = 0; i < nCols; i++) {
+      __m256i in0 = SIMD_LOAD(ptrWordIn), in1 = SIMD_LOAD(ptrWordIn + 4), in2 = SIMD_LOAD(ptrWordIn + 8);
+
+      v0 = _mm256_xor_si256(v0, in0);
+      v1 = _mm256_xor_si256(v1, in1);
+      v2 = _mm256_xor_si256(v2, in2);
+
+      SIMD_ROUND(v0, v1, v2, v3);
+
+      SIMD_STORE(ptrWordOut, _mm256_xor_si256(in0, v0));
+      SIMD_STORE(ptrWordOut + 4, _mm256_xor_si256(in1, v1));
+      SIMD_STORE(ptrWordOut + 8, _mm256_xor_si256(in2, v2));
+
+      ptrWordIn += BLOCK_LEN_INT64;
+      ptrWordOut -= BLOCK_LEN_INT64;
+    }
+
+    SIMD_STORE_STATE(state);
+}
+
+static SIMD_TARGET void SIMD_FN(reducedDuplexRowSetup)(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+    uint64_t* ptrWordIn = rowIn;				//In Lyra2: pointer to prev
+    uint64_t* ptrWordInOut = rowInOut;				//In Lyra2: pointer to row*
+    uint64_t* ptrWordOut = rowOut + (nCols-1)*BLOCK_LEN_INT64; //In Lyra2: pointer to row
+    SIMD_LOAD_STATE(state);
+    int i;
+
+    for (i = 0; i < nCols; i++) {
+      __m256i in0 = SIMD_LOAD(ptrWordIn), in1 = SIMD_LOAD(ptrWordIn + 4), in2 = SIMD_LOAD(ptrWordIn + 8);
+      __m256i io0 = SIMD_LOAD(ptrWordInOut), io1 = SIMD_LOAD(ptrWordInOut + 4), io2 = SIMD_LOAD(ptrWordInOut + 8);
+      __m256i r0, r1, r2;
+
+      v0 = _mm256_xor_si256(v0, _mm256_add_epi64(in0, io0));
+      v1 = _mm256_xor_si256(v1, _mm256_add_epi64(in1, io1));
+      v2 = _mm256_xor_si256(v2, _mm256_add_epi64(in2, io2));
+
+      SIMD_ROUND(v0, v1, v2, v3);
+
+      SIMD_STORE(ptrWordOut, _mm256_xor_si256(in0, v0));
+      SIMD_STORE(ptrWordOut + 4, _mm256_xor_si256(in1, v1));
+      SIMD_STORE(ptrWordOut + 8, _mm256_xor_si256(in2, v2));
+
+      SIMD_ROTW(r0, r1, r2, v0, v1, v2);
+      SIMD_STORE(ptrWordInOut, _mm256_xor_si256(io0, r0));
+      SIMD_STORE(ptrWordInOut + 4, _mm256_xor_si256(io1, r1));
+      SIMD_STORE(ptrWordInOut + 8, _mm256_xor_si256(io2, r2));
+
+      ptrWordInOut += BLOCK_LEN_INT64;
+      ptrWordIn += BLOCK_LEN_INT64;
+      ptrWordOut -= BLOCK_LEN_INT64;
+    }
+
+    SIMD_STORE_STATE(state);
+}
+
+static SIMD_TARGET void SIMD_FN(reducedDuplexRow)(uint64_t *state, uint64_t *rowIn, uint64_t *rowInOut, uint64_t *rowOut, uint64_t nCols) {
+    uint64_t* ptrWordInOut = rowInOut; //In Lyra2: pointer to row*
+    uint64_t* ptrWordIn = rowIn; //In Lyra2: pointer to prev
+    uint64_t* ptrWordOut = rowOut; //In Lyra2: pointer to row
+    SIMD_LOAD_STATE(state);
+    int i;
+
+    for (i = 0; i < nCols; i++) {
+      __m256i r0, r1, r2;
+
+      v0 = _mm256_xor_si256(v0, _mm256_add_epi64(SIMD_LOAD(ptrWordIn), SIMD_LOAD(ptrWordInOut)));
+      v1 = _mm256_xor_si256(v1, _mm256_add_epi64(SIMD_LOAD(ptrWordIn + 4), SIMD_LOAD(ptrWordInOut + 4)));
+      v2 = _mm256_xor_si256(v2, _mm256_add_epi64(SIMD_LOAD(ptrWordIn + 8), SIMD_LOAD(ptrWordInOut + 8)));
+
+      SIMD_ROUND(v0, v1, v2, v3);
+
+      SIMD_STORE(ptrWordOut, _mm256_xor_si256(SIMD_LOAD(ptrWordOut), v0));
+      SIMD_STORE(ptrWordOut + 4, _mm256_xor_si256(SIMD_LOAD(ptrWordOut + 4), v1));
+      SIMD_STORE(ptrWordOut + 8, _mm256_xor_si256(SIMD_LOAD(ptrWordOut + 8), v2));
+
+      //row* may be the same row as the output, so it is read after that store
+      SIMD_ROTW(r0, r1, r2, v0, v1, v2);
+      SIMD_STORE(ptrWordInOut, _mm256_xor_si256(SIMD_LOAD(ptrWordInOut), r0));
+      SIMD_STORE(ptrWordInOut + 4, _mm256_xor_si256(SIMD_LOAD(ptrWordInOut + 4), r1));
+      SIMD_STORE(ptrWordInOut + 8, _mm256_xor_si256(SIMD_LOAD(ptrWordInOut + 8), r2));
+
+      ptrWordOut += BLOCK_LEN_INT64;
+      ptrWordInOut += BLOCK_LEN_INT64;
+      ptrWordIn += BLOCK_LEN_INT64;
+    }
+
+    SIMD_STORE_STATE(state);
+}
+
+#undef SIMD_G
+#undef SIMD_ROUND
+#undef SIMD_ROTW
+#undef SIMD_LOAD
+#undef SIMD_STORE
+#undef SIMD_LOAD_STATE
+#undef SIMD_STORE_STATE
@@ -218,6 +218,8 @@ struct CODES codes[] = {
 
  { SEVERITY_SUCC,  MSG_CHPOOLPR, PARAM_BOTH, "Changed pool %d to profile '%s'" },
 
+ { SEVERITY_SUCC,  MSG_LATENCY, PARAM_NONE, "Share latency" },
+
  { SEVERITY_SUCC,  MSG_BYE,   PARAM_STR,  "%s" },
  { SEVERITY_FAIL, 0, (enum code_parameters)0, NULL }
 };
@@ -1554,6 +1556,24 @@ static void gpudev(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
     io_close(io_data);
 }
 
+/* Count, Avg, Max and Histogram items for a latency histogram, in ms */
+static struct api_data *api_add_lat_hist(struct api_data *root, const char *prefix, struct lat_hist *hist)
+{
+  double avg = hist->count ? hist->total_ms / hist->count : 0;
+  char name[64], str[256];
+
+  snprintf(name, sizeof(name), "%s Count", prefix);
+  root = api_add_uint64(root, name, &(hist->count), false);
+  snprintf(name, sizeof(name), "%s Avg", prefix);
+  root = api_add_double(root, name, &avg, true);
+  snprintf(name, sizeof(name), "%s Max", prefix);
+  root = api_add_double(root, name, &(hist->max_ms), false);
+  snprintf(name, sizeof(name), "%s Histogram", prefix);
+  root = api_add_string(root, name, lat_hist_str(hist, str, sizeof(str)), true);
+
+  return root;
+}
+
 static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
   struct api_data *root = NULL;
@@ -1655,6 +1675,9 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
     double stalep = (pool->diff_accepted + pool->diff_rejected + pool->diff_stale) ?
         (double)(pool->diff_stale) / (double)(pool->diff_accepted + pool->diff_rejected + pool->diff_stale) : 0;
     root = api_add_percent(root, "Pool Stale%", &stalep, false);
+    root = api_add_int(root, "Shares In Flight", &(pool->sshares), false);
+    root = api_add_uint(root, "Shares Expired", &(pool->shares_expired), false);
+    root = api_add_lat_hist(root, "Share RTT", &(pool->share_lat[SHARE_STAGE_POOL]));
 
     root = print_data(root, buf, isjson, isjson && (i > 0));
     io_add(io_data, buf);
@@ -1702,6 +1725,12 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
   root = api_add_int(root, "Stale", &(total_stale), true);
   root = api_add_uint(root, "Get Failures", &(total_go), true);
   root = api_add_uint(root, "Local Work", &(local_work), true);
+  root = api_add_uint(root, "Work Allocs", &(total_work_allocs), true);
+  root = api_add_uint(root, "Work Reused", &(total_work_reused), true);
+  root = api_add_uint(root, "Work Strings", &(total_rstr_allocs), true);
+  root = api_add_uint(root, "Stale Checks", &(stale_checks), true);
+  root = api_add_double(root, "Stale Checks/s", &(stale_check_rate), true);
+  root = api_add_uint(root, "Log Drops", &(log_drops), true);
   root = api_add_uint(root, "Remote Failures", &(total_ro), true);
   root = api_add_uint(root, "Network Blocks", &(new_blocks), true);
   root = api_add_mhtotal(root, "Total MH", &(total_mhashes_done), true);
@@ -2701,6 +2730,12 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct sgminer_st
     root = api_add_uint64(root, "Bytes Recv", &(pool_stats->bytes_received), false);
     root = api_add_uint64(root, "Net Bytes Sent", &(pool_stats->net_bytes_sent), false);
     root = api_add_uint64(root, "Net Bytes Recv", &(pool_stats->net_bytes_received), false);
+    root = api_add_uint64(root, "Recv Calls", &(pool_stats->recv_calls), false);
+    root = api_add_uint64(root, "Send Calls", &(pool_stats->send_calls), false);
+    root = api_add_uint64(root, "Share Sends", &(pool_stats->share_sends), false);
+    root = api_add_uint64(root, "Shares Sent", &(pool_stats->shares_sent), false);
+    root = api_add_uint32(root, "Max Share Batch", &(pool_stats->share_batch_max), false);
+    root = api_add_uint32(root, "Share Queue", &(pool_stats->share_queue), false);
   }
 
   if (extra)
@@ -2751,6 +2786,61 @@ static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
     io_close(io_data);
 }
 
+/* restart_lat is only there for devices */
+static int itemlatency(struct io_data *io_data, int i, char *id, struct lat_hist *share_lat, struct lat_hist *restart_lat, bool isjson)
+{
+  struct api_data *root = NULL;
+  char buf[TMPBUFSIZ];
+  int j;
+
+  root = api_add_int(root, "LATENCY", &i, false);
+  root = api_add_string(root, "ID", id, false);
+  for (j = 0; j < SHARE_STAGES; j++)
+    root = api_add_lat_hist(root, (char *)share_stage_names[j], &share_lat[j]);
+  if (restart_lat)
+    root = api_add_lat_hist(root, "Restart", restart_lat);
+
+  root = print_data(root, buf, isjson, isjson && (i > 0));
+  io_add(io_data, buf);
+
+  return ++i;
+}
+
+static void sharelatency(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+  struct cgpu_info *cgpu;
+  bool io_open = false;
+  char id[20];
+  int i, j;
+
+  message(io_data, MSG_LATENCY, 0, NULL, isjson);
+
+  if (isjson)
+    io_open = io_add(io_data, COMSTR JSON_LATENCY);
+
+  i = 0;
+  for (j = 0; j < total_devices; j++) {
+    cgpu = get_devices(j);
+
+    if (cgpu && cgpu->drv && (!opt_removedisabled || cgpu->deven != DEV_DISABLED)) {
+      sprintf(id, "%s%d", cgpu->drv->name, cgpu->device_id);
+      i = itemlatency(io_data, i, id, cgpu->share_lat, &(cgpu->restart_lat), isjson);
+    }
+  }
+
+  for (j = 0; j < total_pools; j++) {
+    struct pool *pool = pools[j];
+
+    if (pool->removed)
+      continue;
+    sprintf(id, "POOL%d", j);
+    i = itemlatency(io_data, i, id, pool->share_lat, NULL, isjson);
+  }
+
+  if (isjson && io_open)
+    io_close(io_data);
+}
+
 static void failoveronly(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
   if (param == NULL || *param == '\0') {
@@ -3013,6 +3103,7 @@ struct CMDS {
   { "setconfig",    setconfig,  true, false },
   { "zero",   dozero,   true, false },
   { "lockstats",    lockstats,  true, true },
+  { "sharelatency", sharelatency, false,  true },
   { NULL,     NULL,   false,  false }
 };
 
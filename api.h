@@ -38,6 +38,7 @@
 #define _MINECOIN "COIN"
 #define _DEBUGSET "DEBUG"
 #define _SETCONFIG  "SETCONFIG"
+#define _LATENCY  "LATENCY"
 
 #define JSON0   "{"
 #define JSON1   "\""
@@ -67,6 +68,7 @@
 #define JSON_MINECOIN JSON1 _MINECOIN JSON2
 #define JSON_DEBUGSET JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG  JSON1 _SETCONFIG JSON2
+#define JSON_LATENCY  JSON1 _LATENCY JSON2
 
 #define JSON_END  JSON4 JSON5
 #define JSON_END_TRUNCATED  JSON4_TRUNCATED JSON5
@@ -186,6 +188,8 @@
 #define MSG_INVRAWINT 142
 #define MSG_GPURAWINT 143
 
+#define MSG_LATENCY 144
+
 enum code_severity {
   SEVERITY_ERR,
   SEVERITY_WARN,
@@ -0,0 +1,174 @@
+/*
+ * Copyright 2014 sgminer developers (see AUTHORS.md)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <sched.h>
+#endif
+
+#include "compat.h"
+#include "miner.h"
+#include "config_parser.h"
+#include "driver-cpu.h"
+#include "findnonce.h"
+#include "algorithm/lyra2.h"
+
+/* Nonces hashed between checks for a work restart */
+#define CPU_SCAN_BATCH 256
+
+int opt_cpu_threads;
+
+static struct cgpu_info cpu_cgpu;
+
+static int cpu_cores(void)
+{
+#ifdef WIN32
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* All threads share one device so the statline and API show the host as
+ * a whole; each thread works on its own work item. */
+static void cpu_detect(void)
+{
+  struct cgpu_info *cgpu = &cpu_cgpu;
+
+  if (opt_cpu_threads <= 0)
+    return;
+
+  cgpu->deven = DEV_ENABLED;
+  cgpu->drv = &cpu_drv;
+  cgpu->device_id = 0;
+  cgpu->threads = opt_cpu_threads;
+  cgpu->algorithm = default_profile.algorithm;
+  add_cgpu(cgpu);
+
+  applog(LOG_NOTICE, "CPU: %d mining thread(s) on %d core(s)", opt_cpu_threads, cpu_cores());
+
+  /* Pick the sponge before the mining threads all reach their first hash */
+  applog(LOG_INFO, "CPU: hashing Lyra2 with the %s sponge", LYRA2_init());
+}
+
+/* Only algorithms whose share check is a plain regenhash of the header with
+ * a 32 bit nonce can be scanned here. */
+static bool cpu_algorithm_supported(const algorithm_t *algorithm)
+{
+  switch (algorithm->type) {
+    case ALGO_ETHASH:
+    case ALGO_EQUIHASH:
+    case ALGO_CRYPTONIGHT:
+      return false;
+    default:
+      return algorithm->regenhash != NULL;
+  }
+}
+
+/* Pin each thread to its own core, wrapping round when there are more
+ * threads than cores. */
+static bool cpu_thread_init(struct thr_info *thr)
+{
+  struct cgpu_info *cgpu = thr->cgpu;
+  int core = thr->device_thread % cpu_cores();
+
+#if defined(WIN32)
+  SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core);
+#elif defined(CPU_SET)
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    applog(LOG_INFO, "%s%d: Failed to pin thread %d to core %d", cgpu->drv->name, cgpu->device_id, thr->id, core);
+#endif
+  applog(LOG_DEBUG, "%s%d: Thread %d on core %d", cgpu->drv->name, cgpu->device_id, thr->id, core);
+
+  if (!cpu_algorithm_supported(&cgpu->algorithm))
+    applog(LOG_WARNING, "%s%d: No CPU hash for %s, the CPU will not mine it",
+           cgpu->drv->name, cgpu->device_id, cgpu->algorithm.name);
+
+  return true;
+}
+
+/* hash_sole_work scales this so a scan takes a few seconds */
+static uint64_t cpu_can_limit_work(struct thr_info __maybe_unused *thr)
+{
+  return 0xfff;
+}
+
+/* Hash nonces from work->blk.nonce up to max_nonce, checking for a restart
+ * between batches. Every nonce meeting diff 1 goes through the same
+ * submission path as device nonces. */
+static int64_t cpu_scanhash(struct thr_info *thr, struct work *work, int64_t max_nonce)
+{
+  uint32_t first = work->blk.nonce, nonce = first;
+  uint32_t last = max_nonce > (int64_t)MAXTHREADS ? (uint32_t)MAXTHREADS : (uint32_t)max_nonce;
+
+  if (unlikely(!cpu_algorithm_supported(&work->pool->algorithm))) {
+    /* Idle rather than fail so switching back to a supported pool
+     * resumes mining */
+    cgsleep_ms(1000);
+    return 0;
+  }
+
+  while (nonce < last && !thr->work_restart) {
+    uint32_t end = last - nonce > CPU_SCAN_BATCH ? nonce + CPU_SCAN_BATCH : last;
+
+    for (; nonce < end; nonce++) {
+      if (unlikely(test_nonce(work, nonce)))
+        submit_tested_work(thr, work);
+    }
+  }
+
+  work->blk.nonce = nonce;
+  return nonce - first;
+}
+
+struct device_drv cpu_drv = {
+  /*.drv_id = */            DRIVER_cpu,
+  /*.dname = */             "cpu",
+  /*.name = */              "CPU",
+  /*.drv_detect = */        cpu_detect,
+  /*.reinit_device = */     NULL,
+  /*.get_statline_before =*/NULL,
+  /*.get_statline = */      NULL,
+  /*.api_data = */          NULL,
+  /*.get_stats = */         NULL,
+  /*.identify_device = */   NULL,
+  /*.set_device = */        NULL,
+
+  /*.thread_prepare = */    NULL,
+  /*.can_limit_work = */    cpu_can_limit_work,
+  /*.thread_init = */       cpu_thread_init,
+  /*.prepare_work = */      NULL,
+  /*.hash_work = */         NULL,
+  /*.scanhash = */          cpu_scanhash,
+  /*.scanwork = */          NULL,
+  /*.queue_full = */        NULL,
+  /*.flush_work = */        NULL,
+  /*.update_work = */       NULL,
+  /*.hw_error = */          NULL,
+  /*.thread_shutdown = */   NULL,
+  /*.thread_enable = */     NULL,
+  /*.zero_stats = */        NULL,
+  /*.copy = */              false,
+  /*.max_diff = */          1,
+  /*.working_diff = */      1,
+};
@@ -0,0 +1,12 @@
+#ifndef DEVICE_CPU_H
+#define DEVICE_CPU_H
+
+#include "miner.h"
+
+/* Host CPU hashing with the algorithm table's regenhash, set with
+ * --cpu-threads. Off by default. */
+extern int opt_cpu_threads;
+
+extern struct device_drv cpu_drv;
+
+#endif /* DEVICE_CPU_H */
@@ -23,6 +23,15 @@
 
 #ifndef WIN32
 #include <sys/resource.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#ifdef __linux__
+#include <asm/ioctls.h>
+#endif
 #endif
 #include <ccan/opt/opt.h>
 
@@ -35,15 +44,24 @@
 #include "adl.h"
 #include "util.h"
 #include "sysfs-gpu-controls.h"
+#include "reactor.h"
 
 #include "algorithm/equihash.h"
+#include "algorithm/blake256.h"
+#include "algorithm/lyra2.h"
+
+#ifndef WIN32
+#define _read read
+#define _write write
+#define _close close
+#endif
 
 /* TODO: cleanup externals ********************/
 
-double fpga_vint[8];
-double fpga_temp[8];
-int fpga_freq[8];
-int fpga_cores[8];
+double fpga_vint[MAX_FPGA_DEVICES];
+double fpga_temp[MAX_FPGA_DEVICES];
+int fpga_freq[MAX_FPGA_DEVICES];
+int fpga_cores[MAX_FPGA_DEVICES];
 int dev_timeout;
 int fpga_clock;
 
@@ -390,6 +408,101 @@ void manage_gpu(void)
 
 /*****************************************************************************************/
 
+#ifndef WIN32
+/* Map a rate onto its termios Bxxx constant, 0 if there isn't one */
+static speed_t serial_speed(unsigned long baud)
+{
+	switch (baud) {
+	case 1200:	return B1200;
+	case 2400:	return B2400;
+	case 4800:	return B4800;
+	case 9600:	return B9600;
+	case 19200:	return B19200;
+	case 38400:	return B38400;
+	case 57600:	return B57600;
+	case 115200:	return B115200;
+#ifdef B230400
+	case 230400:	return B230400;
+#endif
+#ifdef B460800
+	case 460800:	return B460800;
+#endif
+#ifdef B500000
+	case 500000:	return B500000;
+#endif
+#ifdef B576000
+	case 576000:	return B576000;
+#endif
+#ifdef B921600
+	case 921600:	return B921600;
+#endif
+#ifdef B1000000
+	case 1000000:	return B1000000;
+#endif
+#ifdef B1152000
+	case 1152000:	return B1152000;
+#endif
+#ifdef B1500000
+	case 1500000:	return B1500000;
+#endif
+#ifdef B2000000
+	case 2000000:	return B2000000;
+#endif
+#ifdef B2500000
+	case 2500000:	return B2500000;
+#endif
+#ifdef B3000000
+	case 3000000:	return B3000000;
+#endif
+#ifdef B3500000
+	case 3500000:	return B3500000;
+#endif
+#ifdef B4000000
+	case 4000000:	return B4000000;
+#endif
+	}
+	return 0;
+}
+
+#if defined(__linux__) && defined(TCGETS2)
+#define SERIAL_CUSTOM_BAUD
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+
+/* The kernel's termios2, glibc does not export it */
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+
+/* Rates without a Bxxx constant, e.g. what a USB UART divides down to
+ * exactly, are passed straight to the driver with BOTHER. */
+static bool serial_set_custom_baud(int fd, unsigned long baud)
+{
+	struct termios2 tio2;
+
+	if (ioctl(fd, TCGETS2, &tio2))
+		return false;
+	tio2.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio2.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio2.c_ispeed = baud;
+	tio2.c_ospeed = baud;
+	return !ioctl(fd, TCSETS2, &tio2);
+}
+#endif
+#endif /* WIN32 */
+
 int serial_open(const char *devpath, unsigned long baud, signed short timeout, bool purge)
 {
 #ifdef WIN32
@@ -447,6 +560,8 @@ int serial_open(const char *devpath, unsigned long baud, signed short timeout, b
 	return _open_osfhandle((intptr_t)hSerial, 0);
 #else
 	int fdDev = open(devpath, O_RDWR | O_CLOEXEC | O_NOCTTY);
+	bool custom_baud = false;
+	speed_t speed;
 
 	if (unlikely(fdDev == -1))
 	{
@@ -466,30 +581,16 @@ int serial_open(const char *devpath, unsigned long baud, signed short timeout, b
 	termios_debug(devpath, &my_termios, "before");
 #endif
 
-	switch (baud) {
-	case 0:
-		break;
-	case 19200:
-		cfsetispeed(&my_termios, B19200);
-		cfsetospeed(&my_termios, B19200);
-		break;
-	case 38400:
-		cfsetispeed(&my_termios, B38400);
-		cfsetospeed(&my_termios, B38400);
-		break;
-	case 57600:
-		cfsetispeed(&my_termios, B57600);
-		cfsetospeed(&my_termios, B57600);
-		break;
-	case 115200:
-		cfsetispeed(&my_termios, B115200);
-		cfsetospeed(&my_termios, B115200);
-		break;
-		// TODO: try some higher speeds with the Icarus and BFL to see
-		// if they support them and if setting them makes any difference
-		// N.B. B3000000 doesn't work on Icarus
-	default:
+	speed = serial_speed(baud);
+	if (speed) {
+		cfsetispeed(&my_termios, speed);
+		cfsetospeed(&my_termios, speed);
+	} else if (baud) {
+#ifdef SERIAL_CUSTOM_BAUD
+		custom_baud = true;
+#else
 		applog(LOG_WARNING, "Unrecognized baud rate: %lu", baud);
+#endif
 	}
 
 	my_termios.c_cflag &= ~(CSIZE | PARENB);
@@ -512,6 +613,11 @@ int serial_open(const char *devpath, unsigned long baud, signed short timeout, b
 
 	tcsetattr(fdDev, TCSANOW, &my_termios);
 
+#ifdef SERIAL_CUSTOM_BAUD
+	if (custom_baud && !serial_set_custom_baud(fdDev, baud))
+		applog(LOG_WARNING, "Failed to set baud rate %lu on %s, errno:%d", baud, devpath, errno);
+#endif
+
 #ifdef TERMIOS_DEBUG
 	tcgetattr(fdDev, &my_termios);
 	termios_debug(devpath, &my_termios, "after");
@@ -523,57 +629,202 @@ int serial_open(const char *devpath, unsigned long baud, signed short timeout, b
 #endif
 }
 
-size_t _serial_read(int fd, char *buf, size_t bufsiz, char *eol)
+#define FPGA_FRAME_SIZE 8
+/* Must be a power of two, the indices below are free running */
+#define FPGA_RING_SIZE 256
+/* Bytes of one frame arrive back to back, anything left over from a partial
+ * frame for longer than this was line noise or a frame missing bytes. */
+#define FPGA_FRAME_GAP_MS 50
+
+/* Receive buffer between the serial port and the frame parser. Each fill is
+ * a single syscall for as many bytes as the port has queued. */
+struct fpga_ring {
+	unsigned char buf[FPGA_RING_SIZE];
+	unsigned int head, tail;
+	struct timeval last_rx;
+	unsigned int resyncs;
+};
+
+static inline unsigned int fpga_ring_used(const struct fpga_ring *r)
 {
-	size_t len, tlen = 0;
-	while (bufsiz) {
-		len = _read(fd, buf, eol ? 1 : bufsiz);
-		if (unlikely(len == -1))
-			break;
-		tlen += len;
-		if (eol && *eol == buf[0])
-			break;
-		buf += len;
-		bufsiz -= len;
-	}
-	return tlen;
+	return r->head - r->tail;
+}
+
+static void fpga_ring_reset(struct fpga_ring *r)
+{
+	r->head = r->tail = 0;
+}
+
+static void fpga_ring_peek(const struct fpga_ring *r, unsigned int off, unsigned char *out, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		out[i] = r->buf[(r->tail + off + i) & (FPGA_RING_SIZE - 1)];
 }
 
-int serial_recv(int fd, char *buf, size_t bufsize, size_t *readlen)
+static inline void fpga_ring_drop(struct fpga_ring *r, unsigned int len)
 {
-	BOOL Status;
-	DWORD dwEventMask = 0;
-	const HANDLE fh = (HANDLE)_get_osfhandle(fd);
+	r->tail += len;
+}
 
-	/*	Status = WaitCommEvent(fh, &dwEventMask, NULL); //Wait for the character to be received
+/* Returns the number of bytes read, 0 if nothing arrived before the port
+ * timeout (or EAGAIN on a non-blocking port) and -1 on error. */
+static int fpga_ring_fill(int fd, struct fpga_ring *r)
+{
+	unsigned int used = fpga_ring_used(r);
+	unsigned int head, space, contig;
+	struct timeval now;
+	int ret;
+
+	/* Either the rest of a partial frame is never coming, so whatever
+	 * arrives next starts a new one, or the parser is not keeping up and
+	 * nothing buffered can be trusted. */
+	cgtime(&now);
+	if (unlikely(used == FPGA_RING_SIZE ||
+		     (used && used < FPGA_FRAME_SIZE && ms_tdiff(&now, &r->last_rx) > FPGA_FRAME_GAP_MS))) {
+		fpga_ring_reset(r);
+		r->resyncs++;
+	}
 
-	if (Status == FALSE) {
-	printf("\n    Error! in Setting WaitCommEvent()");
-	return(-1);
-	}*/
+	head = r->head & (FPGA_RING_SIZE - 1);
+	space = FPGA_RING_SIZE - fpga_ring_used(r);
+	contig = MIN(space, FPGA_RING_SIZE - head);
 
-	DWORD NoBytesRead = 0;
-	char TempChar;
-	int len = 0;
+#ifdef WIN32
+	{
+		const HANDLE fh = (HANDLE)_get_osfhandle(fd);
+		DWORD errors, want, got = 0;
+		COMSTAT stat;
+
+		/* Take everything queued, or wait on the port timeouts for one
+		 * frame's worth when the queue is empty. */
+		if (!ClearCommError(fh, &errors, &stat))
+			return -1;
+		want = stat.cbInQue ? stat.cbInQue : FPGA_FRAME_SIZE;
+		if (want > contig)
+			want = contig;
+		if (!ReadFile(fh, r->buf + head, want, &got, NULL))
+			return -1;
+		ret = (int)got;
+	}
+#else
+	{
+		struct iovec iov[2];
+
+		iov[0].iov_base = r->buf + head;
+		iov[0].iov_len = contig;
+		iov[1].iov_base = r->buf;
+		iov[1].iov_len = space - contig;
+
+		do {
+			ret = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+#endif
 
-	do {
-		Status = ReadFile(fh, &TempChar, sizeof(TempChar), &NoBytesRead, NULL);
+	if (ret > 0) {
+		r->head += ret;
+		cgtime(&r->last_rx);
+	}
 
-		buf[len++] = TempChar;
+	return ret;
+}
 
-		if (len == bufsize)
-			break;
+/* Longest a job upload waits for room in the port's output queue */
+#define FPGA_WRITE_TIMEOUT_MS 1000
 
-	} while (NoBytesRead > 0);
+/* Writes all of buf, waiting for room when the port is non-blocking. A
+ * board that got part of a job frame has lost sync, so anything short of
+ * the whole frame is an error. */
+static bool fpga_write(int fd, const unsigned char *buf, size_t len)
+{
+#ifdef WIN32
+	return _write(fd, buf, len) == (int)len;
+#else
+	struct pollfd pfd;
+	ssize_t ret;
 
-	*readlen = (size_t)len;
-	return(0);
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret > 0) {
+			buf += ret;
+			len -= ret;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return false;
+
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		do {
+			ret = poll(&pfd, 1, FPGA_WRITE_TIMEOUT_MS);
+		} while (ret < 0 && errno == EINTR);
+		if (ret <= 0 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+			return false;
+	}
+	return true;
+#endif
 }
 
-extern char devpath[8][512];
-extern int devbaud;
+extern char devpath[MAX_FPGA_DEVICES][512];
+extern int devbaud[MAX_FPGA_DEVICES];
 extern int devtimeout;
+extern bool opt_fpga_reactor;
+extern bool opt_fpga_baud_test;
+
+/* blake256 midstate, header tail and top target word */
+#define FPGA_JOB_SIZE 52
+
+/* Clocks a core spends on one Lyra2Z hash in the current bitstream */
+#define FPGA_CLOCKS_PER_HASH 2400
+/* Verified nonces needed before the share rate may correct the telemetry */
+#define FPGA_RATE_MIN_NONCES 32
+/* Past this many the share window is halved so it follows rate changes */
+#define FPGA_RATE_MAX_NONCES 512
+
+/* Per-board state, allocated once at detect time so that flush_work and the
+ * serial reactor never race with a mining thread restart. */
+struct fpga_info {
+	struct thr_info *thr;
+	bool reactor;
+
+	/* Protects work and is used to wake the mining thread when the job
+	 * on the board is finished or has to be replaced. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct work *work;
+	int nonces;
+	bool comms_error;
+
+	/* Taken by queue_full with its job upload built so it can be sent
+	 * the moment the running job ends. Only the mining thread uses it. */
+	struct work *next;
+	unsigned char next_job[FPGA_JOB_SIZE];
+
+	struct timeval tv_job;
+	struct timeval tv_hashes;
+	int timeout;
+
+	/* Hash rate estimate, see fpga_update_rate() */
+	double nominal_hs;	// cores x clock from telemetry
+	double share_hashes;	// expected hashes behind the verified nonces
+	double share_nonces;
+	double share_secs;
+	double est_hs;
+
+	struct fpga_ring rx;
+};
 
+/* One thread owns every FPGA serial port when epoll is available */
+static struct reactor *fpga_reactor;
+
+/* Boards are numbered by port, which goes past MAX_GPUDEVICES */
+static struct cgpu_info fpgas[MAX_FPGA_DEVICES];
 
 //add one fpga manually for now
 static void fpga_detect(void)
@@ -581,16 +832,17 @@ static void fpga_detect(void)
 	//detect FPGA cards
 
 	struct cgpu_info *cgpu;
+	struct fpga_info *info;
 
 	opt_g_threads = 1;
 
 	opencl_drv.max_diff = 65536;
 
-	int i;
+	int i, found = 0;
 
-	for (i = 0; i < 8; i++) {
+	for (i = 0; i < MAX_FPGA_DEVICES; i++) {
 		if (devpath[i][0]) {
-			cgpu = &gpus[i];
+			cgpu = &fpgas[i];
 			cgpu->deven = DEV_ENABLED;
 			cgpu->drv = &opencl_drv;
 			cgpu->thr = NULL;
@@ -599,10 +851,30 @@ static void fpga_detect(void)
 			cgpu->threads = opt_g_threads;
 			cgpu->virtual_gpu = i;
 			cgpu->algorithm = default_profile.algorithm;
+
+			info = (struct fpga_info *)calloc(1, sizeof(*info));
+			if (unlikely(!info))
+				quit(1, "Failed to calloc fpga_info");
+			mutex_init(&info->lock);
+			if (unlikely(pthread_cond_init(&info->cond, NULL)))
+				quit(1, "Failed to pthread_cond_init fpga_info");
+			cgpu->device_data = info;
+
 			add_cgpu(cgpu);
+			found++;
 			applog(LOG_WARNING, "fpga_detect(): adding %s", devpath[i]);
 		}
 	}
+
+	/* Every nonce is checked on the CPU, pick the sponge up front */
+	if (found)
+		applog(LOG_INFO, "Verifying FPGA nonces with the %s Lyra2 sponge", LYRA2_init());
+
+	if (opt_fpga_reactor && found && !fpga_reactor) {
+		fpga_reactor = reactor_new("SerialReactor");
+		if (!fpga_reactor)
+			applog(LOG_WARNING, "Serial reactor unavailable, polling each FPGA from its own thread");
+	}
 }
 
 static void reinit_fpga_device(struct cgpu_info *gpu)
@@ -650,9 +922,146 @@ static bool fpga_thread_prepare(struct thr_info *thr)
 	return true;
 }
 
+static uint32_t fpga_frame_nonce(const unsigned char *buf)
+{
+	uint32_t nonce;
+
+	memcpy((char *)&nonce, buf, 4);
+
+	return swab32(nonce);
+}
+
+static void fpga_frame_telemetry(struct cgpu_info *gpu, const unsigned char *buf)
+{
+	fpga_vint[gpu->device_id] = (((double)buf[5]) + (((double)buf[4]) * 256.0f)) / 65536.0f * 3.0f;
+	fpga_temp[gpu->device_id] = ((((double)((buf[6] << 8) | buf[7])) * ((double)509.3140064f)) / 65536.0f) - 280.23087870f;
+	fpga_freq[gpu->device_id] = buf[7] | ((buf[6] & 3) << 8);
+	fpga_cores[gpu->device_id] = buf[6] >> 2;
+}
+
+/* Hashes the board is expected to try per nonce that verifies on work. The
+ * board reports every hash whose top word meets the job target, but only
+ * those meeting diff1 as well pass test_nonce. */
+static double fpga_nonce_hashes(struct work *work)
+{
+	uint32_t target = le32toh(*(uint32_t *)(work->target + 28));
+
+	target = MIN(target, work->pool->algorithm.diff1targ);
+	return 4294967296.0 / ((double)target + 1.0);
+}
+
+/* Submit every complete frame in the ring against work and return how many
+ * verified. Frames carry no sync marker, so when one fails while more bytes
+ * are already queued behind it the stream may have slipped and we look for
+ * an alignment that does verify. Telemetry is only taken from frames that
+ * verified since a misaligned frame would report garbage. */
+static int fpga_parse_frames(struct fpga_info *info, struct work *work)
+{
+	struct thr_info *thr = info->thr;
+	struct cgpu_info *gpu = thr->cgpu;
+	struct fpga_ring *rx = &info->rx;
+	unsigned char frame[FPGA_FRAME_SIZE];
+	unsigned int shift;
+	uint32_t nonce;
+	int found = 0;
+
+	while (fpga_ring_used(rx) >= FPGA_FRAME_SIZE) {
+		fpga_ring_peek(rx, 0, frame, FPGA_FRAME_SIZE);
+		nonce = fpga_frame_nonce(frame);
+
+		if (unlikely(!work)) {
+			applog(LOG_DEBUG, "%s%i: Nonce %08X arrived with no job running, dropped",
+			       gpu->drv->name, gpu->device_id, nonce);
+			fpga_ring_drop(rx, FPGA_FRAME_SIZE);
+			continue;
+		}
+
+		applog(LOG_INFO, "%s%i: Nonce Found - %08X", gpu->drv->name, gpu->device_id, nonce);
+		if (submit_nonce(thr, work, nonce)) {
+			fpga_frame_telemetry(gpu, frame);
+			info->share_hashes += fpga_nonce_hashes(work);
+			info->share_nonces++;
+			fpga_ring_drop(rx, FPGA_FRAME_SIZE);
+			found++;
+			continue;
+		}
+
+		for (shift = 1; shift < FPGA_FRAME_SIZE && fpga_ring_used(rx) >= shift + FPGA_FRAME_SIZE; shift++) {
+			fpga_ring_peek(rx, shift, frame, FPGA_FRAME_SIZE);
+			if (test_nonce(work, fpga_frame_nonce(frame)))
+				break;
+		}
+		if (shift < FPGA_FRAME_SIZE && fpga_ring_used(rx) >= shift + FPGA_FRAME_SIZE) {
+			applog(LOG_NOTICE, "%s%i: Serial stream slipped %u bytes, resynchronised",
+			       gpu->drv->name, gpu->device_id, shift);
+			fpga_ring_drop(rx, shift);
+			rx->resyncs++;
+		} else
+			fpga_ring_drop(rx, FPGA_FRAME_SIZE);
+	}
+
+	return found;
+}
+
+/* Called on the reactor thread whenever a board's port is readable */
+static void fpga_serial_ready(int fd, uint32_t events, void *arg)
+{
+	struct fpga_info *info = (struct fpga_info *)arg;
+	struct cgpu_info *gpu = info->thr->cgpu;
+	int ret;
+
+	while ((ret = fpga_ring_fill(fd, &info->rx)) > 0) {
+		if (fpga_ring_used(&info->rx) < FPGA_FRAME_SIZE)
+			continue;
+		mutex_lock(&info->lock);
+		info->nonces += fpga_parse_frames(info, info->work);
+		pthread_cond_signal(&info->cond);
+		mutex_unlock_noyield(&info->lock);
+	}
+
+	if (unlikely((events & REACTOR_ERR) || ret < 0)) {
+		applog(LOG_ERR, "%s%i: Serial Read Error (errno=%d)", gpu->drv->name, gpu->device_id, errno);
+		reactor_del(fpga_reactor, fd);
+		dev_error(gpu, REASON_DEV_COMMS_ERROR);
+
+		/* The mining thread reopens the port */
+		mutex_lock(&info->lock);
+		info->comms_error = true;
+		pthread_cond_signal(&info->cond);
+		mutex_unlock(&info->lock);
+	}
+}
+
+static bool fpga_open(struct cgpu_info *gpu, struct fpga_info *info)
+{
+	fpga_ring_reset(&info->rx);
+	info->comms_error = false;
+
+	if (fpga_reactor) {
+		/* The reactor never blocks in read so the port needs no VTIME */
+		gpu->fd = serial_open(gpu->device_path, devbaud[gpu->virtual_gpu], 0, 1);
+		if (gpu->fd == -1)
+			return false;
+#ifndef WIN32
+		fcntl(gpu->fd, F_SETFL, fcntl(gpu->fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+		info->reactor = reactor_add(fpga_reactor, gpu->fd, REACTOR_IN, fpga_serial_ready, info);
+		if (info->reactor)
+			return true;
+		applog(LOG_WARNING, "%s%i: Falling back to polled serial reads", gpu->drv->name, gpu->device_id);
+		_close(gpu->fd);
+	}
+
+	gpu->fd = serial_open(gpu->device_path, devbaud[gpu->virtual_gpu], devtimeout, 1);
+	return gpu->fd == -1 ? false : true;
+}
+
+static void fpga_baud_test(struct cgpu_info *gpu);
+
 static bool fpga_thread_init(struct thr_info *thr)
 {
 	struct cgpu_info *gpu = thr->cgpu;
+	struct fpga_info *info = (struct fpga_info *)gpu->device_data;
 	int i;
 	int r;
 
@@ -662,13 +1071,22 @@ static bool fpga_thread_init(struct thr_info *thr)
 		fpga_freq[0] = 0;
 	}
 
-	thr->cgpu_data = 0;// thrdata;
+	info->thr = thr;
+	info->work = NULL;
+	info->next = NULL;
+	dev_timeout =
+	info->timeout = 10;
+	info->nominal_hs = info->share_hashes = info->share_nonces = 0;
+	info->share_secs = info->est_hs = 0;
+	cgtime(&info->tv_hashes);
+	thr->cgpu_data = info;
+
+	if (opt_fpga_baud_test)
+		fpga_baud_test(gpu);
 	gpu->status = LIFE_WELL;
 	gpu->device_last_well = time(NULL);
-	
-	gpu->fd = serial_open(gpu->device_path, devbaud, devtimeout, 1);
 
-	return gpu->fd == 0 ? false : true;
+	return fpga_open(gpu, info);
 }
 
 static bool fpga_prepare_work(struct thr_info __maybe_unused *thr, struct work *work)
@@ -681,8 +1099,6 @@ static bool fpga_prepare_work(struct thr_info __maybe_unused *thr, struct work *
 	return true;
 }
 
-#include "sph/sph_blake.h"
-
 void bswap(unsigned char *b, int len)
 {
 	if ((len & 3) != 0) {
@@ -702,190 +1118,412 @@ void bswap(unsigned char *b, int len)
 
 static void reverse(unsigned char *b, int len)
 {
-	static unsigned char bt[1024];
+	/* Jobs are built on every board's mining thread at once */
+	unsigned char bt[128];
 	int i, j;
 
 	if (len > 128) {
 		system("pause");
 		exit(0);
 	}
-	//	bt = (unsigned char*)malloc(len + 1);
 
 	for (i = 0, j = len; i < len;) {
 		bt[i++] = b[--j];
 	}
 
 	memcpy(b, bt, len);
-
-	//	free(bt);
 }
 
-static int64_t fpga_scanhash(struct thr_info *thr, struct work *work, int64_t __maybe_unused max_nonce)
+/* Build the job upload for work in the byte order the board expects */
+/* The midstate comes from the work's cache, the same one the host check of
+ * each returned nonce resumes from. */
+static void fpga_job_frame(struct work *work, unsigned char *wbuf)
 {
-	const int thr_id = thr->id;
-	struct opencl_thread_data *thrdata = (struct opencl_thread_data *)thr->cgpu_data;
-	struct cgpu_info *gpu = thr->cgpu;
-
-	char *ob_hex;
-	
-	unsigned char sdata[80];
-	unsigned char wbuf[56];
-	unsigned char buf[56];
-	unsigned int nonce;
-	sph_blake256_context lyra2z_blake_mid;
-
-	memset(wbuf, 0, 52);
-
-	unsigned char input[(512 + 128) / 8] = {
-		0x00, 0x00, 0x00, 0x20, 0x6E, 0x7E, 0x5F, 0xA2, 0x11, 0x0B, 0xA7, 0x79, 0xED, 0x8D, 0xD3, 0x4D,
-		0x1F, 0xF7, 0x33, 0x21, 0x96, 0x79, 0xD3, 0x8E, 0x69, 0x0A, 0x58, 0xE1, 0xDE, 0x1D, 0x04, 0x00,
-		0x00, 0x00, 0x00, 0x00, 0xE7, 0x7D, 0x10, 0x0C, 0x31, 0x9D, 0x75, 0x5B, 0xB9, 0x58, 0x13, 0xD9,
-		0x79, 0xD7, 0x80, 0xD8, 0xBB, 0xAC, 0x20, 0x5A, 0xC7, 0x33, 0x36, 0xFC, 0xD9, 0x77, 0xEA, 0xD2,
-		0x86, 0x09, 0xF6, 0xF1, 0x27, 0x08, 0x3F, 0x5B, 0x51, 0xC5, 0x19, 0x1B, 0x00, 0x02, 0xE2, 0xC0,
-
-	};
+	unsigned char sdata[16];
 
-	memcpy(sdata, work->data, 80);
+	memset(wbuf, 0, FPGA_JOB_SIZE);
 
-	bswap(sdata, 80);
+	memcpy(sdata, work->data + 64, 16);
 
-	sph_blake256_init(&lyra2z_blake_mid);
-	sph_blake256(&lyra2z_blake_mid, sdata, 64);
+	bswap(sdata, 16);
 
 	wbuf[48] = work->target[0x1F];
 	wbuf[49] = work->target[0x1E];
 	wbuf[50] = work->target[0x1D];
 	wbuf[51] = work->target[0x1C];
 
-	memcpy(wbuf + 0, &lyra2z_blake_mid.H[0], 32);
-	memcpy(wbuf + 32, ((unsigned char*)(sdata)) + 64, 16);
+	memcpy(wbuf + 0, blake256_midstate(work), 32);
+	memcpy(wbuf + 32, sdata, 16);
 
-//	bswap(wbuf, 32);
 	reverse(wbuf, 44);
 	bswap(wbuf, 12);
+}
 
-#define SERIAL_READ_SIZE 8
+#define FPGA_BAUD_TEST_ROUNDS 5
 
-	struct FPGA_INFO {
-		int device_fd;
-		int timeout;
-		double Hs;		// Seconds Per Hash
-	};
+/* Time from job upload to the first nonce frame with a target every hash
+ * meets, against the bare wire time of the two frames at 8N1. Whatever is
+ * left over is board latency, so a rate is worth raising while the wire
+ * time is a noticeable part of the round trip. The board is parked on an
+ * impossible target after each round. */
+static void fpga_baud_test(struct cgpu_info *gpu)
+{
+	unsigned long baud = devbaud[gpu->virtual_gpu];
+	unsigned char job[FPGA_JOB_SIZE];
+	struct fpga_ring rx;
+	struct work work;
+	struct timeval tv_start, tv_now;
+	double rtt, min = 0, max = 0, total = 0, wire;
+	int fd, round, replies = 0;
+	bool replied;
+
+	fd = serial_open(gpu->device_path, baud, devtimeout, 1);
+	if (fd == -1)
+		return;
 
-	unsigned char ob_bin[44], nonce_buf[SERIAL_READ_SIZE];
-	struct timeval tv_start, tv_finish, elapsed, tv_end, diff;
-	int ret;
+	memset(&work, 0, sizeof(work));
+	memset(&rx, 0, sizeof(rx));
 
-	struct cgpu_info *serial_fpga;
-	struct FPGA_INFO *info;
-	struct FPGA_INFO _info;
+	for (round = 0; round < FPGA_BAUD_TEST_ROUNDS; round++) {
+		((uint32_t *)work.data)[0] = round;
+		work.blk.blake256_mid_valid = false;
+		memset(work.target, 0xff, sizeof(work.target));
+		fpga_job_frame(&work, job);
 
-	serial_fpga = thr->cgpu;
-	info = &_info;
+		fpga_ring_reset(&rx);
+		cgtime(&tv_start);
+		if (!fpga_write(fd, job, FPGA_JOB_SIZE))
+			break;
+		do {
+			if (fpga_ring_fill(fd, &rx) < 0)
+				goto out;
+			cgtime(&tv_now);
+		} while (fpga_ring_used(&rx) < FPGA_FRAME_SIZE && ms_tdiff(&tv_now, &tv_start) < 1000);
+		replied = fpga_ring_used(&rx) >= FPGA_FRAME_SIZE;
+
+		memset(work.target, 0, sizeof(work.target));
+		fpga_job_frame(&work, job);
+		if (!fpga_write(fd, job, FPGA_JOB_SIZE))
+			break;
+		/* Let the port time out on whatever was still in flight */
+		while (fpga_ring_fill(fd, &rx) > 0)
+			fpga_ring_reset(&rx);
 
-	info->device_fd = gpu->fd;
-	info->Hs = 250000000 / 2400;
+		if (!replied)
+			continue;
+		rtt = tdiff(&tv_now, &tv_start) * 1000.0;
+		if (!replies || rtt < min)
+			min = rtt;
+		if (rtt > max)
+			max = rtt;
+		total += rtt;
+		replies++;
+	}
+out:
+	_close(fd);
+
+	wire = (FPGA_JOB_SIZE + FPGA_FRAME_SIZE) * 10 * 1000.0 / baud;
+	if (replies)
+		applog(LOG_NOTICE, "%s%i: %lu baud round trip %.2f/%.2f/%.2f ms min/avg/max over %d jobs, wire time %.2f ms",
+		       gpu->drv->name, gpu->device_id, baud, min, total / replies, max, replies, wire);
+	else
+		applog(LOG_WARNING, "%s%i: No reply at %lu baud, check the rate the board was built for",
+		       gpu->drv->name, gpu->device_id, baud);
+}
 
-	dev_timeout = 
-	info->timeout = 10;
+/* Take the next work item and build its job upload while the board is still
+ * busy with the current one. The queue is one job deep. */
+static bool fpga_queue_full(struct cgpu_info *gpu)
+{
+	struct fpga_info *info = (struct fpga_info *)gpu->device_data;
+	struct work *work;
 
+	if (info->next)
+		return true;
 
-	// Send Data To FPGA
-	//	ret = write(fd, ob_bin, sizeof(ob_bin));
-	_write(gpu->fd, wbuf, 52);
+	work = get_queued(gpu);
+	if (unlikely(!work))
+		return false;
 
-	/*	if (ret != sizeof(ob_bin)) {
-	applog(LOG_ERR, "%s%i: Serial Send Error (ret=%d)", serial_fpga->drv->name, serial_fpga->device_id, ret);
-	//serial_fpga_close(thr);
-	dev_error(serial_fpga, REASON_DEV_COMMS_ERROR);
-	return 0;
-	}*/
+	fpga_prepare_work(info->thr, work);
+	work->device_diff = MIN(gpu->drv->working_diff, work->work_difficulty);
+	fpga_job_frame(work, info->next_job);
+	info->next = work;
 
-	if (opt_debug) {
-		char *ob_hex = bin2hex(wbuf, 52);
-		applog(LOG_ERR, "Serial FPGA %d sent: %s", serial_fpga->device_id, ob_hex);
-		free(ob_hex);
-	}
+	return true;
+}
 
-	elapsed.tv_sec = 0;
-	elapsed.tv_usec = 0;
-	cgtime(&tv_start);
+/* Swap the running job for next (which may be NULL to leave the board idle)
+ * and hand the old one back. Nonces are matched against info->work by the
+ * reactor so the swap and the upload happen under the lock. */
+static bool fpga_switch_job(struct cgpu_info *gpu, struct fpga_info *info, struct work *next)
+{
+	struct work *prev;
+	struct timeval now;
+	int nonces;
+	bool ret = true;
+
+	mutex_lock(&info->lock);
+	prev = info->work;
+	nonces = info->nonces;
+	info->work = next;
+	info->nonces = 0;
+	if (next) {
+		ret = fpga_write(gpu->fd, info->next_job, FPGA_JOB_SIZE);
+		cgtime(&info->tv_job);
+	}
+	mutex_unlock(&info->lock);
 
-	size_t len;
+	/* A job upload replaces whatever the board is running, so this is
+	 * where hashing on the old job stops after a restart */
+	if (next)
+		thr_restart_done(info->thr);
 
-	applog(LOG_DEBUG, "%s%i: Begin Scan For Nonces", serial_fpga->drv->name, serial_fpga->device_id);
-	while (thr && !thr->work_restart) {
+	if (next == info->next)
+		info->next = NULL;
 
-		memset(buf, 0, 8);
+	if (prev) {
+		cgtime(&now);
+		applog(LOG_DEBUG, "%s%i: End Scan For Nonces - %d nonces in %d sec", gpu->drv->name,
+		       gpu->device_id, nonces, (int)(now.tv_sec - prev->tv_work_start.tv_sec));
+		work_completed(gpu, prev);
+	}
 
-		// Check Serial Port For 1/10 Sec For Nonce  
-		//		ret = read(fd, nonce_buf, SERIAL_READ_SIZE);
-		ret = serial_recv(gpu->fd, (char*)buf, 8, &len);
+	if (next) {
+		cgtime(&next->tv_work_start);
+		if (opt_debug) {
+			char *ob_hex = bin2hex(info->next_job, FPGA_JOB_SIZE);
+			applog(LOG_DEBUG, "Serial FPGA %d sent: %s", gpu->device_id, ob_hex);
+			free(ob_hex);
+		}
+		if (unlikely(!ret))
+			applog(LOG_ERR, "%s%i: Serial Send Error", gpu->drv->name, gpu->device_id);
+	}
 
-		// Calculate Elapsed Time
-		cgtime(&tv_end);
-		timersub(&tv_end, &tv_start, &elapsed);
+	return ret;
+}
 
-		if (ret == 0 && len != 8) {		// No Nonce Found
-			if (elapsed.tv_sec > info->timeout) {
-				applog(LOG_DEBUG, "%s%i: End Scan For Nonces - Time = %d sec", serial_fpga->drv->name, serial_fpga->device_id, elapsed.tv_sec);
-				//thr->work_restart = true;
-				break;
-			}
-			continue;
-		}
-		else if (ret != 0) { //(ret < SERIAL_READ_SIZE) {
-			applog(LOG_ERR, "%s%i: Serial Read Error (ret=%d)", serial_fpga->drv->name, serial_fpga->device_id, ret);
-			//serial_fpga_close(thr);
-			dev_error(serial_fpga, REASON_DEV_COMMS_ERROR);
-			break;
-		}
+/* Both the running and the preloaded job are stale or will never run */
+static void fpga_drop_jobs(struct cgpu_info *gpu, struct fpga_info *info)
+{
+	if (info->next) {
+		work_completed(gpu, info->next);
+		info->next = NULL;
+	}
+	fpga_switch_job(gpu, info, NULL);
+}
 
-		fpga_vint[gpu->device_id] = (((double)buf[5]) + (((double)buf[4]) * 256.0f)) / 65536.0f * 3.0f;
-		fpga_temp[gpu->device_id] = ((((double)((buf[6] << 8) | buf[7])) * ((double)509.3140064f)) / 65536.0f) - 280.23087870f;
-		fpga_freq[gpu->device_id] = buf[7] | ((buf[6] & 3) << 8);
-		fpga_cores[gpu->device_id] = buf[6] >> 2;
+/* Wait for nonces until deadline, a restart or a comms error */
+static void fpga_wait_job(struct thr_info *thr, struct fpga_info *info, struct timeval *deadline)
+{
+	struct cgpu_info *gpu = thr->cgpu;
+	struct timeval now;
 
-		memcpy((char *)&nonce, buf, 4);
+	if (info->reactor) {
+		struct timespec abstime;
 
-		nonce = swab32(nonce);
+		/* Frames are handled by the reactor as they arrive, we only
+		 * sleep until the job times out or flush_work wakes us. */
+		timeval_to_spec(&abstime, deadline);
 
-		//		curr_hw_errors = serial_fpga->hw_errors;
+		mutex_lock(&info->lock);
+		if (!thr->work_restart && !gpu->shutdown && !info->comms_error)
+			pthread_cond_timedwait(&info->cond, &info->lock, &abstime);
+		mutex_unlock(&info->lock);
+		return;
+	}
 
-		applog(LOG_INFO, "%s%i: Nonce Found - %08X (%5.1fMhz)", serial_fpga->drv->name, serial_fpga->device_id, nonce, (double)(1 / (info->Hs * 1000000)));
-		submit_nonce(thr, work, nonce);
+	while (!thr->work_restart && !gpu->shutdown) {
+#ifndef WIN32
+		/* Sleep until the board sends something, the deadline or a
+		 * restart, rather than for the port timeout at a time */
+		if (thr->restart_fd >= 0) {
+			struct pollfd pfd[2];
+			int ms;
+
+			cgtime(&now);
+			ms = ms_tdiff(deadline, &now);
+			if (ms <= 0)
+				return;
+			pfd[0].fd = gpu->fd;
+			pfd[0].events = POLLIN;
+			pfd[1].fd = thr->restart_fd;
+			pfd[1].events = POLLIN;
+			pfd[0].revents = pfd[1].revents = 0;
+			/* On a poll failure fall back to the port timeout */
+			if (poll(pfd, 2, ms) < 0) {
+				if (errno == EINTR)
+					continue;
+			} else {
+				if (pfd[1].revents)
+					thr_restart_drain(thr);
+				if (!pfd[0].revents)
+					continue;
+			}
+		}
+#endif
+		// Wait up to the port timeout for whatever the board sends
+		if (unlikely(fpga_ring_fill(gpu->fd, &info->rx) < 0)) {
+			applog(LOG_ERR, "%s%i: Serial Read Error (errno=%d)", gpu->drv->name, gpu->device_id, errno);
+			dev_error(gpu, REASON_DEV_COMMS_ERROR);
+			info->comms_error = true;
+			return;
+		}
+		if (fpga_ring_used(&info->rx) >= FPGA_FRAME_SIZE)
+			info->nonces += fpga_parse_frames(info, info->work);
 
-		// Update Hashrate
-		//		if (serial_fpga->hw_errors == curr_hw_errors)
-		//			info->Hs = ((double)(elapsed.tv_sec) + ((double)(elapsed.tv_usec)) / ((double)1000000)) / (double)nonce;
+		cgtime(&now);
+		if (!time_less(&now, deadline))
+			return;
+	}
+}
 
+/* Work out the hash rate reported for the secs just passed. Cores times
+ * clock is what the bitstream should manage, the verified nonce rate is what
+ * it really did. Once enough nonces are in their ratio scales the telemetry
+ * rate down for dead cores or a clock the board doesn't make, while the
+ * telemetry keeps the estimate steady between nonces. Without telemetry only
+ * the nonce rate is left. */
+static void fpga_update_rate(struct cgpu_info *gpu, struct fpga_info *info, double secs)
+{
+	double share_hs = 0, efficiency;
+
+	if (info->reactor)
+		mutex_lock(&info->lock);
+	info->share_secs += secs;
+	if (info->share_nonces > FPGA_RATE_MAX_NONCES) {
+		info->share_hashes /= 2;
+		info->share_nonces /= 2;
+		info->share_secs /= 2;
+	}
+	if (info->share_secs > 0)
+		share_hs = info->share_hashes / info->share_secs;
+	info->nominal_hs = (double)fpga_cores[gpu->device_id] * fpga_freq[gpu->device_id] * 1000000.0 /
+			   FPGA_CLOCKS_PER_HASH;
+
+	if (info->nominal_hs <= 0)
+		info->est_hs = share_hs;
+	else if (info->share_nonces < FPGA_RATE_MIN_NONCES)
+		info->est_hs = info->nominal_hs;
+	else {
+		efficiency = share_hs / info->nominal_hs;
+		info->est_hs = info->nominal_hs * MIN(efficiency, 1.0);
 	}
+	if (info->reactor)
+		mutex_unlock(&info->lock);
+}
 
+/* Runs one wait on the current job. As soon as the job times out the
+ * preloaded one is sent, so the board only idles for the time it takes to
+ * write the upload, and hash_queued_work refills the queue behind it. */
+static int64_t fpga_scanwork(struct thr_info *thr)
+{
+	struct cgpu_info *gpu = thr->cgpu;
+	struct fpga_info *info = (struct fpga_info *)thr->cgpu_data;
+	struct timeval now, deadline;
+	int64_t hash_count;
+	double secs;
+
+	if (unlikely(thr->work_restart)) {
+		fpga_drop_jobs(gpu, info);
+		return 0;
+	}
 
-	int hash_count =  ((double)(elapsed.tv_sec) + ((double)(elapsed.tv_usec)) / ((double)1000000)) / info->Hs;
+	if (!info->work) {
+		if (unlikely(!info->next))
+			return 0;
+		if (unlikely(!fpga_switch_job(gpu, info, info->next)))
+			info->comms_error = true;
+	}
 
-						 //	free_work(work);
+	if (likely(!info->comms_error)) {
+		deadline = info->tv_job;
+		deadline.tv_sec += info->timeout;
+		fpga_wait_job(thr, info, &deadline);
+	}
 
+	if (unlikely(info->comms_error)) {
+		/* Whatever the board was running is lost, the preloaded job
+		 * goes out as soon as the port is back. */
+		fpga_switch_job(gpu, info, NULL);
+		if (info->reactor)
+			reactor_del(fpga_reactor, gpu->fd);
+		_close(gpu->fd);
+		if (!fpga_open(gpu, info))
+			return -1;
+	} else if (unlikely(thr->work_restart))
+		fpga_drop_jobs(gpu, info);
+	else {
+		cgtime(&now);
+		if (!time_less(&now, &deadline) && !fpga_switch_job(gpu, info, info->next))
+			info->comms_error = true;
+	}
 
-	/* The amount of work scanned can fluctuate when intensity changes
-	* and since we do this one cycle behind, we increment the work more
-	* than enough to prevent repeating work */
-	work->blk.nonce += 31337;// gpu->max_hashes;
+	cgtime(&now);
+	secs = tdiff(&now, &info->tv_hashes);
+	copy_time(&info->tv_hashes, &now);
+	fpga_update_rate(gpu, info, secs);
+	hash_count = info->est_hs * secs;
 
 	return hash_count;
+}
+
+/* Wake the mining thread straight away on a block change instead of letting
+ * it notice work_restart at its next timeout. */
+static void fpga_flush_work(struct cgpu_info *gpu)
+{
+	struct fpga_info *info = (struct fpga_info *)gpu->device_data;
 
+	if (!info)
+		return;
+
+	mutex_lock(&info->lock);
+	pthread_cond_signal(&info->cond);
+	mutex_unlock(&info->lock);
 }
 
 static void fpga_thread_shutdown(struct thr_info *thr)
 {
 	struct cgpu_info *gpu = thr->cgpu;
+	struct fpga_info *info = (struct fpga_info *)gpu->device_data;
 
+	if (info && info->reactor) {
+		reactor_del(fpga_reactor, gpu->fd);
+		info->reactor = false;
+	}
+	if (info)
+		fpga_drop_jobs(gpu, info);
 	if(gpu->fd)
 		_close(gpu->fd);
 	gpu->fd = 0;
 	thr->cgpu_data = NULL;
 }
 
+/* Extra fields for the stats API command */
+static struct api_data *fpga_api_stats(struct cgpu_info *gpu)
+{
+	struct fpga_info *info = (struct fpga_info *)gpu->device_data;
+	struct api_data *root = NULL;
+	double mhs, nonces;
+
+	if (!info)
+		return NULL;
+
+	root = api_add_int(root, "Cores", &fpga_cores[gpu->device_id], true);
+	root = api_add_int(root, "Clock", &fpga_freq[gpu->device_id], true);
+	mhs = info->nominal_hs / 1000000.0;
+	root = api_add_mhs(root, "Nominal MHS", &mhs, true);
+	mhs = info->share_secs > 0 ? info->share_hashes / info->share_secs / 1000000.0 : 0;
+	root = api_add_mhs(root, "Share MHS", &mhs, true);
+	nonces = info->share_nonces;
+	root = api_add_double(root, "Share Nonces", &nonces, true);
+	mhs = info->est_hs / 1000000.0;
+	root = api_add_mhs(root, "Estimated MHS", &mhs, true);
+	root = api_add_uint(root, "Serial Resyncs", &info->rx.resyncs, true);
+
+	return root;
+}
+
 struct device_drv opencl_drv = {
   /*.drv_id = */            DRIVER_opencl,
   /*.dname = */             "fpga",
@@ -894,7 +1532,7 @@ struct device_drv opencl_drv = {
   /*.reinit_device = */     reinit_fpga_device,
   /*.get_statline_before =*/get_fpga_statline_before,
   /*.get_statline = */      get_fpga_statline,
-  /*.api_data = */          NULL,
+  /*.api_data = */          fpga_api_stats,
   /*.get_stats = */         NULL,
   /*.identify_device = */   NULL,
   /*.set_device = */        NULL,
@@ -903,11 +1541,11 @@ struct device_drv opencl_drv = {
   /*.can_limit_work = */    NULL,
   /*.thread_init = */       fpga_thread_init,
   /*.prepare_work = */      fpga_prepare_work,
-  /*.hash_work = */         NULL,
-  /*.scanhash = */          fpga_scanhash,
-  /*.scanwork = */          NULL,
-  /*.queue_full = */        NULL,
-  /*.flush_work = */        NULL,
+  /*.hash_work = */         hash_queued_work,
+  /*.scanhash = */          NULL,
+  /*.scanwork = */          fpga_scanwork,
+  /*.queue_full = */        fpga_queue_full,
+  /*.flush_work = */        fpga_flush_work,
   /*.update_work = */       NULL,
   /*.hw_error = */          NULL,
   /*.thread_shutdown = */   fpga_thread_shutdown,
@@ -29,6 +29,10 @@ extern void pause_dynamic_threads(int gpu);
 
 extern int opt_platform_id;
 
+/* Serial FPGA boards, set with --com0..7 or --fpga-ports */
+#define MAX_FPGA_DEVICES 64
+#define FPGA_DEFAULT_BAUD 115200
+
 extern struct device_drv opencl_drv;
 
 #endif /* DEVICE_GPU_H */
@@ -0,0 +1,373 @@
+/*
+ * Copyright 2014 sgminer developers (see AUTHORS.md)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Software stand-in for the Lyra2Z serial FPGA boards. Each simulated board
+ * sits on a pseudo-terminal and speaks the same protocol as the real
+ * bitstream: a 52 byte job (blake256 midstate, header tail and top target
+ * word) in, 8 byte nonce + telemetry frames out. Nonces are real, hashed
+ * with Lyra2Z from the midstate, paced to the configured hash rate.
+ *
+ * Build with "make fpgasim", then point sgminer at the printed ports:
+ *   ./fpgasim -n 16 -r 2000 &
+ *   sgminer -k lyra2Z --fpga-ports /dev/pts/3,/dev/pts/4,... -o ...
+ *
+ * With -v every nonce found is printed with a CLOCK_MONOTONIC timestamp
+ * so it can be lined up against the time the share is submitted. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sph/sph_blake.h"
+#include "algorithm/lyra2.h"
+
+#define JOB_SIZE 52
+#define FRAME_SIZE 8
+#define MAX_BOARDS 64
+
+struct board {
+  int id;
+  int master;
+  int slave;
+  char path[64];
+  pthread_t pth;
+
+  /* Job being hashed, as decoded from the last upload */
+  bool busy;
+  uint32_t midstate[8];
+  unsigned char tail[16];
+  uint32_t target;
+  uint32_t nonce;
+  struct timespec job_start;
+
+  unsigned char in[JOB_SIZE];
+  size_t in_len;
+
+  uint64_t hashes;
+  uint64_t found;
+};
+
+static int opt_boards = 1;
+static double opt_rate = 1000.0;
+static int opt_cores = 16;
+static int opt_freq = 250;
+static double opt_vint = 0.9;
+static bool opt_verbose;
+
+static volatile bool quit_now;
+
+static double ts_diff(const struct timespec *end, const struct timespec *start)
+{
+  return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bswap(unsigned char *b, int len)
+{
+  while (len > 0) {
+    unsigned char t0 = b[0], t1 = b[1];
+
+    b[0] = b[3];
+    b[1] = b[2];
+    b[2] = t1;
+    b[3] = t0;
+    b += 4;
+    len -= 4;
+  }
+}
+
+static void reverse(unsigned char *b, int len)
+{
+  int i, j;
+
+  for (i = 0, j = len - 1; i < j; i++, j--) {
+    unsigned char t = b[i];
+
+    b[i] = b[j];
+    b[j] = t;
+  }
+}
+
+/* Undo the byte shuffling fpga_job_frame() applies before upload */
+static void decode_job(struct board *b, const unsigned char *buf)
+{
+  unsigned char job[JOB_SIZE];
+
+  memcpy(job, buf, JOB_SIZE);
+  bswap(job, 12);
+  reverse(job, 44);
+
+  memcpy(b->midstate, job, 32);
+  memcpy(b->tail, job + 32, 16);
+  b->target = ((uint32_t)job[48] << 24) | ((uint32_t)job[49] << 16) |
+        ((uint32_t)job[50] << 8) | (uint32_t)job[51];
+  b->nonce = 0;
+  b->busy = true;
+  clock_gettime(CLOCK_MONOTONIC, &b->job_start);
+}
+
+/* Lyra2Z of the header whose first 64 bytes left blake256 at midstate */
+static void lyra2z_midstate_hash(uint32_t *hash, const uint32_t *midstate, const unsigned char *tail)
+{
+  sph_blake256_context ctx;
+  uint32_t hashA[8];
+
+  sph_blake256_init(&ctx);
+  memcpy(ctx.H, midstate, sizeof(ctx.H));
+  ctx.T0 = 512;
+  sph_blake256(&ctx, tail, 16);
+  sph_blake256_close(&ctx, hashA);
+
+  LYRA2Z(hash, hashA);
+}
+
+/* Nonce big endian first, then supply voltage and the temperature sensor
+ * word which also carries the core count and clock. */
+static void send_frame(struct board *b, uint32_t nonce)
+{
+  unsigned char frame[FRAME_SIZE];
+  unsigned int vint = (unsigned int)(opt_vint / 3.0 * 65536.0);
+  unsigned int sensor = ((opt_cores & 0x3f) << 10) | (opt_freq & 0x3ff);
+  struct timespec now;
+
+  frame[0] = nonce >> 24;
+  frame[1] = nonce >> 16;
+  frame[2] = nonce >> 8;
+  frame[3] = nonce;
+  frame[4] = vint >> 8;
+  frame[5] = vint;
+  frame[6] = sensor >> 8;
+  frame[7] = sensor;
+
+  if (write(b->master, frame, FRAME_SIZE) != FRAME_SIZE)
+    fprintf(stderr, "board %d: short write: %s\n", b->id, strerror(errno));
+
+  b->found++;
+  if (opt_verbose) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("%ld.%09ld board %d found %08x\n", (long)now.tv_sec, now.tv_nsec, b->id, nonce);
+    fflush(stdout);
+  }
+}
+
+/* Hash every nonce that is due by now at the configured rate. Returns how
+ * long to wait before more are due, in ms. */
+static int hash_due(struct board *b)
+{
+  unsigned char tail[16];
+  uint32_t hash[8];
+  struct timespec now;
+  uint64_t due;
+  int batch;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  due = (uint64_t)(ts_diff(&now, &b->job_start) * opt_rate);
+
+  memcpy(tail, b->tail, sizeof(tail));
+  /* Bound the batch so new jobs are picked up promptly on a slow host */
+  for (batch = 0; b->nonce < due && batch < 256; batch++) {
+    uint32_t nonce = b->nonce;
+
+    tail[12] = nonce >> 24;
+    tail[13] = nonce >> 16;
+    tail[14] = nonce >> 8;
+    tail[15] = nonce;
+    lyra2z_midstate_hash(hash, b->midstate, tail);
+    b->hashes++;
+
+    if (hash[7] <= b->target)
+      send_frame(b, nonce);
+
+    if (++b->nonce == 0) {
+      /* Range exhausted, the board idles until the next job */
+      b->busy = false;
+      return -1;
+    }
+  }
+
+  if (b->nonce < due)
+    return 0;
+  return 1;
+}
+
+static void *board_thread(void *arg)
+{
+  struct board *b = (struct board *)arg;
+  struct pollfd pfd;
+  int timeout = -1;
+
+  pfd.fd = b->master;
+  pfd.events = POLLIN;
+
+  while (!quit_now) {
+    int ret = poll(&pfd, 1, timeout);
+
+    if (ret < 0 && errno != EINTR)
+      break;
+
+    if (ret > 0 && (pfd.revents & POLLIN)) {
+      ssize_t len = read(b->master, b->in + b->in_len, JOB_SIZE - b->in_len);
+
+      if (len > 0) {
+        b->in_len += len;
+        if (b->in_len == JOB_SIZE) {
+          decode_job(b, b->in);
+          b->in_len = 0;
+        }
+      }
+      else if (len < 0 && errno != EAGAIN && errno != EINTR) {
+        /* EIO until the miner has the slave open, keep polling */
+        usleep(100000);
+      }
+    }
+    else if (ret > 0 && (pfd.revents & POLLHUP))
+      usleep(100000);
+
+    /* Wake up now and then while idle to notice a signal */
+    timeout = b->busy ? hash_due(b) : 1000;
+    if (timeout < 0)
+      timeout = 1000;
+  }
+
+  return NULL;
+}
+
+static bool open_board(struct board *b)
+{
+  struct termios tio;
+  char *name;
+
+  b->master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (b->master < 0 || grantpt(b->master) || unlockpt(b->master))
+    return false;
+  name = ptsname(b->master);
+  if (!name)
+    return false;
+  snprintf(b->path, sizeof(b->path), "%s", name);
+
+  /* Hold the slave open in raw mode so nothing is echoed back before the
+   * miner configures it, and reads don't fail between miner restarts. */
+  b->slave = open(b->path, O_RDWR | O_NOCTTY);
+  if (b->slave < 0)
+    return false;
+  tcgetattr(b->slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(b->slave, TCSANOW, &tio);
+
+  fcntl(b->master, F_SETFL, fcntl(b->master, F_GETFL, 0) | O_NONBLOCK);
+  return true;
+}
+
+static void sighandler(int __attribute__((unused)) sig)
+{
+  quit_now = true;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  -n <boards>   simulated boards, 1 to %d (default 1)\n"
+    "  -r <rate>     hashes per second per board (default 1000)\n"
+    "  -c <cores>    reported core count (default 16)\n"
+    "  -f <mhz>      reported clock (default 250)\n"
+    "  -v            print every nonce found with a monotonic timestamp\n",
+    prog, MAX_BOARDS);
+}
+
+int main(int argc, char *argv[])
+{
+  static struct board boards[MAX_BOARDS];
+  struct timespec start, now;
+  int i, opt;
+
+  while ((opt = getopt(argc, argv, "n:r:c:f:vh")) != -1) {
+    switch (opt) {
+      case 'n':
+        opt_boards = atoi(optarg);
+        break;
+      case 'r':
+        opt_rate = atof(optarg);
+        break;
+      case 'c':
+        opt_cores = atoi(optarg);
+        break;
+      case 'f':
+        opt_freq = atoi(optarg);
+        break;
+      case 'v':
+        opt_verbose = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (opt_boards < 1 || opt_boards > MAX_BOARDS || opt_rate <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  signal(SIGINT, sighandler);
+  signal(SIGTERM, sighandler);
+
+  for (i = 0; i < opt_boards; i++) {
+    boards[i].id = i;
+    if (!open_board(&boards[i])) {
+      fprintf(stderr, "board %d: failed to open pty: %s\n", i, strerror(errno));
+      return 1;
+    }
+  }
+
+  fprintf(stderr, "Lyra2 sponge: %s\n", LYRA2_init());
+  fprintf(stderr, "%d board(s) at %.0f H/s each, run sgminer with:\n  --fpga-ports ", opt_boards, opt_rate);
+  for (i = 0; i < opt_boards; i++)
+    fprintf(stderr, "%s%s", i ? "," : "", boards[i].path);
+  fprintf(stderr, "\n");
+
+  for (i = 0; i < opt_boards; i++) {
+    if (pthread_create(&boards[i].pth, NULL, board_thread, &boards[i])) {
+      fprintf(stderr, "board %d: failed to create thread\n", i);
+      return 1;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (!quit_now) {
+    uint64_t hashes = 0, found = 0;
+
+    sleep(10);
+    for (i = 0; i < opt_boards; i++) {
+      hashes += boards[i].hashes;
+      found += boards[i].found;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stderr, "%.0f H/s total over %d board(s), %llu nonces found\n",
+      hashes / ts_diff(&now, &start), opt_boards, (unsigned long long)found);
+  }
+
+  for (i = 0; i < opt_boards; i++)
+    pthread_join(boards[i].pth, NULL);
+
+  return 0;
+}
@@ -10,6 +10,7 @@
 
 #include "config.h"
 
+#include <signal.h>
 #include <unistd.h>
 
 #include "logging.h"
@@ -20,10 +21,16 @@ bool opt_debug_console = false;
 bool opt_verbose = false;
 int last_date_output_day = 0;
 int opt_log_show_date = false;
+bool opt_log_sync = false;
+unsigned int log_drops;
 
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
 
+/* Less urgent messages are dropped on every output, to keep code being
+ * timed quiet */
+int log_max_prio = LOG_DEBUG;
+
 static void _my_log_curses(int prio, const char *datetime, const char *str)
 {
 	if (opt_quiet && prio != LOG_ERR)
@@ -38,6 +45,437 @@ static void _my_log_curses(int prio, const char *datetime, const char *str)
 		printf("%s%s%s", datetime, str, "                    \n");
 }
 
+/* Messages are normally handed to the Logger thread instead of being written
+ * by the thread that logs them. Each logging thread owns a ring of records
+ * that only it writes and only the Logger reads, so a log call costs a
+ * vsnprintf and a copy, with no lock and no syscall. The Logger merges the
+ * rings back into call order by a global sequence number, formats the time
+ * once a second and flushes stderr once per batch. When a ring is full the
+ * record is dropped and counted. Forced messages, as from quit(), and
+ * anything logged while the Logger is not running are written directly. */
+
+/* Must be a power of 2 */
+#define LOG_RING_SIZE 65536
+/* Records start on this boundary, so padding to the end of the ring always
+ * has room for a header */
+#define LOG_REC_ALIGN 32
+#define LOG_REC_PAD -1
+
+struct log_rec {
+  unsigned int size;
+  unsigned int seq;
+  int prio;
+  time_t sec;
+  char str[];
+};
+
+struct log_ring {
+  /* First, so records at LOG_REC_ALIGN offsets keep the alignment calloc
+   * gives the ring and sec is never misaligned */
+  char buf[LOG_RING_SIZE];
+
+  struct log_ring *next;
+  bool owned;
+  /* Set by the owner around a log call so log_stop() can wait it out */
+  unsigned int busy;
+
+  /* Free running offsets, head is written by the owner, tail by the
+   * Logger */
+  unsigned int head;
+  unsigned int tail;
+  unsigned int drops;
+  unsigned int drops_seen;
+
+  /* The owner's vsnprintf buffer */
+  char *fmt;
+  int fmt_size;
+};
+
+/* Set while the Logger is taking messages */
+static unsigned int log_async;
+static bool log_stderr;
+static pthread_key_t log_key;
+static pthread_t log_pth;
+static cgsem_t log_sem;
+static unsigned int log_idle;
+static unsigned int log_seq;
+
+/* log_rings_lock covers ring ownership and the list head, rings are never
+ * removed so the list can be walked without it. log_drain_lock makes the
+ * Logger and a forced message take turns reading the rings. */
+static pthread_mutex_t log_rings_lock;
+static pthread_mutex_t log_drain_lock;
+static struct log_ring *log_rings;
+
+/* Timestamp of the last second printed, under console_lock */
+static time_t log_sec = -1;
+static bool log_sec_date;
+static char log_datetime[64];
+
+static bool log_to_stderr(void)
+{
+  return log_async ? log_stderr : !isatty(fileno((FILE *)stderr));
+}
+
+static bool log_wanted(int prio)
+{
+  if (prio > log_max_prio)
+    return false;
+#ifdef HAVE_SYSLOG_H
+  if (use_syslog)
+    return true;
+#endif
+  return opt_debug_console || (opt_verbose && prio != LOG_DEBUG) || prio <= opt_log_level ||
+         log_to_stderr();
+}
+
+/* Console and stderr output of one message, needs console_lock */
+static void log_output(int prio, time_t sec, const char *str, bool flush)
+{
+  bool write_console = opt_debug_console || (opt_verbose && prio != LOG_DEBUG) || prio <= opt_log_level;
+  bool write_stderr = log_to_stderr();
+
+#ifdef DEV_DEBUG_MODE
+  if (prio == LOG_DEBUG)
+    __debug("", str);
+#endif
+
+  if (!(write_console || write_stderr))
+    return;
+
+  if (sec != log_sec || log_sec_date != !!opt_log_show_date) {
+    const time_t tmp_time = sec;
+    struct tm *tm = localtime(&tmp_time);
+    char date_output_str[64];
+    bool new_day = false;
+
+    log_sec = sec;
+    log_sec_date = !!opt_log_show_date;
+
+    /* Day changed. */
+    if (opt_log_show_date && (last_date_output_day != tm->tm_mday)) {
+      last_date_output_day = tm->tm_mday;
+      snprintf(date_output_str, sizeof(date_output_str), "Log date is now %d-%02d-%02d",
+        tm->tm_year + 1900,
+        tm->tm_mon + 1,
+        tm->tm_mday);
+      new_day = true;
+    }
+
+    if (opt_log_show_date) {
+      snprintf(log_datetime, sizeof(log_datetime), "[%d-%02d-%02d %02d:%02d:%02d] ",
+        tm->tm_year + 1900,
+        tm->tm_mon + 1,
+        tm->tm_mday,
+        tm->tm_hour,
+        tm->tm_min,
+        tm->tm_sec);
+    }
+    else {
+      snprintf(log_datetime, sizeof(log_datetime), "[%02d:%02d:%02d] ",
+        tm->tm_hour,
+        tm->tm_min,
+        tm->tm_sec);
+    }
+
+    /* Stamped with the new time, which log_sec already matches */
+    if (new_day)
+      log_output(prio, sec, date_output_str, flush);
+  }
+
+  /* Only output to stderr if it's not going to the screen as well */
+  if (write_stderr) {
+    fprintf(stderr, "%s%s\n", log_datetime, str);
+    if (flush)
+      fflush(stderr);
+  }
+
+  if (write_console) {
+    _my_log_curses(prio, log_datetime, str);
+  }
+}
+
+static void log_write(int prio, time_t sec, const char *str, bool flush)
+{
+#ifdef HAVE_SYSLOG_H
+  if (use_syslog) {
+    syslog(prio, "%s", str);
+    return;
+  }
+#endif
+  log_output(prio, sec, str, flush);
+}
+
+static void log_ring_put(void *arg)
+{
+  struct log_ring *r = (struct log_ring *)arg;
+
+  mutex_lock(&log_rings_lock);
+  r->owned = false;
+  mutex_unlock(&log_rings_lock);
+}
+
+/* The calling thread's ring, reusing one left by a thread that has exited */
+static struct log_ring *log_ring_get(void)
+{
+  struct log_ring *r = (struct log_ring *)pthread_getspecific(log_key);
+
+  if (likely(r))
+    return r;
+
+  mutex_lock(&log_rings_lock);
+  for (r = log_rings; r; r = r->next) {
+    if (!r->owned)
+      break;
+  }
+  if (!r) {
+    r = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+    if (likely(r)) {
+      r->next = log_rings;
+      log_rings = r;
+    }
+  }
+  if (likely(r))
+    r->owned = true;
+  mutex_unlock(&log_rings_lock);
+
+  if (likely(r))
+    pthread_setspecific(log_key, r);
+  return r;
+}
+
+/* Queues a message on the calling thread's ring. Returns false if it has to
+ * be written directly instead. */
+static bool log_queue(int prio, int size, const char *fmt, va_list args)
+{
+  struct log_ring *r = log_ring_get();
+  unsigned int head, pos, need, pad;
+  struct log_rec *rec;
+  int len;
+
+  if (unlikely(!r))
+    return false;
+
+  atomic_store_uint(&r->busy, 1);
+  atomic_fence();
+  if (unlikely(!atomic_load_uint(&log_async))) {
+    atomic_store_uint(&r->busy, 0);
+    return false;
+  }
+
+  if (unlikely(r->fmt_size < size + 1)) {
+    char *fmt_buf = (char *)realloc(r->fmt, size + 1);
+
+    if (unlikely(!fmt_buf)) {
+      atomic_add_uint(&r->drops, 1);
+      goto out;
+    }
+    r->fmt = fmt_buf;
+    r->fmt_size = size + 1;
+  }
+  len = vsnprintf(r->fmt, size, fmt, args);
+  if (unlikely(len < 0))
+    goto out;
+  if (len >= size)
+    len = size - 1;
+  /* One message may not take more than a quarter of the ring */
+  if (unlikely(sizeof(struct log_rec) + len + 1 > LOG_RING_SIZE / 4))
+    len = LOG_RING_SIZE / 4 - sizeof(struct log_rec) - 1;
+
+  need = (sizeof(struct log_rec) + len + 1 + LOG_REC_ALIGN - 1) & ~(LOG_REC_ALIGN - 1);
+  head = r->head;
+  pos = head & (LOG_RING_SIZE - 1);
+  pad = LOG_RING_SIZE - pos < need ? LOG_RING_SIZE - pos : 0;
+  if (head + pad + need - atomic_load_uint(&r->tail) > LOG_RING_SIZE) {
+    atomic_add_uint(&r->drops, 1);
+    goto out;
+  }
+
+  if (pad) {
+    rec = (struct log_rec *)(r->buf + pos);
+    rec->size = pad;
+    rec->prio = LOG_REC_PAD;
+    head += pad;
+    pos = 0;
+  }
+  rec = (struct log_rec *)(r->buf + pos);
+  rec->size = need;
+  rec->seq = atomic_add_uint(&log_seq, 1);
+  rec->prio = prio;
+  rec->sec = time(NULL);
+  memcpy(rec->str, r->fmt, len);
+  rec->str[len] = '\0';
+  atomic_store_uint(&r->head, head + need);
+
+  /* Wake the Logger if it has gone to sleep */
+  atomic_fence();
+  if (atomic_load_uint(&log_idle) && atomic_xchg_uint(&log_idle, 0))
+    cgsem_post(&log_sem);
+out:
+  atomic_store_uint(&r->busy, 0);
+  return true;
+}
+
+/* The next record of a ring, skipping padding, or NULL if it is empty */
+static struct log_rec *log_ring_peek(struct log_ring *r)
+{
+  unsigned int head = atomic_load_uint(&r->head);
+
+  while (r->tail != head) {
+    struct log_rec *rec = (struct log_rec *)(r->buf + (r->tail & (LOG_RING_SIZE - 1)));
+
+    if (rec->prio != LOG_REC_PAD)
+      return rec;
+    atomic_store_uint(&r->tail, r->tail + rec->size);
+  }
+  return NULL;
+}
+
+/* Writes out everything queued, oldest first. Needs log_drain_lock. */
+static int log_drain(void)
+{
+  struct log_ring *first, *r, *best;
+  struct log_rec *rec, *best_rec;
+  unsigned int drops = 0;
+  int n = 0;
+
+  mutex_lock(&log_rings_lock);
+  first = log_rings;
+  mutex_unlock_noyield(&log_rings_lock);
+
+  for (;;) {
+    best = NULL;
+    best_rec = NULL;
+    for (r = first; r; r = r->next) {
+      rec = log_ring_peek(r);
+      if (rec && (!best_rec || (int)(rec->seq - best_rec->seq) < 0)) {
+        best = r;
+        best_rec = rec;
+      }
+    }
+    if (!best)
+      break;
+
+    mutex_lock(&console_lock);
+    log_write(best_rec->prio, best_rec->sec, best_rec->str, false);
+    mutex_unlock_noyield(&console_lock);
+    atomic_store_uint(&best->tail, best->tail + best_rec->size);
+    n++;
+  }
+
+  for (r = first; r; r = r->next) {
+    unsigned int d = atomic_load_uint(&r->drops);
+
+    drops += d - r->drops_seen;
+    r->drops_seen = d;
+  }
+  if (unlikely(drops)) {
+    char str[64];
+
+    log_drops += drops;
+    snprintf(str, sizeof(str), "Logging fell behind, %u messages dropped", drops);
+    mutex_lock(&console_lock);
+    log_write(LOG_WARNING, time(NULL), str, false);
+    mutex_unlock_noyield(&console_lock);
+    n++;
+  }
+
+  if (n) {
+    mutex_lock(&console_lock);
+    fflush(stderr);
+    mutex_unlock_noyield(&console_lock);
+  }
+  return n;
+}
+
+static void *log_thread(void __maybe_unused *userdata)
+{
+#ifndef WIN32
+  sigset_t set;
+
+  /* A shutdown signal handled here would wait on the drain lock we hold */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+
+  RenameThread("Logger");
+
+  while (1) {
+    int n;
+
+    mutex_lock(&log_drain_lock);
+    n = log_drain();
+    if (!n) {
+      /* Producers check log_idle after queueing, so one that queued
+       * before it was set is caught by the second drain */
+      atomic_store_uint(&log_idle, 1);
+      atomic_fence();
+      n = log_drain();
+    }
+    mutex_unlock_noyield(&log_drain_lock);
+
+    if (!n)
+      cgsem_mswait(&log_sem, 1000);
+    atomic_store_uint(&log_idle, 0);
+  }
+
+  return NULL;
+}
+
+/* Hands logging over to the Logger thread. Any redirection of stderr must
+ * have been done by now. */
+void log_start(void)
+{
+  if (opt_log_sync || log_async)
+    return;
+
+  mutex_init(&log_rings_lock);
+  mutex_init(&log_drain_lock);
+  cgsem_init(&log_sem);
+  if (unlikely(pthread_key_create(&log_key, log_ring_put))) {
+    applog(LOG_WARNING, "Failed to create log key, logging synchronously");
+    return;
+  }
+  log_stderr = !isatty(fileno((FILE *)stderr));
+
+  atomic_store_uint(&log_async, 1);
+  if (unlikely(pthread_create(&log_pth, NULL, log_thread, NULL))) {
+    atomic_store_uint(&log_async, 0);
+    applog(LOG_WARNING, "Failed to create log thread, logging synchronously");
+    return;
+  }
+  atexit(log_stop);
+}
+
+/* Writes out whatever is queued and goes back to logging synchronously. The
+ * Logger is left asleep rather than joined, this may run at exit from any
+ * thread. A thread caught inside log_queue by a signal or a cancel never
+ * finishes its record, so the wait for the others is bounded and our own
+ * ring is not waited on at all. */
+void log_stop(void)
+{
+  struct log_ring *r, *own;
+  int spins;
+
+  if (!log_async)
+    return;
+  atomic_store_uint(&log_async, 0);
+  atomic_fence();
+
+  own = (struct log_ring *)pthread_getspecific(log_key);
+  mutex_lock(&log_rings_lock);
+  r = log_rings;
+  mutex_unlock(&log_rings_lock);
+  for (; r; r = r->next) {
+    for (spins = 0; r != own && atomic_load_uint(&r->busy) && spins < 1000; spins++)
+      sched_yield();
+  }
+
+  mutex_lock(&log_drain_lock);
+  log_drain();
+  mutex_unlock(&log_drain_lock);
+}
+
 void applog(int prio, const char* fmt, ...)
 {
   va_list args;
@@ -60,7 +498,21 @@ void applogsiz(int prio, int size, const char* fmt, ...)
 void vapplogsiz(int prio, int size, const char* fmt, va_list args)
 {
   if ((opt_debug || prio != LOG_DEBUG)) {
-    char *tmp42 = (char *)calloc(size + 1, 1);
+    char *tmp42;
+
+    if (!log_wanted(prio))
+      return;
+    if (log_async) {
+      va_list aq;
+      bool queued;
+
+      va_copy(aq, args);
+      queued = log_queue(prio, size, fmt, aq);
+      va_end(aq);
+      if (queued)
+        return;
+    }
+    tmp42 = (char *)calloc(size + 1, 1);
     vsnprintf(tmp42, size, fmt, args);
     _applog(prio, tmp42, false);
     free(tmp42);
@@ -80,83 +532,30 @@ void vapplogsiz(int prio, int size, const char* fmt, va_list args)
  */
 void _applog(int prio, const char *str, bool force)
 {
+  /* Whatever is queued goes first. The trylock is in case this is the
+   * Logger itself on its way out. */
+  if (force && log_async && !mutex_trylock(&log_drain_lock)) {
+    log_drain();
+    mutex_unlock(&log_drain_lock);
+  }
+
 #ifdef HAVE_SYSLOG_H
   if (use_syslog) {
     syslog(prio, "%s", str);
+    return;
   }
-#else
-  if (0) {}
 #endif
-  else {
-
-#ifdef DEV_DEBUG_MODE
-    if(prio == LOG_DEBUG) {
-      __debug("", str);
-    }
-#endif
-
-    bool write_console = opt_debug_console || (opt_verbose && prio != LOG_DEBUG) || prio <= opt_log_level;
-    bool write_stderr = !isatty(fileno((FILE *)stderr));
-    if (!(write_console || write_stderr))
-      return;
-
-    char datetime[64];
-    struct timeval tv = {0, 0};
-    struct tm *tm;
-
-    cgtime(&tv);
-
-    const time_t tmp_time = tv.tv_sec;
-    tm = localtime(&tmp_time);
-
-    /* Day changed. */
-    if (opt_log_show_date && (last_date_output_day != tm->tm_mday)) {
-      last_date_output_day = tm->tm_mday;
-      char date_output_str[64];
-      snprintf(date_output_str, sizeof(date_output_str), "Log date is now %d-%02d-%02d",
-        tm->tm_year + 1900,
-        tm->tm_mon + 1,
-        tm->tm_mday);
-      _applog(prio, date_output_str, force);
-    }
 
-    if (opt_log_show_date) {
-      snprintf(datetime, sizeof(datetime), "[%d-%02d-%02d %02d:%02d:%02d] ",
-        tm->tm_year + 1900,
-        tm->tm_mon + 1,
-        tm->tm_mday,
-        tm->tm_hour,
-        tm->tm_min,
-        tm->tm_sec);
-    }
-    else {
-      snprintf(datetime, sizeof(datetime), "[%02d:%02d:%02d] ",
-        tm->tm_hour,
-        tm->tm_min,
-        tm->tm_sec);
-    }
-
-    if (write_console || write_stderr) {
-      /* Mutex could be locked by dead thread on shutdown so forcelog will
-       * invalidate any console lock status. */
-      if (force) {
-        mutex_trylock(&console_lock);
-        mutex_unlock(&console_lock);
-      }
-
-      mutex_lock(&console_lock);
-      /* Only output to stderr if it's not going to the screen as well */
-      if (write_stderr) {
-        fprintf(stderr, "%s%s\n", datetime, str); /* atomic write to stderr */
-        fflush(stderr);
-      }
-
-      if (write_console) {
-        _my_log_curses(prio, datetime, str);
-      }
-      mutex_unlock(&console_lock);
-    }
+  /* Mutex could be locked by dead thread on shutdown so forcelog will
+   * invalidate any console lock status. */
+  if (force) {
+    mutex_trylock(&console_lock);
+    mutex_unlock(&console_lock);
   }
+
+  mutex_lock(&console_lock);
+  log_output(prio, time(NULL), str, true);
+  mutex_unlock(&console_lock);
 }
 
 void __debug(const char *filename, const char *fmt, ...)
@@ -26,8 +26,11 @@ extern bool want_per_device_stats;
 
 /* global log_level, messages with lower or equal prio are logged */
 extern int opt_log_level;
+extern int log_max_prio;
 
 extern int opt_log_show_date;
+extern bool opt_log_sync;
+extern unsigned int log_drops;
 
 #define LOGBUFSIZ 8192
 
@@ -36,6 +39,8 @@ void applogsiz(int prio, int size, const char* fmt, ...);
 void vapplogsiz(int prio, int size, const char* fmt, va_list args);
 
 extern void _applog(int prio, const char *str, bool force);
+extern void log_start(void);
+extern void log_stop(void);
 
 #define IN_FMT_FFL " in %s %s():%d"
 
@@ -15,6 +15,7 @@
 #endif
 
 #include "algorithm.h"
+#include "sph/sph_sha2.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -240,7 +241,8 @@ static inline int fsync (int fd)
  * the *_PARSE_COMMANDS macros for each listed driver.
  */
 #define DRIVER_PARSE_COMMANDS(DRIVER_ADD_COMMAND) \
-  DRIVER_ADD_COMMAND(opencl)
+  DRIVER_ADD_COMMAND(opencl) \
+  DRIVER_ADD_COMMAND(cpu)
 
 #define DRIVER_ENUM(X) DRIVER_##X,
 #define DRIVER_PROTOTYPE(X) struct device_drv X##_drv;
@@ -495,6 +497,19 @@ enum dev_reason {
 
 #define MIN_SEC_UNSET 99999999
 
+/* Stages a share passes through from the device reporting its nonce to the
+ * pool answering it, each timed into a lat_hist per device and per pool */
+enum share_stage {
+  SHARE_STAGE_CHECK,  /* Nonce reported to hash checked */
+  SHARE_STAGE_QUEUE,  /* Checked to handed to the submit path */
+  SHARE_STAGE_SEND,   /* Handed over to written to the pool */
+  SHARE_STAGE_POOL,   /* Written to answered by the pool */
+  SHARE_STAGE_TOTAL,  /* Nonce reported to answered */
+  SHARE_STAGES
+};
+
+extern const char *share_stage_names[SHARE_STAGES];
+
 struct sgminer_stats {
   uint32_t getwork_calls;
   struct timeval getwork_wait;
@@ -525,6 +540,14 @@ struct sgminer_pool_stats {
   uint64_t times_received;
   uint64_t bytes_received;
   uint64_t net_bytes_received;
+  uint64_t recv_calls;
+  uint64_t send_calls;
+  /* Writes carrying shares, the shares in them and the most in one */
+  uint64_t share_sends;
+  uint64_t shares_sent;
+  uint32_t share_batch_max;
+  /* Shares found and not yet written */
+  uint32_t share_queue;
 };
 
 typedef struct _gpu_sysfs_info {
@@ -643,8 +666,19 @@ struct cgpu_info {
   int dev_throttle_count;
 
   struct sgminer_stats sgminer_stats;
+  struct lat_hist share_lat[SHARE_STAGES];
+  /* From a work restart to the device starting on new work */
+  struct lat_hist restart_lat;
   eth_dag_t eth_dag;
 
+  /* Work handed out by hash_queued_work: unqueued_work waits for the
+   * driver's queue_full to take it, queued_work holds what the driver
+   * has taken until it calls work_completed. */
+  pthread_rwlock_t qlock;
+  struct work *queued_work;
+  struct work *unqueued_work;
+  unsigned int queued_count;
+
   bool shutdown;
 
   struct timeval dev_start_tv;
@@ -661,6 +695,27 @@ struct thread_q {
   pthread_cond_t    cond;
 };
 
+/* Bounded lock free queue for any number of producers and consumers. Each
+ * cell's sequence number says whether it is free for the push at that
+ * position or holds the item for the pop there. Callers that need to block
+ * do their own waiting. */
+struct ring_cell {
+  volatile unsigned int seq;
+  void *data;
+};
+
+struct ring_q {
+  struct ring_cell *cells;
+  unsigned int mask;
+
+  /* Apart so producers and consumers don't share a cache line */
+  char pad1[64];
+  volatile unsigned int head;
+  char pad2[64];
+  volatile unsigned int tail;
+  char pad3[64];
+};
+
 struct thr_info {
   int   id;
   int   device_thread;
@@ -681,6 +736,14 @@ struct thr_info {
 
   bool  work_restart;
   bool  work_update;
+
+  /* Made readable by restart_thread along with work_restart, so a device
+   * loop can wait in poll() on it and its own descriptors. An eventfd, or -1
+   * where there is none and the loop has to keep polling work_restart. */
+  int restart_fd;
+  /* When the oldest restart not yet followed by new work was signalled,
+   * under stats_lock */
+  struct timeval tv_restart;
 };
 
 struct string_elist {
@@ -1086,7 +1149,70 @@ static inline void _cg_wunlock(cglock_t *lock, const char *file, const char *fun
   _mutex_unlock(&lock->mutex, file, func, line);
 }
 
+/* Atomic operations on unsigned ints for the lock free queues. Loads
+ * acquire, stores release, the read-modify-write ones are full barriers. */
+#ifdef _MSC_VER
+static inline unsigned int atomic_load_uint(volatile unsigned int *p)
+{
+  unsigned int v = *p;
+
+  _ReadWriteBarrier();
+  return v;
+}
+
+static inline void atomic_store_uint(volatile unsigned int *p, unsigned int v)
+{
+  _ReadWriteBarrier();
+  *p = v;
+}
+
+static inline bool atomic_cas_uint(volatile unsigned int *p, unsigned int old, unsigned int val)
+{
+  return (unsigned int)InterlockedCompareExchange((volatile LONG *)p, (LONG)val, (LONG)old) == old;
+}
+
+static inline unsigned int atomic_add_uint(volatile unsigned int *p, unsigned int v)
+{
+  return (unsigned int)InterlockedExchangeAdd((volatile LONG *)p, (LONG)v) + v;
+}
+
+static inline unsigned int atomic_xchg_uint(volatile unsigned int *p, unsigned int v)
+{
+  return (unsigned int)InterlockedExchange((volatile LONG *)p, (LONG)v);
+}
+
+#define atomic_fence() MemoryBarrier()
+#else
+static inline unsigned int atomic_load_uint(volatile unsigned int *p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store_uint(volatile unsigned int *p, unsigned int v)
+{
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline bool atomic_cas_uint(volatile unsigned int *p, unsigned int old, unsigned int val)
+{
+  return __atomic_compare_exchange_n(p, &old, val, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int atomic_add_uint(volatile unsigned int *p, unsigned int v)
+{
+  return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline unsigned int atomic_xchg_uint(volatile unsigned int *p, unsigned int v)
+{
+  return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+#define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
 struct pool;
+struct stratum_share;
 
 #define API_MCAST_CODE "FTW"
 #define API_MCAST_ADDR "224.0.0.75"
@@ -1170,6 +1296,10 @@ extern const uint32_t sha256_init_state[];
 extern json_t *json_rpc_call(CURL *curl, char *curl_err_str, const char *url, const char *userpass,
            const char *rpc_req, bool, bool, int *,
            struct pool *pool, bool);
+struct rpc_call;
+extern struct rpc_call *json_rpc_start(CURL *curl, char *curl_err_str, const char *url, const char *userpass,
+           const char *rpc_req, bool probe, bool longpoll, struct pool *pool, bool share);
+extern json_t *json_rpc_finish(struct rpc_call *call, char *curl_err_str, int rc, int *rolltime);
 #endif
 extern const char *proxytype(proxytypes_t proxytype);
 extern char *get_proxy(char *url, struct pool *pool);
@@ -1203,6 +1333,8 @@ extern pthread_cond_t restart_cond;
 
 extern void clear_stratum_shares(struct pool *pool);
 extern void clear_pool_work(struct pool *pool);
+extern void stratum_reactor_drop(struct pool *pool);
+extern void stratum_reactor_reconnect(struct pool *pool);
 extern void set_target(unsigned char *dest_target, double diff, double diff_multiplier2, const int thr_id);
 extern void set_target_neoscrypt(unsigned char *target, double diff, const int thr_id);
 
@@ -1267,6 +1399,9 @@ extern double total_diff1;
 extern int total_getworks, total_stale, total_discarded;
 extern double total_diff_accepted, total_diff_rejected, total_diff_stale;
 extern unsigned int local_work;
+extern unsigned int total_work_allocs, total_work_reused;
+extern unsigned int stale_checks;
+extern double stale_check_rate;
 extern unsigned int total_go, total_ro;
 extern int opt_cutofftemp;
 extern int opt_log_interval;
@@ -1307,6 +1442,12 @@ typedef struct _dev_blk_ctx {
   cl_uint zeroA, zeroB;
   cl_uint oneA, twoA, threeA, fourA, fiveA, sixA, sevenA;
 
+  /* Host side Blake256 midstate of header bytes 0-63, see
+   * blake256_midstate(). Work is never rewritten below byte 64 once
+   * generated (ntime rolling is in the tail), so copies keep it valid. */
+  uint32_t blake256_mid[8];
+  bool blake256_mid_valid;
+
   struct work *work;
 } dev_blk_ctx;
 
@@ -1338,6 +1479,17 @@ struct stratum_work {
   size_t header_len;
   int merkles;
   double diff;
+
+  /* SHA-256 of the coinbase up to nonce2, taken once per job when the
+   * algorithm's coinbase hash starts with one */
+  sph_sha256_context cb_mid;
+  bool cb_mid_valid;
+
+  /* Counted copies of job_id, ntime and the pool's nonce1 that work items
+   * made from this job share */
+  char *job_ref;
+  char *ntime_ref;
+  char *nonce1_ref;
 };
 
 #define RBUFSIZE 8192
@@ -1453,8 +1605,13 @@ struct pool {
   char *stratum_port;
   struct addrinfo stratum_hints;
   SOCKETTYPE sock;
+  /* Received stratum data, unread from sockbuf_head to sockbuf_tail and
+   * already searched for a newline up to sockbuf_scan */
   char *sockbuf;
   size_t sockbuf_size;
+  size_t sockbuf_head;
+  size_t sockbuf_tail;
+  size_t sockbuf_scan;
   char *sockaddr_url; /* stripped url used for sockaddr */
   char *sockaddr_proxy_url;
   char *sockaddr_proxy_port;
@@ -1469,11 +1626,42 @@ struct pool {
   bool stratum_init;
   bool stratum_notify;
   struct stratum_work swork;
+  /* Moves on each time a notify brings a new job_id, so stale_work compares
+   * it with the work's copy instead of the strings */
+  unsigned int job_gen;
   pthread_t stratum_sthread;
   pthread_t stratum_rthread;
   pthread_mutex_t stratum_lock;
   struct thread_q *stratum_q;
   int sshares; /* stratum shares submitted waiting on response */
+  /* Those shares by id and time sent, under sshare_lock, and how many the
+   * pool never answered */
+  struct share_table *share_table;
+  unsigned int shares_expired;
+  /* Time answered shares spent in each stage, under stats_lock */
+  struct lat_hist share_lat[SHARE_STAGES];
+
+  /* Shared stratum reactor, used instead of the two threads above unless
+   * --no-stratum-reactor. While attached the socket is nonblocking and
+   * sends go through sendbuf (under stratum_lock). stratum_fd and
+   * stratum_retry belong to the reactor's connect thread, the resend list
+   * is under sshare_lock. */
+  bool stratum_reactor;
+  bool stratum_attached;
+  char *sendbuf;
+  size_t sendbuf_len;
+  size_t sendbuf_size;
+  int stratum_fd;
+  bool stratum_drop;
+  bool stratum_reconnect;
+  time_t stratum_retry;
+  struct timeval tv_stratum_recv;
+  struct stratum_share *stratum_resend;
+
+  /* Shares waiting to be written, under sshare_lock. Whichever thread holds
+   * share_send_lock writes all of them at once. */
+  struct stratum_share *share_pending;
+  pthread_mutex_t share_send_lock;
 
   /* GBT variables */
   bool has_gbt;
@@ -1511,66 +1699,74 @@ struct pool {
 #define GETWORK_MODE_STRATUM 'S'
 #define GETWORK_MODE_GBT 'G'
 
-struct work {
-  unsigned char data[256];
-  unsigned char midstate[32];
-  unsigned char target[32];
-  unsigned char hash[32];
-  unsigned char mixhash[32];
-
-  unsigned char device_target[32];
-  double    device_diff;
-  double    share_diff;
-  double	network_diff;
-
+/* Fields only some algorithm families use. They live in a side allocation
+ * so struct work stays small for everything else, see work_ethash() and
+ * friends. */
+struct work_ethash {
   uint32_t eth_epoch;
   uint64_t Nonce;
-  
-  /* cryptonight stuff */
+  unsigned char mixhash[32];
+};
+
+struct work_cn {
   uint32_t XMRTarget;
   uint8_t XMRBlob[76];
-    
   uint32_t XMRNonce;
-  
-  unsigned char equihash_data[1487];
-
-  int   rolls;
-  int   drv_rolllimit; /* How much the driver can roll ntime */
+};
 
-  dev_blk_ctx blk;
+struct work_equihash {
+  unsigned char equihash_data[1487];
+};
 
-  struct thr_info *thr;
-  int   thr_id;
+struct work {
+  /* What hash_pop, stale_work and share submission look at, kept together
+   * in the first cache lines */
   struct pool *pool;
+  int   id;
+  unsigned int  work_block;
+  int   rolltime;
+  bool    clone;
+  bool    stratum;
+  bool    mandatory;
+  bool    stale;
   struct timeval  tv_staged;
+  double    work_difficulty;
+  double    sdiff;
+  char    *job_id;
+  unsigned int  job_gen;
+  char    *ntime;
+  char    *nonce1;
+  uint64_t  nonce2;
+  size_t    nonce2_len;
+  struct thr_info *thr;
+  int   thr_id;
+  int   rolls;
+  int   drv_rolllimit; /* How much the driver can roll ntime */
 
   bool    mined;
-  bool    clone;
   bool    cloned;
-  int   rolltime;
   bool    longpoll;
-  bool    stale;
-  bool    mandatory;
   bool    block;
+  bool    gbt;
+  char    getwork_mode;
 
-  bool    stratum;
-  char    *job_id;
-  uint64_t  nonce2;
-  size_t    nonce2_len;
-  char    *ntime;
-  double    sdiff;
-  char    *nonce1;
+  unsigned char data[256];
+  unsigned char midstate[32];
+  unsigned char target[32];
+  unsigned char hash[32];
+
+  unsigned char device_target[32];
+  double    device_diff;
+  double    share_diff;
+  double	network_diff;
+
+  dev_blk_ctx blk;
 
-  bool    gbt;
   char    *coinbase;
   int   gbt_txns;
 
-  unsigned int  work_block;
-  int   id;
   UT_hash_handle  hh;
 
-  double    work_difficulty;
-
   // Allow devices to identify work if multiple sub-devices
   int   subid;
   // Allow devices to flag work for their own purposes
@@ -1583,9 +1779,35 @@ struct work {
   struct timeval  tv_cloned;
   struct timeval  tv_work_start;
   struct timeval  tv_work_found;
-  char    getwork_mode;
+
+  /* Monotonic times the share passed each stage, see enum share_stage */
+  cgtimer_t t_found;
+  cgtimer_t t_tested;
+  cgtimer_t t_queued;
+  cgtimer_t t_sent;
+
+  /* The algorithm family ext was allocated for, ALGO_UNK if none */
+  algorithm_type_t ext_type;
+  void    *ext;
 };
 
+extern void *__work_ext(struct work *work, algorithm_type_t type);
+
+static inline struct work_ethash *work_ethash(struct work *work)
+{
+  return (struct work_ethash *)(work->ext_type == ALGO_ETHASH ? work->ext : __work_ext(work, ALGO_ETHASH));
+}
+
+static inline struct work_cn *work_cn(struct work *work)
+{
+  return (struct work_cn *)(work->ext_type == ALGO_CRYPTONIGHT ? work->ext : __work_ext(work, ALGO_CRYPTONIGHT));
+}
+
+static inline struct work_equihash *work_equihash(struct work *work)
+{
+  return (struct work_equihash *)(work->ext_type == ALGO_EQUIHASH ? work->ext : __work_ext(work, ALGO_EQUIHASH));
+}
+
 #define TAILBUFSIZ 64
 
 #define tailsprintf(buf, bufsiz, fmt, ...) do { \
@@ -1604,6 +1826,11 @@ extern bool test_nonce(struct work *work, uint32_t nonce);
 extern bool submit_tested_work(struct thr_info *thr, struct work *work);
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
 extern struct work *get_work(struct thr_info *thr, const int thr_id);
+extern struct work *get_queued(struct cgpu_info *cgpu);
+extern void work_completed(struct cgpu_info *cgpu, struct work *work);
+extern void hash_queued_work(struct thr_info *mythr);
+extern void thr_restart_drain(struct thr_info *thr);
+extern void thr_restart_done(struct thr_info *thr);
 extern void _wlog(const char *str);
 extern void _wlogprint(const char *str);
 extern int curses_int(const char *query);
@@ -1630,9 +1857,15 @@ extern void pool_failed(struct pool *pool);
 extern struct thread_q *tq_new(void);
 extern void tq_free(struct thread_q *tq);
 extern bool tq_push(struct thread_q *tq, void *data);
+extern const struct timespec tq_nowait;
 extern void *tq_pop(struct thread_q *tq, const struct timespec *abstime);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
+extern struct ring_q *rq_new(unsigned int size);
+extern void rq_free(struct ring_q *rq);
+extern bool rq_push(struct ring_q *rq, void *data);
+extern void *rq_pop(struct ring_q *rq);
+extern unsigned int rq_count(struct ring_q *rq);
 extern bool successful_connect;
 extern void adl(void);
 extern void app_restart(void);
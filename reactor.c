@@ -0,0 +1,241 @@
+/*
+ * Copyright 2014 sgminer developers (see AUTHORS.md)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "miner.h"
+#include "reactor.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+
+#define REACTOR_MAX_EVENTS 64
+
+struct reactor_ent {
+  int fd;
+  reactor_cb cb;
+  void *arg;
+  bool dead;
+
+  struct reactor_ent *next_dead;
+  UT_hash_handle hh;
+};
+
+struct reactor {
+  char name[16];
+  int epfd;
+  pthread_t pth;
+
+  /* Held while a batch of events is dispatched so entries cannot be freed
+   * underneath a callback. */
+  pthread_mutex_t lock;
+  struct reactor_ent *ents;
+  struct reactor_ent *graveyard;
+};
+
+static uint32_t to_epoll(uint32_t events)
+{
+  uint32_t ev = 0;
+
+  if (events & REACTOR_IN)
+    ev |= EPOLLIN;
+  if (events & REACTOR_OUT)
+    ev |= EPOLLOUT;
+  if (events & REACTOR_EDGE)
+    ev |= EPOLLET;
+  return ev;
+}
+
+static uint32_t from_epoll(uint32_t ev)
+{
+  uint32_t events = 0;
+
+  if (ev & EPOLLIN)
+    events |= REACTOR_IN;
+  if (ev & EPOLLOUT)
+    events |= REACTOR_OUT;
+  if (ev & (EPOLLERR | EPOLLHUP))
+    events |= REACTOR_ERR;
+  return events;
+}
+
+static inline bool on_reactor_thread(struct reactor *r)
+{
+  return pthread_equal(pthread_self(), r->pth);
+}
+
+static void *reactor_thread(void *userdata)
+{
+  struct reactor *r = (struct reactor *)userdata;
+  struct epoll_event evs[REACTOR_MAX_EVENTS];
+
+  pthread_detach(pthread_self());
+  RenameThread(r->name);
+
+  while (42) {
+    struct reactor_ent *ent;
+    int i, n;
+
+    n = epoll_wait(r->epfd, evs, REACTOR_MAX_EVENTS, -1);
+    if (unlikely(n < 0)) {
+      if (errno == EINTR)
+        continue;
+      applog(LOG_ERR, "%s: epoll_wait failed, errno=%d", r->name, errno);
+      cgsleep_ms(100);
+      continue;
+    }
+
+    mutex_lock(&r->lock);
+    for (i = 0; i < n; i++) {
+      ent = (struct reactor_ent *)evs[i].data.ptr;
+      if (ent->dead)
+        continue;
+      ent->cb(ent->fd, from_epoll(evs[i].events), ent->arg);
+    }
+    /* Anything removed before or during this batch can no longer be
+     * returned by a later epoll_wait. */
+    while (r->graveyard) {
+      ent = r->graveyard;
+      r->graveyard = ent->next_dead;
+      free(ent);
+    }
+    mutex_unlock_noyield(&r->lock);
+  }
+
+  return NULL;
+}
+
+struct reactor *reactor_new(const char *name)
+{
+  struct reactor *r = (struct reactor *)calloc(1, sizeof(*r));
+
+  if (unlikely(!r))
+    quit(1, "Failed to calloc reactor");
+
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  mutex_init(&r->lock);
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epfd < 0) {
+    applog(LOG_WARNING, "%s: epoll_create1 failed, errno=%d", name, errno);
+    goto out_free;
+  }
+  if (unlikely(pthread_create(&r->pth, NULL, reactor_thread, r))) {
+    applog(LOG_WARNING, "%s: failed to create reactor thread", name);
+    close(r->epfd);
+    goto out_free;
+  }
+  applog(LOG_INFO, "%s: reactor started", name);
+  return r;
+
+out_free:
+  mutex_destroy(&r->lock);
+  free(r);
+  return NULL;
+}
+
+bool reactor_add(struct reactor *r, int fd, uint32_t events, reactor_cb cb, void *arg)
+{
+  struct reactor_ent *ent;
+  struct epoll_event ev;
+  bool locked = !on_reactor_thread(r);
+
+  ent = (struct reactor_ent *)calloc(1, sizeof(*ent));
+  if (unlikely(!ent))
+    quit(1, "Failed to calloc reactor_ent");
+  ent->fd = fd;
+  ent->cb = cb;
+  ent->arg = arg;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = to_epoll(events);
+  ev.data.ptr = ent;
+
+  if (locked)
+    mutex_lock(&r->lock);
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    if (locked)
+      mutex_unlock(&r->lock);
+    applog(LOG_WARNING, "%s: failed to add fd %d, errno=%d", r->name, fd, errno);
+    free(ent);
+    return false;
+  }
+  HASH_ADD_INT(r->ents, fd, ent);
+  if (locked)
+    mutex_unlock(&r->lock);
+
+  return true;
+}
+
+bool reactor_mod(struct reactor *r, int fd, uint32_t events)
+{
+  struct reactor_ent *ent;
+  struct epoll_event ev;
+  bool locked = !on_reactor_thread(r), ret = false;
+
+  if (locked)
+    mutex_lock(&r->lock);
+  HASH_FIND_INT(r->ents, &fd, ent);
+  if (ent) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll(events);
+    ev.data.ptr = ent;
+    ret = !epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+  if (locked)
+    mutex_unlock(&r->lock);
+
+  return ret;
+}
+
+void reactor_del(struct reactor *r, int fd)
+{
+  struct reactor_ent *ent;
+  bool locked = !on_reactor_thread(r);
+
+  if (locked)
+    mutex_lock(&r->lock);
+  HASH_FIND_INT(r->ents, &fd, ent);
+  if (ent) {
+    HASH_DEL(r->ents, ent);
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+    ent->dead = true;
+    ent->next_dead = r->graveyard;
+    r->graveyard = ent;
+  }
+  if (locked)
+    mutex_unlock(&r->lock);
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+struct reactor *reactor_new(const char __maybe_unused *name)
+{
+  return NULL;
+}
+
+bool reactor_add(struct reactor __maybe_unused *r, int __maybe_unused fd, uint32_t __maybe_unused events,
+                 reactor_cb __maybe_unused cb, void __maybe_unused *arg)
+{
+  return false;
+}
+
+bool reactor_mod(struct reactor __maybe_unused *r, int __maybe_unused fd, uint32_t __maybe_unused events)
+{
+  return false;
+}
+
+void reactor_del(struct reactor __maybe_unused *r, int __maybe_unused fd)
+{
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
@@ -0,0 +1,28 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A single thread multiplexing many file descriptors with epoll. Callbacks
+ * are run on the reactor thread and must not block. Only available where
+ * epoll exists; reactor_new() returns NULL elsewhere so callers can fall back
+ * to their thread-per-descriptor code. */
+
+#define REACTOR_IN  0x01
+#define REACTOR_OUT 0x02
+#define REACTOR_ERR 0x04
+/* Edge triggered: report a descriptor only when it becomes ready again, so
+ * its callback must read or write until it would block */
+#define REACTOR_EDGE 0x08
+
+struct reactor;
+
+typedef void (*reactor_cb)(int fd, uint32_t events, void *arg);
+
+extern struct reactor *reactor_new(const char *name);
+extern bool reactor_add(struct reactor *r, int fd, uint32_t events, reactor_cb cb, void *arg);
+extern bool reactor_mod(struct reactor *r, int fd, uint32_t events);
+extern void reactor_del(struct reactor *r, int fd);
+
+#endif /* REACTOR_H */
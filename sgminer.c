@@ -56,6 +56,7 @@ char *curly = ":D";
 #include "findnonce.h"
 #include "adl.h"
 #include "driver-opencl.h"
+#include "driver-cpu.h"
 #include "bench_block.h"
 
 #include "algorithm.h"
@@ -64,6 +65,9 @@ char *curly = ":D";
 #include "pool.h"
 #include "config_parser.h"
 #include "events.h"
+#include "reactor.h"
+#include "stratum-json.h"
+#include "sharelog.h"
 
 #if defined(unix) || defined(__APPLE__)
   #include <errno.h>
@@ -71,10 +75,22 @@ char *curly = ":D";
   #include <sys/wait.h>
 #endif
 
-char devpath[8][512];
+#ifdef WIN32
+  #include <fcntl.h>
+  #include <io.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+char devpath[MAX_FPGA_DEVICES][512];
 
-int devbaud = 115200;
+int devbaud[MAX_FPGA_DEVICES];
 int devtimeout = 1;
+bool opt_fpga_reactor = true;
+bool opt_stratum_reactor = true;
+bool opt_fpga_baud_test;
 
 int fd;
 
@@ -121,6 +137,8 @@ bool opt_remoteconf_usecache = false; // use last downloaded copy of the config
 
 int opt_cutofftemp = 95;
 int opt_log_interval = 5;
+int opt_latency_log = 300;
+int opt_submit_threads = 1;
 int opt_queue = 1;
 int opt_scantime = 7;
 int opt_expiry = 28;
@@ -148,6 +166,7 @@ struct list_head scan_devices;
 bool devices_enabled[MAX_DEVICES];
 int opt_devs_enabled;
 static bool opt_display_devs;
+static char *opt_stratum_bench;
 bool opt_removedisabled;
 int total_devices;
 static int most_devices;
@@ -219,7 +238,8 @@ pthread_mutex_t lockstat_lock;
 #endif
 
 pthread_mutex_t hash_lock;
-static pthread_mutex_t *stgd_lock;
+/* Only for sleeping, staged work itself is in lock free queues */
+static pthread_mutex_t stgd_lock;
 pthread_mutex_t console_lock;
 cglock_t ch_lock;
 static pthread_rwlock_t blk_lock;
@@ -242,6 +262,11 @@ pthread_mutex_t restart_lock;
 pthread_cond_t restart_cond;
 
 pthread_cond_t gws_cond;
+static pthread_cond_t staged_cond;
+/* hash_pop threads asleep on staged_cond, and whether the getwork scheduler
+ * is asleep on gws_cond */
+static volatile unsigned int staged_waiters;
+static volatile unsigned int gws_waiting;
 
 double total_rolling;
 double total_mhashes_done;
@@ -263,7 +288,6 @@ int total_accepted, total_rejected;
 double total_diff1;
 int total_getworks, total_stale, total_discarded;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
-static int staged_rollable;
 unsigned int new_blocks;
 static unsigned int work_block;
 unsigned int found_blocks;
@@ -319,18 +343,155 @@ static struct block *blocks = NULL;
 
 int swork_id;
 
-/* For creating a hash database of stratum shares submitted that have not had
- * a response yet */
+/* Stratum shares submitted that have not had a response yet */
 struct stratum_share {
-  UT_hash_handle hh;
   bool block;
   struct work *work;
   int id;
   time_t sshare_time;
   time_t sshare_sent;
+  struct stratum_share *resend_next;
+  /* Timer wheel slot list while in a pool's share_table */
+  struct stratum_share *wheel_next;
+  struct stratum_share **wheel_prev;
+};
+
+/* Seconds a pool has to answer a share before it is counted lost */
+#define STRATUM_SHARE_EXPIRY 120
+/* A power of 2 with more seconds than STRATUM_SHARE_EXPIRY */
+#define SHARE_WHEEL_SLOTS 256
+
+/* Each pool's shares in flight, in an open addressing table by id for
+ * matching the responses and in a timer wheel by the second they were sent
+ * for expiring those never answered, all under sshare_lock. */
+struct share_table {
+  struct stratum_share **slots;
+  unsigned int bits;
+  unsigned int count;
+  struct stratum_share *wheel[SHARE_WHEEL_SLOTS];
+  /* The next second to expire */
+  time_t wheel_time;
 };
 
-static struct stratum_share *stratum_shares = NULL;
+static struct share_table *share_table_new(void)
+{
+  struct share_table *table = (struct share_table *)calloc(sizeof(struct share_table), 1);
+
+  if (unlikely(!table))
+    quit(1, "Failed to calloc share_table");
+  table->bits = 6;
+  table->slots = (struct stratum_share **)calloc(sizeof(struct stratum_share *), 1 << table->bits);
+  if (unlikely(!table->slots))
+    quit(1, "Failed to calloc share_table slots");
+  table->wheel_time = time(NULL);
+  return table;
+}
+
+static inline unsigned int share_slot(const struct share_table *table, int id)
+{
+  return ((uint32_t)id * 2654435761U) >> (32 - table->bits);
+}
+
+static void share_table_insert(struct share_table *table, struct stratum_share *sshare)
+{
+  unsigned int mask = (1 << table->bits) - 1, i;
+
+  for (i = share_slot(table, sshare->id); table->slots[i]; i = (i + 1) & mask)
+    ;
+  table->slots[i] = sshare;
+}
+
+/* Keeps the table at most half full */
+static void share_table_grow(struct share_table *table)
+{
+  struct stratum_share **old = table->slots;
+  unsigned int i, size = 1 << table->bits;
+
+  table->bits++;
+  table->slots = (struct stratum_share **)calloc(sizeof(struct stratum_share *), size * 2);
+  if (unlikely(!table->slots))
+    quit(1, "Failed to calloc share_table slots");
+  for (i = 0; i < size; i++) {
+    if (old[i])
+      share_table_insert(table, old[i]);
+  }
+  free(old);
+}
+
+static void share_table_add(struct share_table *table, struct stratum_share *sshare)
+{
+  struct stratum_share **slot = &table->wheel[sshare->sshare_sent & (SHARE_WHEEL_SLOTS - 1)];
+
+  if ((table->count + 1) * 2 > 1U << table->bits)
+    share_table_grow(table);
+  share_table_insert(table, sshare);
+  table->count++;
+
+  sshare->wheel_next = *slot;
+  if (*slot)
+    (*slot)->wheel_prev = &sshare->wheel_next;
+  sshare->wheel_prev = slot;
+  *slot = sshare;
+}
+
+static struct stratum_share *share_table_find(const struct share_table *table, int id)
+{
+  unsigned int mask = (1 << table->bits) - 1, i;
+
+  for (i = share_slot(table, id); table->slots[i]; i = (i + 1) & mask) {
+    if (table->slots[i]->id == id)
+      return table->slots[i];
+  }
+  return NULL;
+}
+
+/* Removing from a linear probing table moves up any later entry of the run
+ * that would otherwise no longer be found */
+static void share_table_del(struct share_table *table, struct stratum_share *sshare)
+{
+  unsigned int mask = (1 << table->bits) - 1, i, j, k;
+
+  for (i = share_slot(table, sshare->id); table->slots[i] != sshare; i = (i + 1) & mask)
+    ;
+  for (j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask) {
+    k = share_slot(table, table->slots[j]->id);
+    /* Stays put if its home slot lies cyclically in (i, j] */
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    table->slots[i] = table->slots[j];
+    i = j;
+  }
+  table->slots[i] = NULL;
+  table->count--;
+
+  *sshare->wheel_prev = sshare->wheel_next;
+  if (sshare->wheel_next)
+    sshare->wheel_next->wheel_prev = sshare->wheel_prev;
+}
+
+/* Takes out the shares sent before the expiry time, returning them linked by
+ * resend_next. Only the wheel slots for the seconds passed since the last
+ * call are visited. */
+static struct stratum_share *share_table_expire(struct share_table *table, time_t now)
+{
+  time_t expiry = now - STRATUM_SHARE_EXPIRY;
+  struct stratum_share *sshare, *next, *list = NULL;
+  int slots = 0;
+
+  for (; table->wheel_time <= expiry && slots < SHARE_WHEEL_SLOTS; table->wheel_time++, slots++) {
+    for (sshare = table->wheel[table->wheel_time & (SHARE_WHEEL_SLOTS - 1)]; sshare; sshare = next) {
+      next = sshare->wheel_next;
+      if (sshare->sshare_sent > expiry)
+        continue;
+      share_table_del(table, sshare);
+      sshare->resend_next = list;
+      list = sshare;
+    }
+  }
+  if (table->wheel_time <= expiry)
+    table->wheel_time = expiry + 1;
+  return list;
+}
 
 char *opt_socks_proxy = NULL;
 
@@ -343,10 +504,13 @@ char *opt_socks_proxy = NULL;
 struct sigaction termhandler, inthandler;
 #endif
 
-struct thread_q *getq;
-
 static int total_work;
-struct work *staged_work = NULL;
+
+/* Staged work, with rollable getwork masters kept apart so hash_pop can hand
+ * out everything else first */
+#define STAGED_QUEUE_SIZE 4096
+static struct ring_q *staged_q;
+static struct ring_q *rollable_q;
 
 struct schedtime schedstart;
 struct schedtime schedstop;
@@ -471,6 +635,25 @@ static void applog_and_exit(const char *fmt, ...)
 
 static pthread_mutex_t sharelog_lock;
 static FILE *sharelog_file = NULL;
+static bool opt_sharelog_binary;
+
+/* Binary share log. Records are appended to sharelog_buf under
+ * sharelog_lock and written out by the ShareLog thread, which swaps in the
+ * spare buffer once SHARELOG_FLUSH_BYTES are waiting or every
+ * SHARELOG_FLUSH_MS. sharelog_write_lock keeps the spare buffer and the file
+ * to one writer, the thread or the flush at exit. */
+#define SHARELOG_FLUSH_BYTES (64 * 1024)
+#define SHARELOG_FLUSH_MS 1000
+
+static bool sharelog_running;
+static char *sharelog_buf, *sharelog_spare;
+static size_t sharelog_len, sharelog_size, sharelog_spare_size;
+static bool sharelog_kicked;
+static cgsem_t sharelog_sem;
+static pthread_mutex_t sharelog_write_lock;
+/* The URL last named for each pool number */
+static char **sharelog_urls;
+static int sharelog_url_count;
 
 static struct cgpu_info *get_thr_cgpu(int thr_id)
 {
@@ -497,6 +680,150 @@ struct cgpu_info *get_devices(int id)
 
 void enable_device(int i);
 
+/* Needs sharelog_lock */
+static void sharelog_append(const struct sharelog_rec *rec)
+{
+  if (unlikely(sharelog_len + sizeof(*rec) > sharelog_size)) {
+    size_t size = sharelog_size ? sharelog_size * 2 : SHARELOG_FLUSH_BYTES * 2;
+    char *buf = (char *)realloc(sharelog_buf, size);
+
+    if (unlikely(!buf)) {
+      applog(LOG_ERR, "Failed to grow share log buffer, share lost");
+      return;
+    }
+    sharelog_buf = buf;
+    sharelog_size = size;
+  }
+  memcpy(sharelog_buf + sharelog_len, rec, sizeof(*rec));
+  sharelog_len += sizeof(*rec);
+}
+
+/* Adds a pool record if the pool's number is new or was last used for a
+ * different URL, as after a pool is removed. Needs sharelog_lock. */
+static void sharelog_name_pool(struct pool *pool)
+{
+  struct sharelog_rec rec;
+  int n = pool->pool_no;
+
+  if (likely(n < sharelog_url_count && sharelog_urls[n] && !strcmp(sharelog_urls[n], pool->rpc_url)))
+    return;
+
+  if (n >= sharelog_url_count) {
+    char **urls = (char **)realloc(sharelog_urls, (n + 1) * sizeof(char *));
+
+    if (unlikely(!urls))
+      quithere(1, "Failed to realloc sharelog_urls");
+    memset(urls + sharelog_url_count, 0, (n + 1 - sharelog_url_count) * sizeof(char *));
+    sharelog_urls = urls;
+    sharelog_url_count = n + 1;
+  }
+  free(sharelog_urls[n]);
+  sharelog_urls[n] = strdup(pool->rpc_url);
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = SHARELOG_POOL;
+  rec.pool_no = n;
+  strncpy(rec.u.url, pool->rpc_url, sizeof(rec.u.url) - 1);
+  sharelog_append(&rec);
+}
+
+static void sharelog_binary(const char *disposition, const struct work *work, struct cgpu_info *cgpu)
+{
+  struct sharelog_share *share;
+  struct sharelog_rec rec;
+  bool kick = false;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = SHARELOG_SHARE;
+  rec.pool_no = work->pool->pool_no;
+  share = &rec.u.share;
+  share->time = work->tv_work_found.tv_sec;
+  share->device_id = cgpu->device_id;
+  share->thr_id = work->thr_id;
+  strncpy(share->dev, cgpu->drv->name, sizeof(share->dev) - 1);
+  strncpy(share->disposition, disposition, sizeof(share->disposition) - 1);
+  memcpy(share->target, work->target, sizeof(share->target));
+  memcpy(share->hash, work->hash, sizeof(share->hash));
+  memcpy(share->data, work->data, sizeof(share->data));
+
+  mutex_lock(&sharelog_lock);
+  sharelog_name_pool(work->pool);
+  sharelog_append(&rec);
+  if (sharelog_len >= SHARELOG_FLUSH_BYTES && !sharelog_kicked)
+    kick = sharelog_kicked = true;
+  mutex_unlock(&sharelog_lock);
+
+  if (kick)
+    cgsem_post(&sharelog_sem);
+}
+
+/* Writes out everything appended so far */
+static void sharelog_flush(void)
+{
+  char *buf;
+  size_t len, size;
+
+  if (!sharelog_running)
+    return;
+
+  mutex_lock(&sharelog_write_lock);
+  mutex_lock(&sharelog_lock);
+  buf = sharelog_buf;
+  len = sharelog_len;
+  size = sharelog_size;
+  sharelog_buf = sharelog_spare;
+  sharelog_size = sharelog_spare_size;
+  sharelog_len = 0;
+  sharelog_kicked = false;
+  mutex_unlock(&sharelog_lock);
+
+  if (len && (fwrite(buf, len, 1, sharelog_file) != 1 || fflush(sharelog_file)))
+    applog(LOG_ERR, "sharelog fwrite error");
+  sharelog_spare = buf;
+  sharelog_spare_size = size;
+  mutex_unlock(&sharelog_write_lock);
+}
+
+static void *sharelog_thread(void __maybe_unused *userdata)
+{
+  RenameThread("ShareLog");
+
+  while (1) {
+    cgsem_mswait(&sharelog_sem, SHARELOG_FLUSH_MS);
+    sharelog_flush();
+  }
+
+  return NULL;
+}
+
+static void sharelog_start(void)
+{
+  struct sharelog_rec rec;
+  pthread_t pth;
+
+  if (!sharelog_file || !opt_sharelog_binary)
+    return;
+
+#ifdef WIN32
+  _setmode(_fileno(sharelog_file), _O_BINARY);
+#endif
+  mutex_init(&sharelog_write_lock);
+  cgsem_init(&sharelog_sem);
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = SHARELOG_HEADER;
+  rec.u.header.magic = SHARELOG_MAGIC;
+  rec.u.header.version = SHARELOG_VERSION;
+  mutex_lock(&sharelog_lock);
+  sharelog_append(&rec);
+  mutex_unlock(&sharelog_lock);
+
+  sharelog_running = true;
+  if (unlikely(pthread_create(&pth, NULL, sharelog_thread, NULL)))
+    quit(1, "Failed to create sharelog thread");
+  pthread_detach(pth);
+}
+
 static void sharelog(const char*disposition, const struct work*work)
 {
   char *target, *hash, *data;
@@ -512,6 +839,10 @@ static void sharelog(const char*disposition, const struct work*work)
 
   thr_id = work->thr_id;
   cgpu = get_thr_cgpu(thr_id);
+  if (opt_sharelog_binary) {
+    sharelog_binary(disposition, work, cgpu);
+    return;
+  }
   pool = work->pool;
   t = (unsigned long int)(work->tv_work_found.tv_sec);
   target = bin2hex(work->target, sizeof(work->target));
@@ -615,6 +946,8 @@ struct pool *add_pool(void)
     quit(1, "Failed to pthread_cond_init in add_pool");
   cglock_init(&pool->data_lock);
   mutex_init(&pool->stratum_lock);
+  mutex_init(&pool->share_send_lock);
+  pool->share_table = share_table_new();
   cglock_init(&pool->gbt_lock);
   mutex_init(&pool->XMRGlobalNonceLock);
   INIT_LIST_HEAD(&pool->curlring);
@@ -1383,14 +1716,73 @@ char *set_difficulty_multiplier(char *arg)
   return NULL;
 }
 
-static char *set_com0_port(char *arg) { sprintf(devpath[0], "\\\\.\\%s", arg);	applog(LOG_WARNING, "Setting devpath0 to: %s\n", devpath[0]);	return NULL; }
-static char *set_com1_port(char *arg) { sprintf(devpath[1], "\\\\.\\%s", arg);	applog(LOG_WARNING, "Setting devpath0 to: %s\n", devpath[1]);	return NULL; }
-static char *set_com2_port(char *arg) { sprintf(devpath[2], "\\\\.\\%s", arg);	applog(LOG_WARNING, "Setting devpath0 to: %s\n", devpath[2]);	return NULL; }
-static char *set_com3_port(char *arg) { sprintf(devpath[3], "\\\\.\\%s", arg);	applog(LOG_WARNING, "Setting devpath0 to: %s\n", devpath[3]);	return NULL; }
-static char *set_com4_port(char *arg) { sprintf(devpath[4], "\\\\.\\%s", arg);	applog(LOG_WARNING, "Setting devpath0 to: %s\n", devpath[4]);	return NULL; }
-static char *set_com5_port(char *arg) { sprintf(devpath[5], "\\\\.\\%s", arg);	applog(LOG_WARNING, "Setting devpath0 to: %s\n", devpath[5]);	return NULL; }
-static char *set_com6_port(char *arg) { sprintf(devpath[6], "\\\\.\\%s", arg);	applog(LOG_WARNING, "Setting devpath0 to: %s\n", devpath[6]);	return NULL; }
-static char *set_com7_port(char *arg) { sprintf(devpath[7], "\\\\.\\%s", arg);	applog(LOG_WARNING, "Setting devpath0 to: %s\n", devpath[7]);	return NULL; }
+/* Windows needs the \\.\ prefix for COM10 and up, elsewhere the argument
+ * is the tty device path as is. */
+static char *set_com_port(int dev, const char *arg)
+{
+#ifdef WIN32
+  snprintf(devpath[dev], sizeof(devpath[dev]), "\\\\.\\%s", arg);
+#else
+  snprintf(devpath[dev], sizeof(devpath[dev]), "%s", arg);
+#endif
+  applog(LOG_WARNING, "Setting devpath%d to: %s\n", dev, devpath[dev]);
+  return NULL;
+}
+
+/* One rate for every board or a comma separated rate per board */
+static char *set_fpga_baud(const char *arg)
+{
+  char *p, *nextptr;
+  int i, val = 0;
+
+  p = strdup(arg);
+  nextptr = strtok(p, ",");
+  for (i = 0; i < MAX_FPGA_DEVICES && nextptr; i++, nextptr = strtok(NULL, ",")) {
+    val = atoi(nextptr);
+    if (val <= 0) {
+      free(p);
+      return "Invalid value passed to set FPGA baud rate";
+    }
+    devbaud[i] = val;
+  }
+  free(p);
+
+  if (i == 1) {
+    while (i < MAX_FPGA_DEVICES)
+      devbaud[i++] = val;
+  }
+
+  return NULL;
+}
+
+/* Every board's port in one go, e.g. for more boards than --comN covers */
+static char *set_fpga_ports(const char *arg)
+{
+  char *p, *nextptr;
+  int i;
+
+  p = strdup(arg);
+  nextptr = strtok(p, ",");
+  for (i = 0; nextptr; i++, nextptr = strtok(NULL, ",")) {
+    if (i >= MAX_FPGA_DEVICES) {
+      free(p);
+      return "Too many FPGA ports";
+    }
+    set_com_port(i, nextptr);
+  }
+  free(p);
+
+  return NULL;
+}
+
+static char *set_com0_port(char *arg) { return set_com_port(0, arg); }
+static char *set_com1_port(char *arg) { return set_com_port(1, arg); }
+static char *set_com2_port(char *arg) { return set_com_port(2, arg); }
+static char *set_com3_port(char *arg) { return set_com_port(3, arg); }
+static char *set_com4_port(char *arg) { return set_com_port(4, arg); }
+static char *set_com5_port(char *arg) { return set_com_port(5, arg); }
+static char *set_com6_port(char *arg) { return set_com_port(6, arg); }
+static char *set_com7_port(char *arg) { return set_com_port(7, arg); }
 
 /* These options are available from config file or commandline */
 struct opt_table opt_config_table[] = {
@@ -1457,6 +1849,9 @@ struct opt_table opt_config_table[] = {
       opt_set_bool, &opt_compact,
       "Use compact display without per device statistics"),
 #endif
+  OPT_WITH_ARG("--cpu-threads",
+      set_int_0_to_9999, opt_show_intval, &opt_cpu_threads,
+      "Number of CPU mining threads, each pinned to a core, for algorithms with a CPU hash (default: 0, off)"),
   OPT_WITHOUT_ARG("--debug|-D",
       enable_debug, &opt_debug,
       "Enable debug output"),
@@ -1505,6 +1900,15 @@ struct opt_table opt_config_table[] = {
   OPT_WITH_ARG("--failover-switch-delay",
       set_int_1_to_65535, opt_show_intval, &opt_fail_switch_delay,
       "Delay in seconds before switching back to a failed pool"),
+  OPT_WITH_ARG("--fpga-baud",
+      set_fpga_baud, NULL, NULL,
+      "Serial baud rate for FPGA boards, one value for all or comma separated per board, default: 115200"),
+  OPT_WITHOUT_ARG("--fpga-baud-test",
+      opt_set_bool, &opt_fpga_baud_test,
+      "Measure the job to nonce round trip time of each FPGA board at startup"),
+  OPT_WITH_ARG("--fpga-ports",
+      set_fpga_ports, NULL, NULL,
+      "Comma separated serial ports of the FPGA boards, in board order"),
   OPT_WITHOUT_ARG("--fix-protocol",
       opt_set_bool, &opt_fix_protocol,
       "Do not redirect to a different getwork protocol (eg. stratum)"),
@@ -1574,6 +1978,9 @@ struct opt_table opt_config_table[] = {
   OPT_WITH_ARG("--kernel-path|-K",
       opt_set_charp, opt_show_charp, &opt_kernel_path,
       "Specify a path to where kernel files are"),
+  OPT_WITH_ARG("--latency-log",
+      set_int_0_to_9999, opt_show_intval, &opt_latency_log,
+      "Interval in seconds between share latency log lines, 0 to disable"),
   OPT_WITHOUT_ARG("--load-balance",
       set_loadbalance, &pool_strategy,
       "Change multipool strategy from failover to quota based balance"),
@@ -1586,6 +1993,9 @@ struct opt_table opt_config_table[] = {
   OPT_WITHOUT_ARG("--log-show-date|-L",
       opt_set_bool, &opt_log_show_date,
       "Show date on every log line"),
+  OPT_WITHOUT_ARG("--log-sync",
+      opt_set_bool, &opt_log_sync,
+      "Write log messages from the thread that logs them instead of a background thread"),
   OPT_WITHOUT_ARG("--lowmem",
       opt_set_bool, &opt_lowmem,
       "Minimise caching of shares for low memory applications"),
@@ -1606,6 +2016,9 @@ struct opt_table opt_config_table[] = {
   OPT_WITHOUT_ARG("--no-adl",
       opt_set_bool, &opt_noadl,
       "Disable the ATI display library used for monitoring and setting GPU parameters"),
+  OPT_WITHOUT_ARG("--no-fpga-reactor",
+      opt_set_invbool, &opt_fpga_reactor,
+      "Poll each FPGA serial port from its own mining thread instead of one shared reactor thread"),
   OPT_WITHOUT_ARG("--no-pool-disable",
       opt_set_invbool, &opt_disable_pool,
       opt_hidden),
@@ -1615,6 +2028,9 @@ struct opt_table opt_config_table[] = {
   OPT_WITHOUT_ARG("--no-restart",
       opt_set_invbool, &opt_restart,
       "Do not attempt to restart GPUs that hang"),
+  OPT_WITHOUT_ARG("--no-stratum-reactor",
+      opt_set_invbool, &opt_stratum_reactor,
+      "Give each stratum pool its own receive and send threads instead of one shared reactor thread"),
   OPT_WITHOUT_ARG("--no-submit-stale",
       opt_set_invbool, &opt_submit_stale,
       "Don't submit shares if they are detected as stale"),
@@ -1793,6 +2209,9 @@ struct opt_table opt_config_table[] = {
   OPT_WITH_ARG("--sharelog",
       set_sharelog, NULL, NULL,
       "Append share log to file"),
+  OPT_WITHOUT_ARG("--sharelog-binary",
+      opt_set_bool, &opt_sharelog_binary,
+      "Write the share log as binary records in the background, read back with sharelog-decode"),
   OPT_WITH_ARG("--shares",
       opt_set_intval, NULL, &opt_shares,
       "Quit after mining N shares (default: unlimited)"),
@@ -1805,6 +2224,9 @@ struct opt_table opt_config_table[] = {
   OPT_WITH_ARG("--state|--pool-state",
       set_pool_state, NULL, NULL,
       "Specify pool state at startup (default: enabled)"),
+  OPT_WITH_ARG("--submit-threads",
+      set_int_1_to_10, opt_show_intval, &opt_submit_threads,
+      "Number of threads sending shares to getwork and GBT pools"),
   OPT_WITH_ARG("--switcher-mode",
       set_switcher_mode, NULL, NULL,
       "Algorithm/gpu settings switcher mode."),
@@ -1916,6 +2338,9 @@ static struct opt_table opt_cmdline_table[] = {
       display_devs, &nDevs,
       "Display number of detected GPUs, OpenCL platform "
       "information, and exit"),
+  OPT_WITH_ARG("--stratum-bench",
+      opt_set_charp, NULL, &opt_stratum_bench,
+      "Time the stratum parsers on recorded pool traffic and exit"),
   OPT_WITHOUT_ARG("--version|-V",
       opt_version_and_exit, packagename,
       "Display version and exit"),
@@ -1962,12 +2387,26 @@ static void calc_midstate(struct work *work)
 }
 
 
+/* Retired work structs, left zeroed by clean_work, for make_work to hand
+ * out again */
+#define WORK_DEPOT_SIZE 1024
+static struct ring_q *work_depot;
+unsigned int total_work_allocs, total_work_reused;
+
 static struct work *make_work(void)
 {
-  struct work *w = (struct work *)calloc(sizeof(struct work), 1);
+  struct work *w = NULL;
 
-  if (unlikely(!w))
-    quit(1, "Failed to calloc work in make_work");
+  if (likely(work_depot))
+    w = (struct work *)rq_pop(work_depot);
+  if (w)
+    atomic_add_uint(&total_work_reused, 1);
+  else {
+    w = (struct work *)calloc(sizeof(struct work), 1);
+    if (unlikely(!w))
+      quit(1, "Failed to calloc work in make_work");
+    atomic_add_uint(&total_work_allocs, 1);
+  }
 
   cg_wlock(&control_lock);
   w->id = total_work++;
@@ -1978,12 +2417,44 @@ static struct work *make_work(void)
 
 /* This is the central place all work that is about to be retired should be
  * cleaned to remove any dynamically allocated arrays within the struct */
+static size_t work_ext_size(algorithm_type_t type)
+{
+  switch (type) {
+    case ALGO_ETHASH:
+      return sizeof(struct work_ethash);
+    case ALGO_CRYPTONIGHT:
+      return sizeof(struct work_cn);
+    case ALGO_EQUIHASH:
+      return sizeof(struct work_equihash);
+    default:
+      return 0;
+  }
+}
+
+/* Gives work zeroed fields for the algorithm family, as when they were part
+ * of struct work. A work item only ever carries one family's fields. */
+void *__work_ext(struct work *work, algorithm_type_t type)
+{
+  free(work->ext);
+  work->ext = calloc(1, work_ext_size(type));
+  if (unlikely(!work->ext))
+    quit(1, "Failed to calloc work ext in __work_ext");
+  work->ext_type = type;
+  return work->ext;
+}
+
+static void put_work_data(struct work *w)
+{
+  rstr_put(w->job_id);
+  rstr_put(w->ntime);
+  rstr_put(w->coinbase);
+  rstr_put(w->nonce1);
+  free(w->ext);
+}
+
 void clean_work(struct work *w)
 {
-  free(w->job_id);
-  free(w->ntime);
-  free(w->coinbase);
-  free(w->nonce1);
+  put_work_data(w);
   memset(w, 0, sizeof(struct work));
 }
 
@@ -1992,7 +2463,8 @@ void clean_work(struct work *w)
 void free_work(struct work *w)
 {
   clean_work(w);
-  free(w);
+  if (unlikely(!work_depot || !rq_push(work_depot, w)))
+    free(w);
 }
 
 static void calc_diff(struct work *work, double known);
@@ -2175,6 +2647,7 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
   unsigned char *merkleroot;
   struct timeval now;
   uint64_t nonce2le;
+  char *cbhex;
   int offsetMerkleRoot, offsetTime, offsetBits, offsetNonce, offsetPadding, lenPadding, nonceLen, headerLen;
 
   applog(LOG_DEBUG, "gen_gbt_work()");
@@ -2228,13 +2701,15 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 
   memcpy(work->target, pool->gbt_target, 32);
 
-  work->coinbase = bin2hex(pool->coinbase, pool->coinbase_len);
+  cbhex = bin2hex(pool->coinbase, pool->coinbase_len);
+  work->coinbase = rstr_new(cbhex);
+  free(cbhex);
 
   /* For encoding the block data on submission */
   work->gbt_txns = pool->gbt_txns + 1;
 
   if (pool->gbt_workid)
-    work->job_id = strdup(pool->gbt_workid);
+    work->job_id = rstr_new(pool->gbt_workid);
   cg_runlock(&pool->gbt_lock);
 
   flip32(work->data + offsetMerkleRoot, merkleroot);
@@ -2247,8 +2722,8 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
     // Equihash is little endian -> swab32 first 140 bytes
     for (int i = 0; i < 140; i += 4)
       for (int j = 0; j < 4; j++)
-        work->equihash_data[i + j] = work->data[i + 3-j];
-    add_var_int(work->equihash_data + offsetNonce + 32, 1344);
+        work_equihash(work)->equihash_data[i + j] = work->data[i + 3-j];
+    add_var_int(work_equihash(work)->equihash_data + offsetNonce + 32, 1344);
   }
 
   if (lenPadding > 0) {
@@ -2594,7 +3069,7 @@ static bool work_decode_eth(struct pool *pool, struct work *work, json_t *val, j
   else
     cg_dlock(&pool->data_lock);
   //work->height = strtoul(BlockHeightStr + 2, NULL, 16) / 30000UL;
-  work->eth_epoch = pool->eth_cache.current_epoch;
+  work_ethash(work)->eth_epoch = pool->eth_cache.current_epoch;
   cg_runlock(&pool->data_lock);
 
   memcpy(work->data, EthWork, 32);
@@ -2634,20 +3109,9 @@ void decay_time(double *f, double fadd, double fsecs)
   *f /= ftotal;
 }
 
-static int __total_staged(void)
-{
-  return HASH_COUNT(staged_work);
-}
-
 static int total_staged(void)
 {
-  int ret;
-
-  mutex_lock(stgd_lock);
-  ret = __total_staged();
-  mutex_unlock(stgd_lock);
-
-  return ret;
+  return rq_count(staged_q) + rq_count(rollable_q);
 }
 
 #ifdef HAVE_CURSES
@@ -3100,20 +3564,52 @@ void logwin_update(void)
 #endif
 
 static void restart_threads(void);
+static void flush_queue(struct cgpu_info *cgpu);
+
+const char *share_stage_names[SHARE_STAGES] = {
+  "Check", "Queue", "Send", "Pool", "Total"
+};
+
+/* Times the stages of a share the pool has answered into the histograms of
+ * the device that found it and the pool */
+static void share_latency(const struct work *work, struct cgpu_info *cgpu)
+{
+  cgtimer_t t[SHARE_STAGES];
+  struct pool *pool = work->pool;
+  double ms[SHARE_STAGES];
+  int i;
+
+  t[0] = work->t_found;
+  t[1] = work->t_tested;
+  t[2] = work->t_queued;
+  t[3] = work->t_sent;
+  cgtimer_time(&t[4]);
+  for (i = 0; i < SHARE_STAGE_TOTAL; i++)
+    ms[i] = cgtimer_tdiff_ms(&t[i + 1], &t[i]);
+  ms[SHARE_STAGE_TOTAL] = cgtimer_tdiff_ms(&t[4], &t[0]);
+
+  mutex_lock(&stats_lock);
+  for (i = 0; i < SHARE_STAGES; i++) {
+    lat_hist_add(&cgpu->share_lat[i], ms[i]);
+    lat_hist_add(&pool->share_lat[i], ms[i]);
+  }
+  mutex_unlock(&stats_lock);
+}
 
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
  * same time is zero so there is no point adding extra locking */
 static void
-share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
-       char *hashshow, bool resubmit, char *worktime)
+__share_result(bool accepted, const char *reject_reason, const char *err_reason, int err_len,
+         const struct work *work, char *hashshow, bool resubmit, char *worktime)
 {
   struct pool *pool = work->pool;
   struct cgpu_info *cgpu;
 
   cgpu = get_thr_cgpu(work->thr_id);
+  share_latency(work, cgpu);
 
-  if (json_is_true(res) || (work->gbt && json_is_null(res)) || (pool->algorithm.type == ALGO_CRYPTONIGHT && json_is_null(err))) {
+  if (accepted) {
     mutex_lock(&stats_lock);
     cgpu->accepted++;
     total_accepted++;
@@ -3184,27 +3680,17 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 
       strcpy(reason, "");
 
-      if (!work->gbt)
-        res = json_object_get(val, "reject-reason");
-      if (res) {
-        const char *reasontmp = json_string_value(res);
-
-        size_t reasonLen = strlen(reasontmp);
+      if (reject_reason) {
+        size_t reasonLen = strlen(reject_reason);
         if (reasonLen > 28)
           reasonLen = 28;
         reason[0] = ' '; reason[1] = '(';
-        memcpy(2 + reason, reasontmp, reasonLen);
+        memcpy(2 + reason, reject_reason, reasonLen);
         reason[reasonLen + 2] = ')'; reason[reasonLen + 3] = '\0';
-        memcpy(disposition + 7, reasontmp, reasonLen);
+        memcpy(disposition + 7, reject_reason, reasonLen);
         disposition[6] = ':'; disposition[reasonLen + 7] = '\0';
-      } else if (work->stratum && err && json_is_array(err)) {
-        json_t *reason_val = json_array_get(err, 1);
-        char *reason_str;
-
-        if (reason_val && json_is_string(reason_val)) {
-          reason_str = (char *)json_string_value(reason_val);
-          snprintf(reason, 31, " (%s)", reason_str);
-        }
+      } else if (err_reason) {
+        snprintf(reason, 31, " (%.*s)", err_len, err_reason);
       }
 
       applog(LOG_NOTICE, "Rejected %s %s %d %s%s %s%s",
@@ -3239,6 +3725,29 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
   }
 }
 
+/* Works out the result and any reason given for a reject from a pool's
+ * JSON reply */
+static void
+share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
+       char *hashshow, bool resubmit, char *worktime)
+{
+  const char *reject_reason = NULL, *err_reason = NULL;
+  struct pool *pool = work->pool;
+  bool accepted;
+
+  accepted = json_is_true(res) || (work->gbt && json_is_null(res)) || (pool->algorithm.type == ALGO_CRYPTONIGHT && json_is_null(err));
+  if (!accepted) {
+    if (!work->gbt)
+      res = json_object_get(val, "reject-reason");
+    if (res)
+      reject_reason = json_string_value(res);
+    else if (work->stratum && err && json_is_array(err))
+      err_reason = json_string_value(json_array_get(err, 1));
+  }
+  __share_result(accepted, reject_reason, err_reason, err_reason ? (int)strlen(err_reason) : 0,
+           work, hashshow, resubmit, worktime);
+}
+
 static void show_hash(struct work *work, char *hashshow)
 {
   unsigned char rhash[32];
@@ -3287,29 +3796,18 @@ static void print_status(int thr_id)
 }
 
 
-static bool submit_upstream_work(struct work *work, CURL *curl, char *curl_err_str, bool resubmit)
+/* Builds the request submitting a share to a getwork or GBT pool */
+static char *submit_upstream_req(struct work *work)
 {
+  struct pool *pool = work->pool;
   char *hexstr = NULL;
-  json_t *val, *res, *err;
   char *s;
-  bool rc = false;
-  int thr_id = work->thr_id;
-  struct cgpu_info *cgpu;
-  struct pool *pool = work->pool;
-  int rolltime;
-  struct timeval tv_submit, tv_submit_reply;
-  char hashshow[64 + 4] = "";
-  char worktime[200] = "";
-  struct timeval now;
-  double dev_runtime;
-
-  cgpu = get_thr_cgpu(thr_id);
 
   if(work->pool->algorithm.type == ALGO_ETHASH)
   {
 	  s = (char *)malloc(sizeof(char) * (128 + 16 + 512));
-	  uint64_t tmp = bswap_64(work->Nonce);
-	  char *ASCIIMixHash = bin2hex(work->mixhash, 32);
+	  uint64_t tmp = bswap_64(work_ethash(work)->Nonce);
+	  char *ASCIIMixHash = bin2hex(work_ethash(work)->mixhash, 32);
 	  char *ASCIIPoWHash = bin2hex(work->data, 32);
 	  char *ASCIINonce = bin2hex((const unsigned char*)&tmp, 8);
 
@@ -3322,8 +3820,8 @@ static bool submit_upstream_work(struct work *work, CURL *curl, char *curl_err_s
   else if(work->pool->algorithm.type == ALGO_EQUIHASH)
   {
     /* equihash block: header (108) + nonce (32) + numbersolutions (3) + solution (1344) - total of 1487 , times 2 for hex string (2974) + json string (50) */
-    const int bin_len = sizeof(work->equihash_data);
-    char *result = bin2hex(work->equihash_data, bin_len);  // block header
+    const int bin_len = sizeof(work_equihash(work)->equihash_data);
+    char *result = bin2hex(work_equihash(work)->equihash_data, bin_len);  // block header
     const int len = 2*bin_len;
     char workid[256];
 
@@ -3408,15 +3906,30 @@ static bool submit_upstream_work(struct work *work, CURL *curl, char *curl_err_s
   }
   applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->rpc_url, s);
   s = (char *)realloc_strcat(s, "\n");
+  free(hexstr);
 
-  cgtime(&tv_submit);
-  /* issue JSON-RPC request */
-  val = json_rpc_call(curl, curl_err_str, pool->rpc_url, pool->rpc_userpass, s, false, false, &rolltime, pool, true);
-  cgtime(&tv_submit_reply);
-  free(s);
+  return s;
+}
+
+/* Handles a getwork or GBT pool's answer to a share, val being NULL if the
+ * call failed. Returns false if the share should be sent again. */
+static bool submit_upstream_result(struct work *work, json_t *val, bool resubmit,
+           struct timeval *tv_submit, struct timeval *tv_submit_reply)
+{
+  json_t *res, *err;
+  bool rc = false;
+  int thr_id = work->thr_id;
+  struct cgpu_info *cgpu;
+  struct pool *pool = work->pool;
+  char hashshow[64 + 4] = "";
+  char worktime[200] = "";
+  struct timeval now;
+  double dev_runtime;
+
+  cgpu = get_thr_cgpu(thr_id);
 
   if (unlikely(!val)) {
-    applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
+    applog(LOG_INFO, "submit_upstream_result json_rpc_call failed");
     if (!pool_tset(pool, &pool->submit_fail)) {
       total_ro++;
       pool->remotefail_occasions++;
@@ -3426,7 +3939,6 @@ static bool submit_upstream_work(struct work *work, CURL *curl, char *curl_err_s
       }
       applog(LOG_WARNING, "%s communication failure, caching submissions", get_pool_name(pool));
     }
-    cgsleep_ms(5000);
     goto out;
   } else if (pool_tclear(pool, &pool->submit_fail))
     applog(LOG_WARNING, "%s communication resumed, submitting work", get_pool_name(pool));
@@ -3446,15 +3958,15 @@ static bool submit_upstream_work(struct work *work, CURL *curl, char *curl_err_s
               (struct timeval *)&(work->tv_getwork_reply));
       double work_time = tdiff((struct timeval *)&(work->tv_work_found),
               (struct timeval *)&(work->tv_work_start));
-      double work_to_submit = tdiff(&tv_submit,
+      double work_to_submit = tdiff(tv_submit,
               (struct timeval *)&(work->tv_work_found));
-      double submit_time = tdiff(&tv_submit_reply, &tv_submit);
+      double submit_time = tdiff(tv_submit_reply, tv_submit);
       int diffplaces = 3;
 
       time_t tmp_time = work->tv_getwork.tv_sec;
       tm = localtime(&tmp_time);
       memcpy(&tm_getwork, tm, sizeof(struct tm));
-      tmp_time = tv_submit_reply.tv_sec;
+      tmp_time = tv_submit_reply->tv_sec;
       tm = localtime(&tmp_time);
       memcpy(&tm_submit_reply, tm, sizeof(struct tm));
 
@@ -3509,7 +4021,6 @@ static bool submit_upstream_work(struct work *work, CURL *curl, char *curl_err_s
 
   rc = true;
 out:
-  free(hexstr);
   return rc;
 }
 
@@ -3821,6 +4332,8 @@ static void kill_timeout(struct thr_info *thr)
   cg_completion_timeout(&thr_info_cancel_join, thr, 1000);
 }
 
+static void thr_restart_close(struct thr_info *thr);
+
 static void kill_mining(void)
 {
   struct thr_info *thr;
@@ -3833,6 +4346,7 @@ static void kill_mining(void)
     thr = mining_thr[i];
     forcelog(LOG_DEBUG, "Waiting for thread %d to finish...", thr->id);
     thr_info_cancel_join(thr);
+    thr_restart_close(thr);
   }
   rd_unlock(&mining_thr_lock);
 }
@@ -4043,87 +4557,298 @@ static void roll_work(struct work *work)
   work->id = total_work++;
 }
 
-static void *submit_work_thread(void *userdata)
-{
-  struct work *work = (struct work *)userdata;
-  struct pool *pool = work->pool;
-  bool resubmit = false;
-  struct curl_ent *ce;
+/* Shares for getwork and GBT pools are sent by a fixed set of submit
+ * threads, each running its transfers on one curl multi handle. The multi
+ * handle keeps connections to the pool alive between shares, and a burst of
+ * shares waits for one of a few connections rather than each starting a
+ * thread and a connection of its own. */
 
-  pthread_detach(pthread_self());
+/* Most connections each submit thread opens to one host */
+#define SUBMIT_HOST_CONNECTIONS 4
+/* Easy handles each submit thread keeps for reuse */
+#define SUBMIT_SPARE_CURLS 8
 
-  RenameThread("SubmitWork");
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define HAVE_CURL_MULTI_POLL 1
+#endif
 
-  applog(LOG_DEBUG, "Creating extra submit work thread");
+struct submit_req {
+  struct work *work;
+  char *s;
+  CURL *curl;
+  struct rpc_call *call;
+  char curl_err_str[CURL_ERROR_SIZE];
+  bool resubmit;
+  struct timeval tv_submit;
+  struct timeval tv_retry;
+  struct submit_req *next;
+};
 
-  ce = pop_curl_entry(pool);
-  /* submit solution to bitcoin via JSON-RPC */
-  while (!submit_upstream_work(work, ce->curl, ce->curl_err_str, resubmit)) {
-    if (opt_lowmem) {
-      applog(LOG_NOTICE, "%s share being discarded to minimise memory cache", get_pool_name(pool));
-      break;
-    }
-    resubmit = true;
-    if (stale_work(work, true)) {
-      applog(LOG_NOTICE, "%s share became stale while retrying submit, discarding", get_pool_name(pool));
+struct submit_worker {
+  CURLM *multi;
+  int active;
+  /* Failed shares waiting to be sent again */
+  struct submit_req *retry;
+  CURL *spare[SUBMIT_SPARE_CURLS];
+  int spares;
+};
 
-      mutex_lock(&stats_lock);
-      total_stale++;
-      pool->stale_shares++;
-      total_diff_stale += work->work_difficulty;
-      pool->diff_stale += work->work_difficulty;
-      mutex_unlock(&stats_lock);
-      break;
-    }
+static struct thread_q *submit_q;
+static struct submit_worker *submit_workers;
+
+static void submit_start(struct submit_worker *worker, struct submit_req *req)
+{
+  struct pool *pool = req->work->pool;
 
-    /* pause, then restart work-request loop */
-    applog(LOG_INFO, "json_rpc_call failed on submit_work, retrying");
+  if (!req->curl) {
+    if (worker->spares)
+      req->curl = worker->spare[--worker->spares];
+    else if (unlikely(!(req->curl = curl_easy_init())))
+      quit(1, "Failed to curl_easy_init in submit_start");
   }
-  push_curl_entry(ce, pool);
 
-  free(work);
-  return NULL;
+  cgtime(&req->tv_submit);
+  cgtimer_time(&req->work->t_sent);
+  req->call = json_rpc_start(req->curl, req->curl_err_str, pool->rpc_url, pool->rpc_userpass,
+           req->s, false, false, pool, true);
+  curl_easy_setopt(req->curl, CURLOPT_PRIVATE, (void *)req);
+  curl_multi_add_handle(worker->multi, req->curl);
+  worker->active++;
 }
 
-static struct work *make_clone(struct work *work)
+static void submit_req_free(struct submit_worker *worker, struct submit_req *req)
 {
-  struct work *work_clone = copy_work(work);
-
-  work_clone->clone = true;
-  cgtime((struct timeval *)&(work_clone->tv_cloned));
-  work_clone->longpoll = false;
-  work_clone->mandatory = false;
-  /* Make cloned work appear slightly older to bias towards keeping the
-   * master work item which can be further rolled */
-  work_clone->tv_staged.tv_sec -= 1;
+  if (worker->spares < SUBMIT_SPARE_CURLS)
+    worker->spare[worker->spares++] = req->curl;
+  else
+    curl_easy_cleanup(req->curl);
+  free(req->s);
+  free_work(req->work);
+  free(req);
+}
+
+/* Retries a failed share after 5 seconds as long as it is still worth it */
+static void submit_done(struct submit_worker *worker, struct submit_req *req, CURLcode result)
+{
+  struct work *work = req->work;
+  struct pool *pool = work->pool;
+  struct timeval tv_submit_reply;
+  int rolltime;
+  json_t *val;
+
+  curl_multi_remove_handle(worker->multi, req->curl);
+  worker->active--;
+  cgtime(&tv_submit_reply);
+  val = json_rpc_finish(req->call, req->curl_err_str, result, &rolltime);
+  req->call = NULL;
+
+  if (submit_upstream_result(work, val, req->resubmit, &req->tv_submit, &tv_submit_reply)) {
+    submit_req_free(worker, req);
+    return;
+  }
+
+  if (opt_lowmem) {
+    applog(LOG_NOTICE, "%s share being discarded to minimise memory cache", get_pool_name(pool));
+    submit_req_free(worker, req);
+    return;
+  }
+  req->resubmit = true;
+  if (stale_work(work, true)) {
+    applog(LOG_NOTICE, "%s share became stale while retrying submit, discarding", get_pool_name(pool));
+
+    mutex_lock(&stats_lock);
+    total_stale++;
+    pool->stale_shares++;
+    total_diff_stale += work->work_difficulty;
+    pool->diff_stale += work->work_difficulty;
+    mutex_unlock(&stats_lock);
+    submit_req_free(worker, req);
+    return;
+  }
+
+  applog(LOG_INFO, "json_rpc_call failed on submit_work, retrying");
+  tv_submit_reply.tv_sec += 5;
+  copy_time(&req->tv_retry, &tv_submit_reply);
+  req->next = worker->retry;
+  worker->retry = req;
+}
+
+/* Starts the retries that are due, returning the ms until the next one or
+ * -1 if there are none */
+static long submit_retries(struct submit_worker *worker)
+{
+  struct submit_req *req, **prev = &worker->retry;
+  struct timeval now;
+  long next = -1;
+
+  cgtime(&now);
+  while ((req = *prev)) {
+    long wait = ms_tdiff(&req->tv_retry, &now);
+
+    if (!time_less(&now, &req->tv_retry)) {
+      *prev = req->next;
+      submit_start(worker, req);
+      continue;
+    }
+    if (next < 0 || wait < next)
+      next = wait;
+    prev = &req->next;
+  }
+  return next;
+}
+
+static void submit_queued(struct submit_worker *worker, const struct timespec *abstime)
+{
+  struct submit_req *req;
+  struct work *work;
+
+  while ((work = (struct work *)tq_pop(submit_q, abstime))) {
+    if (!(req = (struct submit_req *)calloc(sizeof(struct submit_req), 1)))
+      quit(1, "Failed to calloc submit_req");
+    req->work = work;
+    req->s = submit_upstream_req(work);
+    submit_start(worker, req);
+    abstime = &tq_nowait;
+  }
+}
+
+static void *submit_work_thread(void *userdata)
+{
+  struct submit_worker *worker = (struct submit_worker *)userdata;
+  char threadname[16];
+
+  pthread_detach(pthread_self());
+
+  snprintf(threadname, sizeof(threadname), "%d/SubmitWork", (int)(worker - submit_workers));
+  RenameThread(threadname);
+
+  while (42) {
+    long next = submit_retries(worker);
+    struct timespec abstime;
+    CURLMsg *msg;
+    int running, left;
+
+    if (!worker->active) {
+      /* Nothing in flight, sleep until a share or a retry is due */
+      if (next >= 0) {
+        struct timespec now;
+        struct timeval tv;
+
+        cgtime(&tv);
+        timeval_to_spec(&now, &tv);
+        ms_to_timespec(&abstime, next);
+        timeraddspec(&abstime, &now);
+      }
+      submit_queued(worker, next >= 0 ? &abstime : NULL);
+      continue;
+    }
+    submit_queued(worker, &tq_nowait);
+
+    curl_multi_perform(worker->multi, &running);
+    while ((msg = curl_multi_info_read(worker->multi, &left))) {
+      struct submit_req *req;
+
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+      submit_done(worker, req, msg->data.result);
+    }
+    if (!worker->active)
+      continue;
+
+    if (next < 0 || next > 1000)
+      next = 1000;
+#ifdef HAVE_CURL_MULTI_POLL
+    /* submit_work_push() wakes this when a share is queued */
+    curl_multi_poll(worker->multi, NULL, 0, next, NULL);
+#else
+    /* Without a wakeup, check the queue every 10ms while busy */
+    curl_multi_wait(worker->multi, NULL, 0, next < 10 ? next : 10, NULL);
+#endif
+  }
+
+  return NULL;
+}
+
+static void submit_work_push(struct work *work)
+{
+  int i;
+
+  if (unlikely(!tq_push(submit_q, work))) {
+    free_work(work);
+    return;
+  }
+#ifdef HAVE_CURL_MULTI_POLL
+  for (i = 0; i < opt_submit_threads; i++)
+    curl_multi_wakeup(submit_workers[i].multi);
+#endif
+}
+
+static void submit_workers_init(void)
+{
+  pthread_t pth;
+  int i;
+
+  submit_q = tq_new();
+  if (unlikely(!submit_q))
+    quit(1, "Failed to tq_new submit_q");
+  submit_workers = (struct submit_worker *)calloc(sizeof(struct submit_worker), opt_submit_threads);
+  if (unlikely(!submit_workers))
+    quit(1, "Failed to calloc submit_workers");
+
+  for (i = 0; i < opt_submit_threads; i++) {
+    struct submit_worker *worker = &submit_workers[i];
+
+    worker->multi = curl_multi_init();
+    if (unlikely(!worker->multi))
+      quit(1, "Failed to curl_multi_init in submit_workers_init");
+    curl_multi_setopt(worker->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)SUBMIT_HOST_CONNECTIONS);
+#ifdef CURLPIPE_MULTIPLEX
+    curl_multi_setopt(worker->multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+    if (unlikely(pthread_create(&pth, NULL, submit_work_thread, (void *)worker)))
+      quit(1, "Failed to create submit_work_thread");
+  }
+}
+
+static struct work *make_clone(struct work *work)
+{
+  struct work *work_clone = copy_work(work);
+
+  work_clone->clone = true;
+  cgtime((struct timeval *)&(work_clone->tv_cloned));
+  work_clone->longpoll = false;
+  work_clone->mandatory = false;
+  /* Make cloned work appear slightly older to bias towards keeping the
+   * master work item which can be further rolled */
+  work_clone->tv_staged.tv_sec -= 1;
 
   return work_clone;
 }
 
 static void stage_work(struct work *work);
+static bool hash_push(struct work *work);
 
 static bool clone_available(void)
 {
-  struct work *work_clone = NULL, *work, *tmp;
+  struct work *work_clone = NULL, *work;
+  unsigned int n = rq_count(rollable_q);
   bool cloned = false;
 
-  mutex_lock(stgd_lock);
-  if (!staged_rollable)
-    goto out_unlock;
-
-  HASH_ITER(hh, staged_work, work, tmp) {
+  /* Masters are taken off the queue while they are rolled, so nothing else
+   * can touch them */
+  while (n-- && (work = (struct work *)rq_pop(rollable_q))) {
     if (can_roll(work) && should_roll(work)) {
       roll_work(work);
       work_clone = make_clone(work);
       roll_work(work);
       cloned = true;
-      break;
     }
+    hash_push(work);
+    if (cloned)
+      break;
   }
 
-out_unlock:
-  mutex_unlock(stgd_lock);
-
   if (cloned) {
     applog(LOG_DEBUG, "Pushing cloned available work to stage thread");
     stage_work(work_clone);
@@ -4167,10 +4892,13 @@ static struct work *clone_work(struct work *work)
 }
 
 #else /* HAVE_LIBCURL */
-static void *submit_work_thread(void __maybe_unused *userdata)
+static void submit_work_push(struct work *work)
+{
+  free_work(work);
+}
+
+static void submit_workers_init(void)
 {
-  pthread_detach(pthread_self());
-  return NULL;
 }
 #endif /* HAVE_LIBCURL */
 
@@ -4180,29 +4908,35 @@ static char *offset_ntime(const char *ntime, int noffset)
 {
   unsigned char bin[4];
   uint32_t h32, *be32 = (uint32_t *)bin;
+  char hex[9];
 
   hex2bin(bin, ntime, 4);
   h32 = be32toh(*be32) + noffset;
   *be32 = htobe32(h32);
 
-  return bin2hex(bin, 4);
+  __bin2hex(hex, bin, 4);
+  return rstr_newn(hex, 8);
 }
 
-/* Duplicates any dynamically allocated arrays within the work struct to
- * prevent a copied work struct from freeing ram belonging to another struct */
+/* Takes references on the strings within the work struct so that a copied
+ * work struct shares them with the original instead of duplicating them.
+ * The algorithm family fields are duplicated, hashing writes to them. */
 static void _copy_work(struct work *work, const struct work *base_work, int noffset)
 {
   int id = work->id;
 
-  clean_work(work);
+  put_work_data(work);
   memcpy(work, base_work, sizeof(struct work));
   /* Keep the unique new id assigned during make_work to prevent copied
    * work from having the same id. */
   work->id = id;
-  if (base_work->job_id)
-    work->job_id = strdup(base_work->job_id);
-  if (base_work->nonce1)
-    work->nonce1 = strdup(base_work->nonce1);
+  if (base_work->ext) {
+    work->ext = NULL;
+    memcpy(__work_ext(work, base_work->ext_type), base_work->ext, work_ext_size(base_work->ext_type));
+  }
+  rstr_get(work->job_id);
+  rstr_get(work->nonce1);
+  rstr_get(work->coinbase);
   if (base_work->ntime) {
     /* If we are passed an noffset the binary work->data ntime and
      * the work->ntime hex string need to be adjusted. */
@@ -4214,7 +4948,7 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
       *work_ntime = htobe32(ntime);
       work->ntime = offset_ntime(base_work->ntime, noffset);
     } else
-      work->ntime = strdup(base_work->ntime);
+      rstr_get(work->ntime);
   } else if (noffset) {
     uint32_t *work_ntime = (uint32_t *)(work->data + 68);
     uint32_t ntime = be32toh(*work_ntime);
@@ -4222,8 +4956,6 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
     ntime += noffset;
     *work_ntime = htobe32(ntime);
   }
-  if (base_work->coinbase)
-    work->coinbase = strdup(base_work->coinbase);
 }
 
 /* Generates a copy of an existing work struct, creating fresh heap allocations
@@ -4262,6 +4994,10 @@ static void pool_died(struct pool *pool)
   }
 }
 
+/* Calls to stale_work, sampled by the watchdog into a rate per second */
+unsigned int stale_checks;
+double stale_check_rate;
+
 static bool stale_work(struct work *work, bool share)
 {
   struct timeval now;
@@ -4269,6 +5005,8 @@ static bool stale_work(struct work *work, bool share)
   struct pool *pool;
   int getwork_delay;
 
+  atomic_add_uint(&stale_checks, 1);
+
   if (work->work_block != work_block) {
     applog(LOG_DEBUG, "Work stale due to block mismatch");
     return true;
@@ -4285,21 +5023,12 @@ static bool stale_work(struct work *work, bool share)
   pool = work->pool;
 
   if (!share && pool->has_stratum) {
-    bool same_job;
-
     if (!pool->stratum_active || !pool->stratum_notify) {
       applog(LOG_DEBUG, "Work stale due to stratum inactive");
       return true;
     }
 
-    same_job = true;
-
-    cg_rlock(&pool->data_lock);
-    if (strcmp(work->job_id, pool->swork.job_id))
-      same_job = false;
-    cg_runlock(&pool->data_lock);
-
-    if (!same_job) {
+    if (work->job_gen != atomic_load_uint(&pool->job_gen)) {
       applog(LOG_DEBUG, "Work stale due to stratum job_id mismatch");
       return true;
     }
@@ -4530,31 +5259,127 @@ void discard_work(struct work *work)
 
 static void wake_gws(void)
 {
-  mutex_lock(stgd_lock);
+  mutex_lock(&stgd_lock);
   pthread_cond_signal(&gws_cond);
-  mutex_unlock(stgd_lock);
+  mutex_unlock(&stgd_lock);
 }
 
-static void discard_stale(void)
+/* Takes everything that was staged off the queues once. Items that match
+ * are discarded, or freed without counting them if discard is false, and
+ * the rest are staged again. Returns the number removed. */
+static int staged_purge(bool (*match)(struct work *, void *), void *arg, bool discard)
 {
-  struct work *work, *tmp;
-  int stale = 0;
+  struct ring_q *queues[] = { staged_q, rollable_q };
+  int i, removed = 0;
 
-  mutex_lock(stgd_lock);
-  HASH_ITER(hh, staged_work, work, tmp) {
-    if (stale_work(work, false)) {
-      HASH_DEL(staged_work, work);
-      discard_work(work);
-      stale++;
+  for (i = 0; i < 2; i++) {
+    unsigned int n = rq_count(queues[i]);
+    struct work *work;
+
+    while (n-- && (work = (struct work *)rq_pop(queues[i]))) {
+      if (match(work, arg)) {
+        if (discard)
+          discard_work(work);
+        else
+          free_work(work);
+        removed++;
+      } else
+        hash_push(work);
     }
   }
-  pthread_cond_signal(&gws_cond);
-  mutex_unlock(stgd_lock);
+
+  return removed;
+}
+
+static bool staged_stale(struct work *work, void __maybe_unused *arg)
+{
+  return stale_work(work, false);
+}
+
+static void discard_stale(void)
+{
+  int stale = staged_purge(staged_stale, NULL, true);
+
+  wake_gws();
 
   if (stale)
     applog(LOG_DEBUG, "Discarded %d stales that didn't match current hash", stale);
 }
 
+static void thr_restart_init(struct thr_info *thr)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  thr->restart_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (unlikely(thr->restart_fd < 0))
+    applog(LOG_WARNING, "Thread %d: eventfd failed (errno=%d), restarts will be polled", thr->id, errno);
+#else
+  thr->restart_fd = -1;
+#endif
+}
+
+/* Closes restart_fd before the thr_info is freed. stats_lock keeps a
+ * concurrent thr_restart_signal from writing to the fd once it is closed. */
+static void thr_restart_close(struct thr_info *thr)
+{
+  int fd;
+
+  mutex_lock(&stats_lock);
+  fd = thr->restart_fd;
+  thr->restart_fd = -1;
+  mutex_unlock(&stats_lock);
+
+  if (fd >= 0)
+    close(fd);
+}
+
+static void thr_restart_signal(struct thr_info *thr)
+{
+  mutex_lock(&stats_lock);
+  if (!thr->tv_restart.tv_sec)
+    cgtime(&thr->tv_restart);
+  thr->work_restart = true;
+#ifdef HAVE_SYS_EVENTFD_H
+  if (thr->restart_fd >= 0) {
+    uint64_t one = 1;
+
+    if (unlikely(write(thr->restart_fd, &one, sizeof(one)) != sizeof(one)))
+      applog(LOG_DEBUG, "Thread %d: restart eventfd write failed (errno=%d)", thr->id, errno);
+  }
+#endif
+  mutex_unlock(&stats_lock);
+}
+
+/* Empties restart_fd once it has woken a wait. The fd only says a restart
+ * may have happened, work_restart is still what the loop acts on. */
+void thr_restart_drain(struct thr_info *thr)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t count;
+
+  if (thr->restart_fd >= 0 && read(thr->restart_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    applog(LOG_DEBUG, "Thread %d: restart eventfd read failed (errno=%d)", thr->id, errno);
+#endif
+}
+
+/* Records the time from the oldest unanswered restart to the device starting
+ * on new work. hash_sole_work calls it for scanhash drivers, queued drivers
+ * call it once the new job is on the device. */
+void thr_restart_done(struct thr_info *thr)
+{
+  struct timeval now;
+
+  if (likely(!thr->tv_restart.tv_sec))
+    return;
+
+  mutex_lock(&stats_lock);
+  if (thr->tv_restart.tv_sec) {
+    cgtime(&now);
+    lat_hist_add(&thr->cgpu->restart_lat, tdiff(&now, &thr->tv_restart) * 1000);
+    thr->tv_restart.tv_sec = thr->tv_restart.tv_usec = 0;
+  }
+  mutex_unlock(&stats_lock);
+}
+
 static void *restart_thread(void __maybe_unused *arg)
 {
   struct pool *cp = current_pool();
@@ -4578,7 +5403,8 @@ static void *restart_thread(void __maybe_unused *arg)
         continue;
       if (cgpu->deven != DEV_ENABLED)
         continue;
-      mining_thr[i]->work_restart = true;
+      thr_restart_signal(mining_thr[i]);
+      flush_queue(cgpu);
       cgpu->drv->flush_work(cgpu);
     }
     rd_unlock(&mining_thr_lock);
@@ -4777,11 +5603,6 @@ out:
   return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
-{
-  return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
-}
-
 static bool work_rollable(struct work *work)
 {
   return (!work->clone && work->rolltime);
@@ -4789,20 +5610,22 @@ static bool work_rollable(struct work *work)
 
 static bool hash_push(struct work *work)
 {
-  bool rc = true;
+  if (unlikely(!rq_push(work_rollable(work) ? rollable_q : staged_q, work))) {
+    applog(LOG_DEBUG, "[THR%d] Staged work queue full, discarding work", work->thr_id);
+    discard_work(work);
+    return false;
+  }
 
-  mutex_lock(stgd_lock);
-  if (work_rollable(work))
-    staged_rollable++;
-  if (likely(!getq->frozen)) {
-    HASH_ADD_INT(staged_work, id, work);
-    HASH_SORT(staged_work, tv_sort);
-  } else
-    rc = false;
-  pthread_cond_broadcast(&getq->cond);
-  mutex_unlock(stgd_lock);
+  /* Pairs with the fence in hash_pop: a thread about to sleep there either
+   * finds this work or is counted in staged_waiters */
+  atomic_fence();
+  if (atomic_load_uint(&staged_waiters)) {
+    mutex_lock(&stgd_lock);
+    pthread_cond_signal(&staged_cond);
+    mutex_unlock(&stgd_lock);
+  }
 
-  return rc;
+  return true;
 }
 
 static void stage_work(struct work *work)
@@ -5522,12 +6345,10 @@ out_unlock:
   }
 }
 
-static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
-         struct stratum_share *sshare)
+static void stratum_share_lag(struct stratum_share *sshare, char *hashshow)
 {
   struct work *work = sshare->work;
   time_t now_t = time(NULL);
-  char hashshow[64];
   int srdiff;
 
   srdiff = now_t - sshare->sshare_sent;
@@ -5536,7 +6357,66 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
            work->pool->pool_no, srdiff);
   }
   show_hash(work, hashshow);
-  share_result(val, res_val, err_val, work, hashshow, false, "");
+}
+
+static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
+         struct stratum_share *sshare)
+{
+  char hashshow[64];
+
+  stratum_share_lag(sshare, hashshow);
+  share_result(val, res_val, err_val, sshare->work, hashshow, false, "");
+}
+
+/* Removes the share the pool is answering from the table of those in
+ * flight, NULL if it is not one of ours */
+static struct stratum_share *stratum_take_share(struct pool *pool, int id)
+{
+  struct stratum_share *sshare;
+
+
+  mutex_lock(&sshare_lock);
+  sshare = share_table_find(pool->share_table, id);
+  if (sshare) {
+    share_table_del(pool->share_table, sshare);
+    pool->sshares--;
+  }
+  mutex_unlock(&sshare_lock);
+
+  return sshare;
+}
+
+static void stratum_untracked_result(struct pool *pool, bool success)
+{
+  double pool_diff;
+
+  /* Since the share is untracked, we can only guess at what the
+   * work difficulty is based on the current pool diff. */
+  cg_rlock(&pool->data_lock);
+  pool_diff = pool->swork.diff;
+  cg_runlock(&pool->data_lock);
+
+  if (success) {
+    applog(LOG_NOTICE, "Accepted untracked stratum share from %s", get_pool_name(pool));
+
+    /* We don't know what device this came from so we can't
+     * attribute the work to the relevant cgpu */
+    mutex_lock(&stats_lock);
+    total_accepted++;
+    pool->accepted++;
+    total_diff_accepted += pool_diff;
+    pool->diff_accepted += pool_diff;
+    mutex_unlock(&stats_lock);
+  } else {
+    applog(LOG_NOTICE, "Rejected untracked stratum share from %s", get_pool_name(pool));
+
+    mutex_lock(&stats_lock);
+    total_rejected++;
+    pool->rejected++;
+    total_diff_rejected += pool_diff;
+    pool->diff_rejected += pool_diff;
+    mutex_unlock(&stats_lock);
+  }
 }
 
 /* Parses stratum json responses and tries to find the id that the request
@@ -5576,24 +6456,10 @@ static bool parse_stratum_response(struct pool *pool, char *s)
 
   id = json_integer_value(id_val);
 
-  mutex_lock(&sshare_lock);
-  HASH_FIND_INT(stratum_shares, &id, sshare);
-  if (sshare) {
-    HASH_DEL(stratum_shares, sshare);
-    pool->sshares--;
-  }
-  mutex_unlock(&sshare_lock);
-
+  sshare = stratum_take_share(pool, id);
   if (!sshare) {
-    double pool_diff;
     bool success = false;
 
-    /* Since the share is untracked, we can only guess at what the
-     * work difficulty is based on the current pool diff. */
-    cg_rlock(&pool->data_lock);
-    pool_diff = pool->swork.diff;
-    cg_runlock(&pool->data_lock);
-
     //for cryptonight, the result contains the "status" object which should = "OK" on accept
     if (pool->algorithm.type == ALGO_CRYPTONIGHT) {
       json_t *res_id, *res_job;
@@ -5634,27 +6500,7 @@ static bool parse_stratum_response(struct pool *pool, char *s)
       success = json_is_true(res_val);
     }
 
-    if (success) {
-      applog(LOG_NOTICE, "Accepted untracked stratum share from %s", get_pool_name(pool));
-
-      /* We don't know what device this came from so we can't
-       * attribute the work to the relevant cgpu */
-      mutex_lock(&stats_lock);
-      total_accepted++;
-      pool->accepted++;
-      total_diff_accepted += pool_diff;
-      pool->diff_accepted += pool_diff;
-      mutex_unlock(&stats_lock);
-    } else {
-      applog(LOG_NOTICE, "Rejected untracked stratum share from %s", get_pool_name(pool));
-
-      mutex_lock(&stats_lock);
-      total_rejected++;
-      pool->rejected++;
-      total_diff_rejected += pool_diff;
-      pool->diff_rejected += pool_diff;
-      mutex_unlock(&stats_lock);
-    }
+    stratum_untracked_result(pool, success);
     goto out;
   }
   stratum_share_result(val, res_val, err_val, sshare);
@@ -5669,27 +6515,65 @@ out:
   return ret;
 }
 
-void clear_stratum_shares(struct pool *pool)
+/* The streaming parser's side of parse_stratum_response(), for plain share
+ * results. Returns -1 for anything else so the line goes to jansson. */
+static int parse_stratum_response_msg(struct pool *pool, const struct stratum_msg *msg)
+{
+  struct stratum_share *sshare;
+  const char *reason = NULL;
+  int reason_len = 0, id;
+  char hashshow[64];
+  bool accepted;
+
+  /* Cryptonight sends jobs in results and reject-reason needs jansson */
+  if (msg->method >= 0 || msg->other || msg->id < 0 || !sjson_int(&msg->tok[msg->id], &id) ||
+      pool->algorithm.type == ALGO_ETHASH || pool->algorithm.type == ALGO_CRYPTONIGHT)
+    return -1;
+  if (msg->result >= 0 && !sjson_is(msg, msg->result, SJSON_TRUE) &&
+      !sjson_is(msg, msg->result, SJSON_FALSE) && !sjson_is(msg, msg->result, SJSON_NULL))
+    return -1;
+  if (msg->error >= 0 && !sjson_is(msg, msg->error, SJSON_NULL)) {
+    int t = sjson_array_get(msg, msg->error, 1);
+
+    if (!sjson_is(msg, msg->error, SJSON_ARRAY))
+      return -1;
+    if (sjson_is(msg, t, SJSON_STRING)) {
+      reason = msg->tok[t].s;
+      reason_len = msg->tok[t].len;
+    }
+  }
+  accepted = sjson_is(msg, msg->result, SJSON_TRUE);
+
+  sshare = stratum_take_share(pool, id);
+  if (!sshare) {
+    stratum_untracked_result(pool, accepted);
+    return false;
+  }
+  stratum_share_lag(sshare, hashshow);
+  __share_result(accepted, NULL, reason, reason_len, sshare->work, hashshow, false, "");
+  free_work(sshare->work);
+  free(sshare);
+
+  return true;
+}
+
+/* Counts shares the pool will no longer answer as stale */
+static void stratum_lost_shares(struct pool *pool, struct stratum_share *list, const char *why)
 {
-  struct stratum_share *sshare, *tmpshare;
+  struct stratum_share *sshare, *next;
   double diff_cleared = 0;
   int cleared = 0;
 
-  mutex_lock(&sshare_lock);
-  HASH_ITER(hh, stratum_shares, sshare, tmpshare) {
-    if (sshare->work->pool == pool) {
-      HASH_DEL(stratum_shares, sshare);
-      diff_cleared += sshare->work->work_difficulty;
-      free_work(sshare->work);
-      pool->sshares--;
-      free(sshare);
-      cleared++;
-    }
+  for (sshare = list; sshare; sshare = next) {
+    next = sshare->resend_next;
+    diff_cleared += sshare->work->work_difficulty;
+    free_work(sshare->work);
+    free(sshare);
+    cleared++;
   }
-  mutex_unlock(&sshare_lock);
 
   if (cleared) {
-    applog(LOG_WARNING, "Lost %d shares due to stratum disconnect on %s", cleared, get_pool_name(pool));
+    applog(LOG_WARNING, "Lost %d shares due to %s on %s", cleared, why, get_pool_name(pool));
     pool->stale_shares += cleared;
     total_stale += cleared;
     pool->diff_stale += diff_cleared;
@@ -5697,20 +6581,54 @@ void clear_stratum_shares(struct pool *pool)
   }
 }
 
-void clear_pool_work(struct pool *pool)
+void clear_stratum_shares(struct pool *pool)
 {
-  struct work *work, *tmp;
-  int cleared = 0;
+  struct share_table *table = pool->share_table;
+  struct stratum_share *sshare, *next, *list = NULL;
+  int i;
 
-  mutex_lock(stgd_lock);
-  HASH_ITER(hh, staged_work, work, tmp) {
-    if (work->pool == pool) {
-      HASH_DEL(staged_work, work);
-      free_work(work);
-      cleared++;
+  mutex_lock(&sshare_lock);
+  for (i = 0; i < SHARE_WHEEL_SLOTS; i++) {
+    for (sshare = table->wheel[i]; sshare; sshare = next) {
+      next = sshare->wheel_next;
+      sshare->resend_next = list;
+      list = sshare;
     }
+    table->wheel[i] = NULL;
   }
-  mutex_unlock(stgd_lock);
+  memset(table->slots, 0, sizeof(struct stratum_share *) << table->bits);
+  table->count = 0;
+  pool->sshares = 0;
+  mutex_unlock(&sshare_lock);
+
+  stratum_lost_shares(pool, list, "stratum disconnect");
+}
+
+/* Gives up on shares the pool has sat on for STRATUM_SHARE_EXPIRY seconds */
+static void stratum_expire_shares(struct pool *pool)
+{
+  struct stratum_share *list, *sshare;
+  int expired = 0;
+
+  mutex_lock(&sshare_lock);
+  list = share_table_expire(pool->share_table, time(NULL));
+  for (sshare = list; sshare; sshare = sshare->resend_next)
+    expired++;
+  pool->sshares -= expired;
+  pool->shares_expired += expired;
+  mutex_unlock(&sshare_lock);
+
+  stratum_lost_shares(pool, list, "no response");
+}
+
+static bool staged_from_pool(struct work *work, void *arg)
+{
+  return work->pool == (struct pool *)arg;
+}
+
+void clear_pool_work(struct pool *pool)
+{
+  int cleared = staged_purge(staged_from_pool, pool, false);
 
   if (cleared)
     applog(LOG_INFO, "Cleared %d work items due to stratum disconnect on pool %d", cleared, pool->pool_no);
@@ -5770,6 +6688,14 @@ static bool cnx_needed(struct pool *pool)
   return false;
 }
 
+/* Whether a pool waiting in wait_lpcurrent() should connect again */
+static bool pool_lpcurrent(struct pool *pool)
+{
+  return cnx_needed(pool) || (pool->state != POOL_DISABLED &&
+         (pool == current_pool() || pool_strategy == POOL_LOADBALANCE ||
+         pool_strategy == POOL_BALANCE));
+}
+
 static void wait_lpcurrent(struct pool *pool);
 static void pool_resus(struct pool *pool);
 static void gen_stratum_work(struct pool *pool, struct work *work);
@@ -5796,6 +6722,306 @@ static bool supports_resume(struct pool *pool)
   return ret;
 }
 
+/* Handles a line with the streaming parser, or jansson for what it leaves.
+ * Returns whether the line was understood. */
+static bool stratum_parse_line(struct pool *pool, char *s)
+{
+  struct stratum_msg msg;
+  bool ret = false;
+  int handled = -1;
+  char *line;
+
+  if (stratum_msg_parse(&msg, s, strlen(s))) {
+    if (msg.method >= 0)
+      handled = parse_method_msg(pool, &msg);
+    else
+      handled = parse_stratum_response_msg(pool, &msg);
+  }
+  if (handled > 0)
+    return true;
+
+  if (handled == 0) {
+    applog(LOG_INFO, "Unknown stratum msg: %s", s);
+    return false;
+  }
+
+  /* s points into the pool's receive buffer, which parse_method reads over
+   * when it handles client.reconnect, so jansson gets a copy */
+  line = strdup(s);
+  if (unlikely(!line))
+    quit(1, "Failed to strdup stratum line");
+  if (parse_method(pool, line) || parse_stratum_response(pool, line))
+    ret = true;
+  else
+    applog(LOG_INFO, "Unknown stratum msg: %s", line);
+  free(line);
+  return ret;
+}
+
+/* Handle one message received from a stratum pool, from its receive thread
+ * or the stratum reactor. */
+static void stratum_handle_line(struct pool *pool, char *s)
+{
+  bool handled;
+
+  /* Check this pool hasn't died while being a backup pool and
+   * has not had its idle flag cleared */
+  stratum_resumed(pool);
+
+  applog(LOG_DEBUG, "%s: parsing %s...", __func__, s);
+
+  handled = stratum_parse_line(pool, s);
+  if (handled && pool->swork.clean) {
+    struct work *work = make_work();
+
+    /* Generate a single work item to update the current
+     * block database */
+    pool->swork.clean = false;
+
+    switch(pool->algorithm.type) {
+      case ALGO_ETHASH:
+        gen_stratum_work_eth(pool, work);
+        break;
+      case ALGO_CRYPTONIGHT:
+        gen_stratum_work_cn(pool, work);
+        break;
+      default:
+        gen_stratum_work(pool, work);
+        break;
+    }
+
+    work->longpoll = true;
+    /* Return value doesn't matter. We're just informing
+     * that we may need to restart. */
+    test_work_current(work);
+    free_work(work);
+  }
+}
+
+/* Scratch pool for the parser benchmark, as if subscribed with a 4 byte
+ * nonce1 and nonce2 */
+static struct pool *stratum_bench_pool(void)
+{
+  struct pool *pool = (struct pool *)calloc(sizeof(struct pool), 1);
+
+  if (unlikely(!pool))
+    quit(1, "Failed to calloc bench pool");
+  cglock_init(&pool->data_lock);
+  pool->name = strdup("bench");
+  pool->algorithm = default_profile.algorithm;
+  pool->nonce1 = strdup("00000000");
+  pool->n1_len = 4;
+  pool->nonce1bin = (unsigned char *)calloc(pool->n1_len, 1);
+  pool->n2size = 4;
+  return pool;
+}
+
+static bool stratum_bench_same(struct pool *a, struct pool *b)
+{
+  int i;
+
+  if (!a->swork.job_id != !b->swork.job_id ||
+      (a->swork.job_id && strcmp(a->swork.job_id, b->swork.job_id)) ||
+      a->swork.clean != b->swork.clean || a->swork.diff != b->swork.diff ||
+      a->next_diff != b->next_diff || a->n1_len != b->n1_len || a->n2size != b->n2size ||
+      a->swork.cb_len != b->swork.cb_len || a->swork.merkles != b->swork.merkles ||
+      memcmp(a->header_bin, b->header_bin, sizeof(a->header_bin)))
+    return false;
+  if (a->swork.cb_len && memcmp(a->coinbase, b->coinbase, a->swork.cb_len))
+    return false;
+  for (i = 0; i < a->swork.merkles; i++) {
+    if (memcmp(a->swork.merkle_bin[i], b->swork.merkle_bin[i], 32))
+      return false;
+  }
+  return true;
+}
+
+/* Decodes a share result the way parse_stratum_response() starts out */
+static int stratum_bench_json_result(char *s)
+{
+  json_error_t err;
+  json_t *val;
+  int ret;
+
+  val = JSON_LOADS(s, &err);
+  if (!val)
+    return 0;
+  ret = json_integer_value(json_object_get(val, "id")) * 2 + json_is_true(json_object_get(val, "result"));
+  json_decref(val);
+  return ret;
+}
+
+static int stratum_bench_msg_result(char *s)
+{
+  struct stratum_msg msg;
+  int id;
+
+  if (!stratum_msg_parse(&msg, s, strlen(s)) || msg.id < 0 || !sjson_int(&msg.tok[msg.id], &id))
+    return stratum_bench_json_result(s);
+  return id * 2 + sjson_is(&msg, msg.result, SJSON_TRUE);
+}
+
+enum stratum_bench_kind {
+  BENCH_RESULT,
+  BENCH_NOTIFY,
+  BENCH_DIFF,
+  BENCH_EXTRANONCE,
+  BENCH_KINDS
+};
+
+static const char *stratum_bench_names[BENCH_KINDS] = {
+  "share results", "notify", "set_difficulty", "set_extranonce"
+};
+
+/* Replays recorded pool traffic through jansson and the streaming parser
+ * and reports messages per second for each. The file has one message per
+ * line, or is a -P debug log whose RECVD lines are used. Jobs, difficulty
+ * and extranonce changes are applied to two scratch pools which must come
+ * out the same. Share results are only decoded, applying them needs the
+ * shares they answer. Extranonce changes are only checked, not timed, as
+ * each one logs a notice whatever the log level. */
+static void stratum_bench(const char *path)
+{
+  int nlines = 0, ntimed = 0, fallbacks = 0, mismatches = 0, passes, pass, i;
+  int counts[BENCH_KINDS] = {0};
+  char **lines = NULL, *buf = NULL, *line;
+  enum stratum_bench_kind *kind = NULL;
+  struct pool *pools[2];
+  struct timeval start, end;
+  int *timed = NULL;
+  double secs[2];
+  int sums[2];
+  size_t n = 0;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if (!fp)
+    quit(1, "Failed to open %s for the stratum benchmark", path);
+  while (getline(&buf, &n, fp) > 0) {
+    enum stratum_bench_kind k;
+    json_error_t err;
+    json_t *val, *m;
+    const char *name;
+
+    line = strstr(buf, "RECVD: ");
+    line = line ? line + 7 : buf;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!(val = JSON_LOADS(line, &err)))
+      continue;
+
+    /* Only what a pool sends in numbers, other methods act on the pool */
+    m = json_object_get(val, "method");
+    name = json_string_value(m);
+    if (!m)
+      k = BENCH_RESULT;
+    else if (name && !strncasecmp(name, "mining.notify", 13))
+      k = BENCH_NOTIFY;
+    else if (name && !strncasecmp(name, "mining.set_difficulty", 21))
+      k = BENCH_DIFF;
+    else if (name && !strncasecmp(name, "mining.set_extranonce", 21))
+      k = BENCH_EXTRANONCE;
+    else
+      k = BENCH_KINDS;
+    if (k == BENCH_KINDS || (k == BENCH_RESULT && !json_object_get(val, "id"))) {
+      json_decref(val);
+      continue;
+    }
+    json_decref(val);
+
+    lines = (char **)realloc(lines, sizeof(char *) * (nlines + 1));
+    kind = (enum stratum_bench_kind *)realloc(kind, sizeof(*kind) * (nlines + 1));
+    if (unlikely(!lines || !kind))
+      quit(1, "Failed to realloc bench lines");
+    kind[nlines] = k;
+    lines[nlines++] = strdup(line);
+  }
+  free(buf);
+  fclose(fp);
+  if (!nlines)
+    quit(1, "No stratum messages found in %s", path);
+
+  timed = (int *)malloc(sizeof(int) * nlines);
+  if (unlikely(!timed))
+    quit(1, "Failed to malloc bench lines");
+  for (i = 0; i < nlines; i++) {
+    struct stratum_msg msg;
+
+    if (kind[i] != BENCH_RESULT && !stratum_msg_parse(&msg, lines[i], strlen(lines[i])))
+      fallbacks++;
+    if (kind[i] != BENCH_EXTRANONCE) {
+      counts[kind[i]]++;
+      timed[ntimed++] = i;
+    }
+  }
+  if (!ntimed)
+    quit(1, "No stratum messages to time in %s", path);
+
+  /* Both parsers must leave a pool in the same state after each message */
+  pools[0] = stratum_bench_pool();
+  pools[1] = stratum_bench_pool();
+  for (i = 0; i < nlines; i++) {
+    struct stratum_msg msg;
+
+    if (kind[i] == BENCH_RESULT)
+      continue;
+    parse_method(pools[0], lines[i]);
+    if (!stratum_msg_parse(&msg, lines[i], strlen(lines[i])) || parse_method_msg(pools[1], &msg) < 0)
+      parse_method(pools[1], lines[i]);
+    if (!stratum_bench_same(pools[0], pools[1])) {
+      applog(LOG_WARNING, "Stratum bench: parsers disagree on %s", lines[i]);
+      mismatches++;
+    }
+  }
+
+  /* Only warnings from here, so the logger isn't what gets timed */
+  log_max_prio = LOG_WARNING;
+  passes = 200000 / ntimed + 1;
+  for (pass = 0; pass < 2; pass++) {
+    sums[pass] = 0;
+    cgtime(&start);
+    for (i = 0; i < passes * ntimed; i++) {
+      int l = timed[i % ntimed];
+      char *s = lines[l];
+      struct stratum_msg msg;
+
+      if (!pass) {
+        if (kind[l] != BENCH_RESULT)
+          parse_method(pools[0], s);
+        else
+          sums[pass] += stratum_bench_json_result(s);
+      } else {
+        if (kind[l] == BENCH_RESULT)
+          sums[pass] += stratum_bench_msg_result(s);
+        else if (!stratum_msg_parse(&msg, s, strlen(s)) || parse_method_msg(pools[1], &msg) < 0)
+          parse_method(pools[1], s);
+      }
+    }
+    cgtime(&end);
+    secs[pass] = tdiff(&end, &start);
+  }
+  log_max_prio = LOG_DEBUG;
+  if (sums[0] != sums[1])
+    mismatches++;
+
+  applog(LOG_WARNING, "Stratum bench: %d messages from %s, %d left to jansson",
+         nlines, path, fallbacks);
+  applog(LOG_WARNING, "Stratum bench: timed %d %s, %d %s, %d %s; %d %s checked only",
+         counts[BENCH_NOTIFY], stratum_bench_names[BENCH_NOTIFY],
+         counts[BENCH_DIFF], stratum_bench_names[BENCH_DIFF],
+         counts[BENCH_RESULT], stratum_bench_names[BENCH_RESULT],
+         nlines - ntimed, stratum_bench_names[BENCH_EXTRANONCE]);
+  applog(LOG_WARNING, "Stratum bench: jansson %.0f msgs/s, streaming %.0f msgs/s (%.2fx)",
+         passes * ntimed / secs[0], passes * ntimed / secs[1], secs[0] / secs[1]);
+  if (mismatches)
+    quit(1, "Stratum bench: %d messages parsed differently", mismatches);
+
+  for (i = 0; i < nlines; i++)
+    free(lines[i]);
+  free(lines);
+  free(kind);
+  free(timed);
+}
+
 /* One stratum receive thread per pool that has stratum waits on the socket
  * checking for new messages and for the integrity of the socket connection. We
  * reset the connection based on the integrity of the receive side only as the
@@ -5819,6 +7045,8 @@ static void *stratum_rthread(void *userdata)
     if (unlikely(pool->removed))
       break;
 
+    stratum_expire_shares(pool);
+
     /* Check to see whether we need to maintain this connection
      * indefinitely or just bring it up when we switch to this
      * pool */
@@ -5854,7 +7082,7 @@ static void *stratum_rthread(void *userdata)
       applog(LOG_DEBUG, "Stratum select failed on %s with value %d", get_pool_name(pool), sel_ret);
       s = NULL;
     } else
-      s = recv_line(pool);
+      s = recv_line_view(pool, NULL);
     if (!s) {
       applog(LOG_NOTICE, "Stratum connection to %s interrupted", get_pool_name(pool));
       pool->getfail_occasions++;
@@ -5883,52 +7111,295 @@ static void *stratum_rthread(void *userdata)
       continue;
     }
 
-    /* Check this pool hasn't died while being a backup pool and
-     * has not had its idle flag cleared */
-    stratum_resumed(pool);
+    stratum_handle_line(pool, s);
+  }
 
-    applog(LOG_DEBUG, "%s: parsing %s...", __func__, s);
-    
-    if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-      applog(LOG_INFO, "Unknown stratum msg: %s", s);
-    else if (pool->swork.clean) {
-      struct work *work = make_work();
-
-      /* Generate a single work item to update the current
-       * block database */
-      pool->swork.clean = false;
-      
-      switch(pool->algorithm.type) {
-	    case ALGO_LBRY:
-		  gen_stratum_work(pool, work);
-		  break;
-        case ALGO_ETHASH:
-          gen_stratum_work_eth(pool, work);
-          break;        
-        case ALGO_CRYPTONIGHT:
-          gen_stratum_work_cn(pool, work);
-          break;          
-        default:
-          gen_stratum_work(pool, work);
-		  break;
-      }
+out:
+  return NULL;
+}
 
-      work->longpoll = true;
-      /* Return value doesn't matter. We're just informing
-       * that we may need to restart. */
-      test_work_current(work);
-      free_work(work);
+/* Build the mining.submit message for a found share in s and give the share
+ * a unique id. Returns false if the share can't be submitted. */
+static bool stratum_share_msg(struct pool *pool, struct stratum_share *sshare, char *s, size_t s_size)
+{
+  struct work *work = sshare->work;
+
+  applog(LOG_DEBUG, "stratum_share_msg() algorithm = %s", pool->algorithm.name);
+
+  if (pool->algorithm.type == ALGO_ETHASH) {
+    uint64_t tmp = bswap_64(work_ethash(work)->Nonce);
+    char *ASCIIMixHash = bin2hex(work_ethash(work)->mixhash, 32);
+    char *ASCIIPoWHash = bin2hex(work->data, 32);
+    char *ASCIINonce = bin2hex((const unsigned char*)&tmp, 8);
+
+    mutex_lock(&sshare_lock);
+    /* Give the stratum share a unique id */
+    sshare->id = swork_id++;
+    mutex_unlock(&sshare_lock);
+    snprintf(s, s_size, "{\"id\": %d, \"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"0x%s\", \"0x%s\", \"0x%s\"]}", sshare->id, pool->rpc_user, work->job_id, ASCIINonce, ASCIIPoWHash, ASCIIMixHash);
+
+    free(ASCIINonce);
+    free(ASCIIMixHash);
+    free(ASCIIPoWHash);
+  }
+  else if (pool->algorithm.type == ALGO_CRYPTONIGHT) {
+    char *ASCIIResult;
+    char *ASCIINonce = bin2hex((const unsigned char*)&(work_cn(work)->XMRNonce), 4);
+
+    ASCIIResult = bin2hex(work->hash, 32);
+
+    mutex_lock(&sshare_lock);
+    /* Give the stratum share a unique id */
+    sshare->id = swork_id++;
+    mutex_unlock(&sshare_lock);
+
+    snprintf(s, s_size, "{\"method\": \"submit\", \"params\": {\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}, \"id\":%d}", pool->XMRAuthID, work->job_id, ASCIINonce, ASCIIResult, sshare->id);
+
+    free(ASCIINonce);
+    free(ASCIIResult);
+  }
+  else if (pool->algorithm.type == ALGO_EQUIHASH) {
+    char *nonce;
+    char *solution;
+
+    //get nonce minus extranonce set by server
+    nonce = bin2hex(work_equihash(work)->equihash_data+108, 32);
+    solution = bin2hex(work_equihash(work)->equihash_data+140, 1347);
+
+    mutex_lock(&sshare_lock);
+    /* Give the stratum share a unique id */
+    sshare->id = swork_id++;
+    mutex_unlock(&sshare_lock);
+    snprintf(s, s_size, "{\"id\": %d, \"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"]}", sshare->id, pool->rpc_user, work->job_id, work->ntime, nonce+strlen(work->nonce1), solution);
+
+    free(nonce);
+    free(solution);
+  }
+  else {
+    char noncehex[12], nonce2hex[20];
+    unsigned char nonce2[8];
+    uint32_t nonce;
+
+    if (unlikely(work->nonce2_len > 8)) {
+      applog(LOG_ERR, "%s asking for inappropriately long nonce2 length %d", get_pool_name(pool), (int)work->nonce2_len);
+      applog(LOG_ERR, "Not attempting to submit shares");
+      return false;
     }
-    free(s);
+
+    // Neoscrypt is little endian
+    if (pool->algorithm.type == ALGO_NEOSCRYPT)
+      nonce = htobe32(*((uint32_t *)(work->data + 76)));
+    else if (pool->algorithm.type == ALGO_LBRY)
+      nonce = *((uint32_t *)(work->data + 108));
+    else
+      nonce = *((uint32_t *)(work->data + 76));
+
+    __bin2hex(noncehex, (const unsigned char *)&nonce, 4);
+
+    *((uint64_t *)nonce2) = htole64(work->nonce2);
+    __bin2hex(nonce2hex, nonce2, work->nonce2_len);
+
+    mutex_lock(&sshare_lock);
+    /* Give the stratum share a unique id */
+    sshare->id = swork_id++;
+    mutex_unlock(&sshare_lock);
+
+    snprintf(s, s_size,
+      "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+      pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, sshare->id);
   }
 
-out:
-  return NULL;
+  return true;
+}
+
+/* A share for the work, to be queued for sending */
+static struct stratum_share *stratum_new_share(struct work *work)
+{
+  struct stratum_share *sshare;
+
+  if (!(sshare = (struct stratum_share *)calloc(sizeof(struct stratum_share), 1)))
+    quit(1, "%s: calloc() failed on sshare.", __func__);
+  sshare->sshare_time = time(NULL);
+  /* This work item is freed in parse_stratum_response */
+  sshare->work = work;
+
+  applog(LOG_INFO, "Submitting share %08lx to %s", (long unsigned int)htole32(((uint32_t *)work->hash)[6]), get_pool_name(work->pool));
+  return sshare;
+}
+
+#define STRATUM_SHARE_MSG_SIZE 4096
+/* Most shares put in one write */
+#define STRATUM_SHARE_BATCH 32
+
+/* One attempt at sending shares linked by resend_next, serialised into one
+ * buffer and written at once. The shares are entered in the pool's
+ * share_table before the write so an answer always finds them, and the
+ * write itself happens outside sshare_lock. If it fails, those still in
+ * the table are taken back out and returned. */
+static struct stratum_share *stratum_send_shares(struct pool *pool, struct stratum_share *list)
+{
+  struct sgminer_pool_stats *stats = &pool->sgminer_pool_stats;
+  struct stratum_share *sshare, **prev = &list;
+  char s[STRATUM_SHARE_MSG_SIZE];
+  size_t len = 0, size = 0;
+  /* The batch as entered in the table. Once the lock is dropped the shares
+   * may be answered or cleared and freed, so only the pointer and id are
+   * trusted when taking them back. */
+  struct share_sent {
+    struct stratum_share *sshare;
+    int id;
+  } *batch;
+  char *buf = NULL;
+  time_t now;
+  bool sent;
+  int n = 0, i;
+
+  while ((sshare = *prev)) {
+    size_t slen;
+
+    if (!stratum_share_msg(pool, sshare, s, sizeof(s))) {
+      *prev = sshare->resend_next;
+      free_work(sshare->work);
+      free(sshare);
+      continue;
+    }
+
+    /* Requests are newline separated, stratum_send adds the last one */
+    slen = strlen(s);
+    if (len + slen + 2 > size) {
+      size = (len + slen + 2) * 2;
+      buf = (char *)realloc(buf, size);
+      if (unlikely(!buf))
+        quit(1, "Failed to realloc share buffer in stratum_send_shares");
+    }
+    if (len)
+      buf[len++] = '\n';
+    memcpy(buf + len, s, slen + 1);
+    len += slen;
+    n++;
+    prev = &sshare->resend_next;
+  }
+  if (!n)
+    return NULL;
+
+  batch = (struct share_sent *)malloc(n * sizeof(*batch));
+  if (unlikely(!batch))
+    quit(1, "Failed to malloc share batch in stratum_send_shares");
+
+  now = time(NULL);
+  mutex_lock(&sshare_lock);
+  for (sshare = list, i = 0; sshare; sshare = sshare->resend_next, i++) {
+    int ssdiff;
+
+    /* Stamped before the write so an answer is never seen first */
+    cgtimer_time(&sshare->work->t_sent);
+    sshare->sshare_sent = now;
+    ssdiff = sshare->sshare_sent - sshare->sshare_time;
+    if (opt_debug || ssdiff > 0) {
+      applog(LOG_INFO, "Pool %d stratum share submission lag time %d seconds",
+             pool->pool_no, ssdiff);
+    }
+
+    batch[i].sshare = sshare;
+    batch[i].id = sshare->id;
+    share_table_add(pool->share_table, sshare);
+    pool->sshares++;
+  }
+  mutex_unlock(&sshare_lock);
+
+  sent = stratum_send(pool, buf, len);
+  free(buf);
+
+  mutex_lock(&sshare_lock);
+  if (likely(sent)) {
+    stats->share_sends++;
+    stats->shares_sent += n;
+    if ((uint32_t)n > stats->share_batch_max)
+      stats->share_batch_max = n;
+  } else {
+    /* Shares cleared meanwhile, on a disconnect, are already dealt with */
+    prev = &list;
+    for (i = 0; i < n; i++) {
+      sshare = batch[i].sshare;
+      if (share_table_find(pool->share_table, batch[i].id) != sshare)
+        continue;
+      share_table_del(pool->share_table, sshare);
+      pool->sshares--;
+      *prev = sshare;
+      prev = &sshare->resend_next;
+    }
+    *prev = NULL;
+  }
+  mutex_unlock(&sshare_lock);
+  free(batch);
+
+  if (likely(sent)) {
+    if (pool_tclear(pool, &pool->submit_fail))
+        applog(LOG_WARNING, "%s communication resumed, submitting work", get_pool_name(pool));
+    applog(LOG_DEBUG, "Successfully submitted %d share(s), adding to share table", n);
+    return NULL;
+  }
+
+  if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
+    applog(LOG_WARNING, "%s stratum share submission failure", get_pool_name(pool));
+    total_ro++;
+    pool->remotefail_occasions++;
+  }
+  return list;
+}
+
+/* A share that failed to send is worth trying again while the pool's
+ * session id still matches, for up to 2 minutes */
+static bool stratum_share_resumable(struct pool *pool, struct stratum_share *sshare)
+{
+  bool sessionid_match;
+
+  if (opt_lowmem) {
+    applog(LOG_DEBUG, "Lowmem option prevents resubmitting stratum share");
+    return false;
+  }
+  if (time(NULL) >= sshare->sshare_time + 120)
+    return false;
+
+  cg_rlock(&pool->data_lock);
+  sessionid_match = (pool->nonce1 && !strcmp(sshare->work->nonce1, pool->nonce1));
+  cg_runlock(&pool->data_lock);
+
+  if (!sessionid_match) {
+    applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
+    return false;
+  }
+  return true;
+}
+
+static void stratum_discard_share(struct pool *pool, struct stratum_share *sshare)
+{
+  applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
+  free_work(sshare->work);
+  free(sshare);
+  pool->stale_shares++;
+  total_stale++;
+}
+
+/* Discards the shares no longer worth sending and returns the rest */
+static struct stratum_share *stratum_keep_resumable(struct pool *pool, struct stratum_share *list)
+{
+  struct stratum_share *sshare, **prev = &list;
+
+  while ((sshare = *prev)) {
+    if (stratum_share_resumable(pool, sshare)) {
+      prev = &sshare->resend_next;
+      continue;
+    }
+    *prev = sshare->resend_next;
+    stratum_discard_share(pool, sshare);
+  }
+  return list;
 }
 
 /* Each pool has one stratum send thread for sending shares to avoid many
  * threads being created for submission since all sends need to be serialised
- * anyway. */
+ * anyway. Everything queued by the time it wakes goes out in one write. */
 static void *stratum_sthread(void *userdata)
 {
   struct pool *pool = (struct pool *)userdata;
@@ -5943,16 +7414,10 @@ static void *stratum_sthread(void *userdata)
   if (!pool->stratum_q)
     quit(1, "Failed to create stratum_q in stratum_sthread");
 
-  size_t s_size = 4096;
-  char *s = (char*) malloc(s_size);
   while (42) {
-    char noncehex[12], nonce2hex[20];
-    struct stratum_share *sshare;
-    uint32_t *hash32, nonce;
-    unsigned char nonce2[8];
-    uint64_t *nonce2_64;
+    struct stratum_share *list = NULL, **tail = &list;
     struct work *work;
-    bool submitted = false;
+    int n = 0;
 
     if (unlikely(pool->removed))
       break;
@@ -5961,200 +7426,358 @@ static void *stratum_sthread(void *userdata)
     if (unlikely(!work))
       quit(1, "Stratum q returned empty work");
 
-    hash32 = (uint32_t*) work->hash;
-    if (!(sshare = (struct stratum_share *)calloc(sizeof(struct stratum_share), 1))) {
-      quit(1, "%s: calloc() failed on sshare.", __func__);
-    }
-    if(pool->algorithm.type == ALGO_ETHASH) {
-      sshare->sshare_time = time(NULL);
-      /* This work item is freed in parse_stratum_response */
-      sshare->work = work;
+    do {
+      *tail = stratum_new_share(work);
+      tail = &(*tail)->resend_next;
+      n++;
+    } while (n < STRATUM_SHARE_BATCH && (work = (struct work *)tq_pop(pool->stratum_q, &tq_nowait)));
+    atomic_add_uint(&pool->sgminer_pool_stats.share_queue, -n);
+
+    /* Try resubmitting for up to 2 minutes if we fail to submit
+     * once and the stratum pool nonce1 still matches suggesting
+     * we may be able to resume. Retry every 5 seconds. */
+    while ((list = stratum_send_shares(pool, list)) && (list = stratum_keep_resumable(pool, list)))
+      sleep(5);
+  }
+
+  /* Freeze the work queue but don't free up its memory in case there is
+   * work still trying to be submitted to the removed pool. */
+  tq_freeze(pool->stratum_q);
+
+  return NULL;
+}
+
+/* Rather than the two threads above for every pool, one reactor thread can
+ * watch all the stratum sockets. Shares are then sent straight from the
+ * thread that found them and the pool's messages are handled on the reactor
+ * thread as they arrive. A connect thread does everything that may block:
+ * connecting, authorising and the stratum_rthread() policy of when to drop,
+ * suspend and reconnect. */
+static struct reactor *stratum_reactor;
+static pthread_mutex_t stratum_connect_lock;
+static pthread_cond_t stratum_connect_cond;
+
+static void stratum_connect_wake(void)
+{
+  mutex_lock(&stratum_connect_lock);
+  pthread_cond_signal(&stratum_connect_cond);
+  mutex_unlock(&stratum_connect_lock);
+}
+
+/* From any thread: the connection has failed */
+void stratum_reactor_drop(struct pool *pool)
+{
+  pool->stratum_drop = true;
+  stratum_connect_wake();
+}
+
+/* From the reactor thread: client.reconnect has set a new address */
+void stratum_reactor_reconnect(struct pool *pool)
+{
+  pool->stratum_reconnect = true;
+  stratum_connect_wake();
+}
+
+static void stratum_reactor_cb(int __maybe_unused fd, uint32_t events, void *arg)
+{
+  struct pool *pool = (struct pool *)arg;
+  char *s;
+  int n;
+
+  if (pool->stratum_drop || pool->stratum_reconnect)
+    return;
+
+  if ((events & REACTOR_OUT) && !stratum_flush(pool)) {
+    stratum_reactor_drop(pool);
+    return;
+  }
+  if (!(events & (REACTOR_IN | REACTOR_ERR)))
+    return;
+
+  /* Edge triggered, so read until the socket would block. Lines are
+   * handled as each read completes them. */
+  do {
+    n = recv_sock_nonblock(pool);
+    if (n > 0)
+      cgtime(&pool->tv_stratum_recv);
+    while (!pool->stratum_reconnect && (s = recv_line_buffered(pool, NULL)))
+      stratum_handle_line(pool, s);
+  } while (n > 0 && !pool->stratum_reconnect);
+
+  if (n < 0) {
+    applog(LOG_DEBUG, "Stratum reactor lost the connection to %s", get_pool_name(pool));
+    stratum_reactor_drop(pool);
+  }
+}
+
+/* Hand a freshly authorised connection to the reactor, first handling
+ * anything that came in with the handshake */
+static bool stratum_reactor_attach(struct pool *pool)
+{
+  char *s;
+  int fd;
+
+  pool->stratum_drop = pool->stratum_reconnect = false;
+  while (!pool->stratum_reconnect && (s = recv_line_buffered(pool, NULL)))
+    stratum_handle_line(pool, s);
+
+  mutex_lock(&pool->stratum_lock);
+  fd = pool->sock;
+  if (fd) {
+    noblock_socket(fd);
+    pool->sendbuf_len = 0;
+    pool->stratum_attached = true;
+  }
+  mutex_unlock(&pool->stratum_lock);
+  if (!fd)
+    return false;
+
+  cgtime(&pool->tv_stratum_recv);
+  if (!reactor_add(stratum_reactor, fd, REACTOR_IN | REACTOR_OUT | REACTOR_EDGE, stratum_reactor_cb, pool)) {
+    mutex_lock(&pool->stratum_lock);
+    pool->stratum_attached = false;
+    mutex_unlock(&pool->stratum_lock);
+    return false;
+  }
+  pool->stratum_fd = fd;
+  return true;
+}
+
+/* Take the socket back from the reactor. Once reactor_del() returns no
+ * callback is running for it, so it is safe to close. */
+static void stratum_reactor_detach(struct pool *pool)
+{
+  if (!pool->stratum_fd)
+    return;
+
+  reactor_del(stratum_reactor, pool->stratum_fd);
+  pool->stratum_fd = 0;
+
+  mutex_lock(&pool->stratum_lock);
+  pool->stratum_attached = false;
+  mutex_unlock(&pool->stratum_lock);
+}
+
+static bool stratum_reactor_restart(struct pool *pool)
+{
+  return restart_stratum(pool) && stratum_reactor_attach(pool);
+}
+
+/* Put shares that failed to send on the list for the connect thread */
+static void stratum_reactor_defer(struct pool *pool, struct stratum_share *list)
+{
+  struct stratum_share *tail = list;
+
+  if (!list)
+    return;
+  while (tail->resend_next)
+    tail = tail->resend_next;
+
+  mutex_lock(&sshare_lock);
+  tail->resend_next = pool->stratum_resend;
+  pool->stratum_resend = list;
+  mutex_unlock(&sshare_lock);
+}
+
+/* Try again shares that failed to send, or give up on them */
+static void stratum_reactor_resend(struct pool *pool)
+{
+  struct stratum_share *list;
+
+  mutex_lock(&sshare_lock);
+  list = pool->stratum_resend;
+  pool->stratum_resend = NULL;
+  mutex_unlock(&sshare_lock);
+
+  list = stratum_keep_resumable(pool, list);
+  if (list && pool->stratum_attached)
+    list = stratum_send_shares(pool, list);
+  stratum_reactor_defer(pool, list);
+}
+
+/* Send a share from the thread that found it. The share is queued and then
+ * whoever holds share_send_lock writes everything queued, so shares found
+ * while another thread is writing go out together in its next write. Sends
+ * never block on a pool attached to the reactor, failures are left to the
+ * connect thread. */
+static void stratum_reactor_submit(struct pool *pool, struct work *work)
+{
+  struct stratum_share *sshare = stratum_new_share(work), *list, *next;
+  int n = 0;
+
+  atomic_add_uint(&pool->sgminer_pool_stats.share_queue, 1);
+  mutex_lock(&sshare_lock);
+  sshare->resend_next = pool->share_pending;
+  pool->share_pending = sshare;
+  mutex_unlock(&sshare_lock);
+
+  mutex_lock(&pool->share_send_lock);
+  mutex_lock(&sshare_lock);
+  sshare = pool->share_pending;
+  pool->share_pending = NULL;
+  mutex_unlock(&sshare_lock);
+
+  /* Shares are queued on the front, put them back in the order found */
+  for (list = NULL; sshare; sshare = next) {
+    next = sshare->resend_next;
+    sshare->resend_next = list;
+    list = sshare;
+    n++;
+  }
+  /* An empty queue means another thread has written ours already */
+  if (n) {
+    atomic_add_uint(&pool->sgminer_pool_stats.share_queue, -n);
+    list = stratum_send_shares(pool, list);
+  }
+  mutex_unlock(&pool->share_send_lock);
 
-      applog(LOG_DEBUG, "stratum_sthread() algorithm = %s", pool->algorithm.name);
+  stratum_reactor_defer(pool, stratum_keep_resumable(pool, list));
+}
 
-      uint64_t tmp = bswap_64(work->Nonce);
-      char *ASCIIMixHash = bin2hex(work->mixhash, 32);
-      char *ASCIIPoWHash = bin2hex(work->data, 32);
-      char *ASCIINonce = bin2hex((const unsigned char*)&tmp, 8);
+/* What stratum_rthread() does for a pool between messages, without
+ * blocking on any one pool except while it connects */
+static void stratum_reactor_check(struct pool *pool, struct timeval *now)
+{
+  if (pool->removed) {
+    stratum_reactor_detach(pool);
+    return;
+  }
 
-      mutex_lock(&sshare_lock);
-      /* Give the stratum share a unique id */
-      sshare->id = swork_id++;
-      mutex_unlock(&sshare_lock);
-      snprintf(s, s_size, "{\"id\": %d, \"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"0x%s\", \"0x%s\", \"0x%s\"]}", sshare->id, pool->rpc_user, work->job_id, ASCIINonce, ASCIIPoWHash, ASCIIMixHash);
+  stratum_reactor_resend(pool);
+  stratum_expire_shares(pool);
 
-      free(ASCIINonce);
-      free(ASCIIMixHash);
-      free(ASCIIPoWHash);
+  if (!pool->stratum_fd) {
+    /* Waiting to be needed again, or to retry a dead pool every 30s */
+    if (pool->stratum_retry) {
+      if (now->tv_sec < pool->stratum_retry)
+        return;
+      if (!stratum_reactor_restart(pool)) {
+        pool_failed(pool);
+        pool->stratum_retry = now->tv_sec + 30;
+        return;
+      }
+      pool->stratum_retry = 0;
+      stratum_resumed(pool);
+      return;
     }
-    else if (pool->algorithm.type == ALGO_CRYPTONIGHT) {
-      char *ASCIIResult;
-      uint8_t HashResult[32];
-
-      sshare->sshare_time = time(NULL);
-      /* This work item is freed in parse_stratum_response */
-      sshare->work = work;
-
-      applog(LOG_DEBUG, "stratum_sthread() algorithm = %s", pool->algorithm.name);
-		
-      char *ASCIINonce = bin2hex((const unsigned char*)&(work->XMRNonce), 4);
-      
-      ASCIIResult = bin2hex(work->hash, 32);
-       
-      mutex_lock(&sshare_lock);
-      /* Give the stratum share a unique id */
-      sshare->id = swork_id++;
-      mutex_unlock(&sshare_lock);
-      
-      snprintf(s, s_size, "{\"method\": \"submit\", \"params\": {\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}, \"id\":%d}", pool->XMRAuthID, work->job_id, ASCIINonce, ASCIIResult, sshare->id);
+    if (!pool_lpcurrent(pool))
+      return;
+    if (!stratum_reactor_restart(pool)) {
+      pool_died(pool);
+      pool->stratum_retry = now->tv_sec + 30;
+    }
+    return;
+  }
 
-      free(ASCIINonce);
-      free(ASCIIResult);
+  if (pool->stratum_reconnect) {
+    stratum_reactor_detach(pool);
+    if (!stratum_reactor_restart(pool)) {
+      pool_failed(pool);
+      pool->stratum_retry = now->tv_sec + 30;
     }
- 
-    else if(pool->algorithm.type == ALGO_EQUIHASH) {
-      char *nonce;
-      char *solution;
+    return;
+  }
 
-      sshare->sshare_time = time(NULL);
-      /* This work item is freed in parse_stratum_response */
-      sshare->work = work;
+  /* The protocol specifies that notify messages should be sent every
+   * minute so if we fail to receive any for 90 seconds we assume the
+   * connection has been dropped and treat this pool as dead */
+  if (pool->stratum_drop || tdiff(now, &pool->tv_stratum_recv) >= 90) {
+    stratum_reactor_detach(pool);
+    applog(LOG_NOTICE, "Stratum connection to %s interrupted", get_pool_name(pool));
+    pool->getfail_occasions++;
+    total_go++;
 
-      applog(LOG_DEBUG, "stratum_sthread() algorithm = %s", pool->algorithm.name);
-      
-      //get nonce minus extranonce set by server
-      nonce = bin2hex(work->equihash_data+108, 32);
-      solution = bin2hex(work->equihash_data+140, 1347);
-      
-      //applog(LOG_DEBUG, "%s: Nonce set to %s", __func__, nonce+strlen(work->nonce1));
-      
-      mutex_lock(&sshare_lock);
-      /* Give the stratum share a unique id */
-      sshare->id = swork_id++;
-      mutex_unlock(&sshare_lock);
-      snprintf(s, s_size, "{\"id\": %d, \"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"]}", sshare->id, pool->rpc_user, work->job_id, work->ntime, nonce+strlen(work->nonce1), solution);
+    /* If the socket to our stratum pool disconnects, all
+     * tracked submitted shares are lost and we will leak
+     * the memory if we don't discard their records. */
+    if (!supports_resume(pool) || opt_lowmem)
+      clear_stratum_shares(pool);
+    clear_pool_work(pool);
+    if (pool == current_pool())
+      restart_threads();
 
-      free(nonce);
-      free(solution);
+    if (!stratum_reactor_restart(pool)) {
+      pool_died(pool);
+      pool->stratum_retry = now->tv_sec + 30;
     }
-    else {
-      if (unlikely(work->nonce2_len > 8)) {
-        applog(LOG_ERR, "%s asking for inappropriately long nonce2 length %d", get_pool_name(pool), (int)work->nonce2_len);
-        applog(LOG_ERR, "Not attempting to submit shares");
-        free_work(work);
-        continue;
-      }
-
-      // TODO: check for memory leaks
-      sshare->sshare_time = time(NULL);
-      /* This work item is freed in parse_stratum_response */
-      sshare->work = work;
-
-      applog(LOG_DEBUG, "stratum_sthread() algorithm = %s", pool->algorithm.name);
+    return;
+  }
 
-      // Neoscrypt is little endian
-      if (pool->algorithm.type == ALGO_NEOSCRYPT)
-        nonce = htobe32(*((uint32_t *)(work->data + 76)));
-	  else if (pool->algorithm.type == ALGO_LBRY) {
-		  nonce = *((uint32_t *)(work->data + 108));
-	  }
-      else
-        nonce = *((uint32_t *)(work->data + 76));
+  /* Check to see whether we need to maintain this connection
+   * indefinitely or just bring it up when we switch to this
+   * pool */
+  if (!cnx_needed(pool)) {
+    applog(LOG_INFO, "Suspending stratum on %s", get_pool_name(pool));
+    stratum_reactor_detach(pool);
+    suspend_stratum(pool);
+    clear_stratum_shares(pool);
+    clear_pool_work(pool);
+  }
+}
 
-      __bin2hex(noncehex, (const unsigned char *)&nonce, 4);
+static void *stratum_connect_thread(void __maybe_unused *userdata)
+{
+  pthread_detach(pthread_self());
+  RenameThread("StratumConnect");
 
-      *((uint64_t *)nonce2) = htole64(work->nonce2);
-      __bin2hex(nonce2hex, nonce2, work->nonce2_len);
-      memset(s, 0, 1024);
+  while (42) {
+    struct timespec abstime;
+    struct timeval now;
+    int i;
 
-      mutex_lock(&sshare_lock);
-      /* Give the stratum share a unique id */
-      sshare->id = swork_id++;
-      mutex_unlock(&sshare_lock);
+    cgtime(&now);
+    for (i = 0; i < total_pools; i++) {
+      struct pool *pool = pools[i];
 
-      snprintf(s, s_size,
-        "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-        pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, sshare->id);
+      if (pool->stratum_reactor)
+        stratum_reactor_check(pool, &now);
     }
 
-    applog(LOG_INFO, "Submitting share %08lx to %s", (long unsigned int)htole32(hash32[6]), get_pool_name(pool));
-
-    /* Try resubmitting for up to 2 minutes if we fail to submit
-     * once and the stratum pool nonce1 still matches suggesting
-     * we may be able to resume. */
-    while (time(NULL) < sshare->sshare_time + 120) {
-      bool sessionid_match;
-
-      mutex_lock(&sshare_lock);
-      if (likely(stratum_send(pool, s, strlen(s)))) {
-        int ssdiff;
-
-        if (pool_tclear(pool, &pool->submit_fail))
-            applog(LOG_WARNING, "%s communication resumed, submitting work", get_pool_name(pool));
-
-        sshare->sshare_sent = time(NULL);
-        ssdiff = sshare->sshare_sent - sshare->sshare_time;
-        if (opt_debug || ssdiff > 0) {
-          applog(LOG_INFO, "Pool %d stratum share submission lag time %d seconds",
-                 pool->pool_no, ssdiff);
-        }
-
-        HASH_ADD_INT(stratum_shares, id, sshare);
-        pool->sshares++;
-        mutex_unlock(&sshare_lock);
-
-        applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
-        submitted = true;
-        break;
-      }
-      else {
-        mutex_unlock(&sshare_lock);
-      }
-      if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
-        applog(LOG_WARNING, "%s stratum share submission failure", get_pool_name(pool));
-        total_ro++;
-        pool->remotefail_occasions++;
-      }
+    cgtime(&now);
+    now.tv_sec++;
+    timeval_to_spec(&abstime, &now);
+    mutex_lock(&stratum_connect_lock);
+    pthread_cond_timedwait(&stratum_connect_cond, &stratum_connect_lock, &abstime);
+    mutex_unlock(&stratum_connect_lock);
+  }
 
-      if (opt_lowmem) {
-        applog(LOG_DEBUG, "Lowmem option prevents resubmitting stratum share");
-        break;
-      }
+  return NULL;
+}
 
-      cg_rlock(&pool->data_lock);
-      sessionid_match = (pool->nonce1 && !strcmp(work->nonce1, pool->nonce1));
-      cg_runlock(&pool->data_lock);
+/* Falls back to the per pool threads where there is no epoll */
+static void stratum_reactor_init(void)
+{
+  pthread_t pth;
 
-      if (!sessionid_match) {
-        applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
-        break;
-      }
-      /* Retry every 5 seconds */
-      sleep(5);
-    }
+  if (!opt_stratum_reactor)
+    return;
 
-    if (unlikely(!submitted)) {
-      applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
-      free_work(work);
-      free(sshare);
-      pool->stale_shares++;
-      total_stale++;
-    }
+  stratum_reactor = reactor_new("StratumReactor");
+  if (!stratum_reactor) {
+    applog(LOG_INFO, "No stratum reactor, using a receive and a send thread per pool");
+    return;
   }
 
-  /* Freeze the work queue but don't free up its memory in case there is
-   * work still trying to be submitted to the removed pool. */
-  tq_freeze(pool->stratum_q);
-  if (s != NULL)
-    free(s);
-
-  return NULL;
+  mutex_init(&stratum_connect_lock);
+  if (unlikely(pthread_cond_init(&stratum_connect_cond, NULL)))
+    quit(1, "Failed to pthread_cond_init stratum_connect_cond");
+  if (unlikely(pthread_create(&pth, NULL, stratum_connect_thread, NULL)))
+    quit(1, "Failed to create stratum connect thread");
 }
 
 static void init_stratum_threads(struct pool *pool)
 {
   have_longpoll = true;
 
+  if (stratum_reactor) {
+    /* If it can't be attached the connect thread brings it back */
+    if (!stratum_reactor_attach(pool))
+      suspend_stratum(pool);
+    pool->stratum_reactor = true;
+    stratum_connect_wake();
+    return;
+  }
+
   if (unlikely(pthread_create(&pool->stratum_sthread, NULL, stratum_sthread, (void *)pool)))
     quit(1, "Failed to create stratum sthread");
   if (unlikely(pthread_create(&pool->stratum_rthread, NULL, stratum_rthread, (void *)pool)))
@@ -6409,16 +8032,28 @@ static void pool_resus(struct pool *pool)
 
 /* If this is called non_blocking, it will return NULL for work so that must
  * be handled. */
+/* Find clone work if possible, to allow masters to be reused */
+static struct work *staged_pop(void)
+{
+  struct work *work = (struct work *)rq_pop(staged_q);
+
+  if (!work)
+    work = (struct work *)rq_pop(rollable_q);
+  return work;
+}
+
 static struct work *hash_pop(bool blocking)
 {
-  struct work *work = NULL, *tmp;
-  int hc;
+  struct work *work = staged_pop();
 
-  mutex_lock(stgd_lock);
-  if (!HASH_COUNT(staged_work)) {
+  if (!work) {
     if (!blocking)
-      goto out_unlock;
-    do {
+      return NULL;
+
+    mutex_lock(&stgd_lock);
+    atomic_add_uint(&staged_waiters, 1);
+    atomic_fence();
+    while (!(work = staged_pop())) {
       struct timespec then;
       struct timeval now;
       int rc;
@@ -6427,7 +8062,7 @@ static struct work *hash_pop(bool blocking)
       then.tv_sec = now.tv_sec + 10;
       then.tv_nsec = now.tv_usec * 1000;
       pthread_cond_signal(&gws_cond);
-      rc = pthread_cond_timedwait(&getq->cond, stgd_lock, &then);
+      rc = pthread_cond_timedwait(&staged_cond, &stgd_lock, &then);
       /* Check again for !no_work as multiple threads may be
         * waiting on this condition and another may set the
         * bool separately. */
@@ -6436,37 +8071,27 @@ static struct work *hash_pop(bool blocking)
         applog(LOG_WARNING, "Waiting for work to be available from pools.");
         event_notify("idle");
       }
-    } while (!HASH_COUNT(staged_work));
-  }
-
-  if (no_work) {
-    applog(LOG_WARNING, "Work available from pools, resuming.");
-    no_work = false;
+    }
+    atomic_add_uint(&staged_waiters, -1);
+    mutex_unlock(&stgd_lock);
   }
 
-  hc = HASH_COUNT(staged_work);
-  /* Find clone work if possible, to allow masters to be reused */
-  if (hc > staged_rollable) {
-    HASH_ITER(hh, staged_work, work, tmp) {
-      if (!work_rollable(work))
-        break;
+  if (unlikely(no_work)) {
+    mutex_lock(&stgd_lock);
+    if (no_work) {
+      applog(LOG_WARNING, "Work available from pools, resuming.");
+      no_work = false;
     }
-  } else
-    work = staged_work;
-  HASH_DEL(staged_work, work);
-  if (work_rollable(work))
-    staged_rollable--;
-
-  /* Signal the getwork scheduler to look for more work */
-  pthread_cond_signal(&gws_cond);
+    mutex_unlock(&stgd_lock);
+  }
 
-  /* Signal hash_pop again in case there are mutliple hash_pop waiters */
-  pthread_cond_signal(&getq->cond);
+  /* Wake the getwork scheduler if it is waiting for room to stage more */
+  atomic_fence();
+  if (atomic_load_uint(&gws_waiting) && atomic_xchg_uint(&gws_waiting, 0))
+    wake_gws();
 
   /* Keep track of last getwork grabbed */
   last_getwork = time(NULL);
-out_unlock:
-  mutex_unlock(stgd_lock);
 
   return work;
 }
@@ -6580,8 +8205,9 @@ static void gen_stratum_work_eth(struct pool *pool, struct work *work)
   applog(LOG_DEBUG, "[THR%d] gen_stratum_work() - algorithm = %s", work->thr_id, pool->algorithm.name);
 
   cg_rlock(&pool->data_lock);
-  work->eth_epoch = pool->eth_cache.current_epoch;
-  work->job_id = strdup(pool->swork.job_id);
+  work_ethash(work)->eth_epoch = pool->eth_cache.current_epoch;
+  work->job_id = rstr_new(pool->swork.job_id);
+  work->job_gen = pool->job_gen;
   memcpy(work->data, pool->EthWork, 32);
   memcpy(work->target, pool->Target, 32);
   work->sdiff = pool->swork.diff;
@@ -6615,19 +8241,20 @@ static void gen_stratum_work_cn(struct pool *pool, struct work *work)
   applog(LOG_DEBUG, "[THR%d] gen_stratum_work_cn() - algorithm = %s", work->thr_id, pool->algorithm.name);
   
   cg_rlock(&pool->data_lock);	
-  work->job_id = strdup(pool->swork.job_id);
-  work->XMRTarget = pool->XMRTarget;
+  work->job_id = rstr_new(pool->swork.job_id);
+  work->job_gen = pool->job_gen;
+  work_cn(work)->XMRTarget = pool->XMRTarget;
   //strcpy(work->XMRID, pool->XMRID);
   //work->XMRBlockBlob = strdup(pool->XMRBlockBlob);
-  memcpy(work->XMRBlob, pool->XMRBlob, 76);
-  memcpy(work->data, work->XMRBlob, 76);
+  memcpy(work_cn(work)->XMRBlob, pool->XMRBlob, 76);
+  memcpy(work->data, work_cn(work)->XMRBlob, 76);
   memset(work->target, 0xFF, 32);
   work->sdiff = (double)0xffffffff / pool->XMRTarget;
   work->work_difficulty = work->sdiff;
   work->network_diff = pool->diff1;
   cg_runlock(&pool->data_lock);
   
-  work->target[7] = work->XMRTarget;
+  work->target[7] = work_cn(work)->XMRTarget;
   
   local_work++;
   work->pool = pool;
@@ -6646,9 +8273,22 @@ static void gen_stratum_work_cn(struct pool *pool, struct work *work)
   applog(LOG_DEBUG, "gen_stratum_work_cn() done.");
 }
 
+/* Brings the counted copies of the job strings up to date so each work item
+ * takes a reference instead of duplicating them. Needs the data_lock write
+ * lock. */
+static void stratum_job_refs(struct pool *pool)
+{
+  rstr_set(&pool->swork.job_ref, pool->swork.job_id);
+  rstr_set(&pool->swork.ntime_ref, pool->swork.ntime);
+  rstr_set(&pool->swork.nonce1_ref, pool->nonce1);
+}
+
 static void gen_stratum_work_equihash(struct pool *pool, struct work *work)
 {
+  unsigned char *data = work_equihash(work)->equihash_data;
+
   cg_wlock(&pool->data_lock);
+  stratum_job_refs(pool);
   work->nonce2 = pool->nonce2++;
   work->nonce2_len = 2;
 
@@ -6656,30 +8296,31 @@ static void gen_stratum_work_equihash(struct pool *pool, struct work *work)
   cg_dwlock(&pool->data_lock);
   
   /* equihash already has the merkle root in the header no need to change it */
-  memset(work->equihash_data, 0, 1487);
-  memcpy(work->equihash_data, pool->header_bin, 128);
+  memset(data, 0, 1487);
+  memcpy(data, pool->header_bin, 128);
   
   //add pool extra nonce
-  hex2bin(work->equihash_data + 108, pool->nonce1, strlen(pool->nonce1) / 2);
-  memcpy(work->equihash_data + 108 + 20 - work->nonce2_len, &work->nonce2, work->nonce2_len);
+  hex2bin(data + 108, pool->nonce1, strlen(pool->nonce1) / 2);
+  memcpy(data + 108 + 20 - work->nonce2_len, &work->nonce2, work->nonce2_len);
  
   //add solutionsize
-  add_var_int(work->equihash_data + 140, 1344);
+  add_var_int(data + 140, 1344);
 
   /* Store the stratum work diff to check it still matches the pool's
   * stratum diff when submitting shares */
   work->sdiff = pool->swork.diff;
 
   /* Copy parameters required for share submission */
-  work->job_id = strdup(pool->swork.job_id);
-  work->nonce1 = strdup(pool->nonce1);
-  work->ntime = strdup(pool->swork.ntime);
+  work->job_id = rstr_get(pool->swork.job_ref);
+  work->job_gen = pool->job_gen;
+  work->nonce1 = rstr_get(pool->swork.nonce1_ref);
+  work->ntime = rstr_get(pool->swork.ntime_ref);
   cg_runlock(&pool->data_lock);
 
   if (opt_debug) {
     char *header, *merkle_hash;
 
-    header = bin2hex(work->equihash_data, 143);
+    header = bin2hex(data, 143);
     applog(LOG_DEBUG, "[THR%d] Generated stratum header %s", work->thr_id, header);
     applog(LOG_DEBUG, "[THR%d] job_id %s, nonce1 %s, nonce2 %" PRIu64 ", ntime %s", work->thr_id, work->job_id, work->nonce1, work->nonce2, work->ntime);
     free(header);
@@ -6704,32 +8345,41 @@ static void gen_stratum_work_equihash(struct pool *pool, struct work *work)
   cgtime(&work->tv_staged);
 }
 
-static void gen_stratum_work(struct pool *pool, struct work *work)
+/* Hashes one work item's coinbase and walks the merkle branches into its
+ * header. Called with the pool's data_lock held for reading; nothing shared
+ * is written, so several items can be built under one lock. */
+static void __gen_stratum_work(struct pool *pool, struct work *work, uint64_t nonce2)
 {
-  if (pool->algorithm.type == ALGO_EQUIHASH) {
-    gen_stratum_work_equihash(pool, work);
-    return;
-  }
-  
   unsigned char merkle_root[32], merkle_sha[64];
   uint32_t *data32, *swap32;
   uint64_t nonce2le;
   int i, j;
 
-  cg_wlock(&pool->data_lock);
-
-  /* Update coinbase. Always use an LE encoded nonce2 to fill in values
-  * from left to right and prevent overflow errors with small n2sizes */
-  nonce2le = htole64(pool->nonce2);
-  memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
-  work->nonce2 = pool->nonce2++;
+  /* Always use an LE encoded nonce2 to fill in values from left to right
+   * and prevent overflow errors with small n2sizes */
+  nonce2le = htole64(nonce2);
+  work->nonce2 = nonce2;
   work->nonce2_len = pool->n2size;
 
-  /* Downgrade to a read lock to read off the pool variables */
-  cg_dwlock(&pool->data_lock);
-
   /* Generate merkle root */
-  pool->algorithm.gen_hash(pool->coinbase, pool->swork.cb_len, merkle_root);
+  if (pool->swork.cb_mid_valid) {
+    sph_sha256_context ctx = pool->swork.cb_mid;
+    size_t tail = pool->nonce2_offset + pool->n2size;
+
+    /* Everything up to nonce2 was hashed when the job arrived */
+    sph_sha256(&ctx, &nonce2le, pool->n2size);
+    sph_sha256(&ctx, pool->coinbase + tail, pool->swork.cb_len - tail);
+    sph_sha256_close(&ctx, merkle_root);
+    if (pool->algorithm.gen_hash == gen_hash)
+      sha256(merkle_root, 32, merkle_root);
+  } else {
+    size_t cb_len = MAX(pool->swork.cb_len, pool->nonce2_offset + pool->n2size);
+    unsigned char *coinbase = (unsigned char *)alloca(cb_len);
+
+    memcpy(coinbase, pool->coinbase, pool->swork.cb_len);
+    memcpy(coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
+    pool->algorithm.gen_hash(coinbase, pool->swork.cb_len, merkle_root);
+  }
   memcpy(merkle_sha, merkle_root, 32);
   for (i = 0; i < pool->swork.merkles; i++) {
     memcpy(merkle_sha + 32, pool->swork.merkle_bin[i], 32);
@@ -6783,16 +8433,20 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
   work->sdiff = pool->swork.diff;
 
   /* Copy parameters required for share submission */
-  work->job_id = strdup(pool->swork.job_id);
-  work->nonce1 = strdup(pool->nonce1);
-  work->ntime = strdup(pool->swork.ntime);
-  cg_runlock(&pool->data_lock);
+  work->job_id = rstr_get(pool->swork.job_ref);
+  work->job_gen = pool->job_gen;
+  work->nonce1 = rstr_get(pool->swork.nonce1_ref);
+  work->ntime = rstr_get(pool->swork.ntime_ref);
+}
 
+/* The part of making stratum work that needs no pool lock */
+static void stratum_work_finish(struct pool *pool, struct work *work)
+{
   if (opt_debug) {
     char *header, *merkle_hash;
 
     header = bin2hex(work->data, 128);
-    merkle_hash = bin2hex((const unsigned char *)merkle_root, 32);
+    merkle_hash = bin2hex(work->data + pool->merkle_offset, 32);
     applog(LOG_DEBUG, "[THR%d] Generated stratum merkle %s", work->thr_id, merkle_hash);
     applog(LOG_DEBUG, "[THR%d] Generated stratum header %s", work->thr_id, header);
     applog(LOG_DEBUG, "[THR%d] Work job_id %s nonce2 %" PRIu64 " ntime %s", work->thr_id, work->job_id,
@@ -6824,6 +8478,42 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
   cgtime(&work->tv_staged);
 }
 
+/* Most stratum work items the getwork scheduler makes at once */
+#define STRATUM_WORK_BATCH 8
+
+/* Makes n work items from the pool's current job, taking the pool lock once
+ * for all of them. The nonce2 values are reserved in one go. */
+static void gen_stratum_works(struct pool *pool, struct work **works, int n)
+{
+  uint64_t nonce2;
+  int i;
+
+  if (pool->algorithm.type == ALGO_EQUIHASH) {
+    for (i = 0; i < n; i++)
+      gen_stratum_work_equihash(pool, works[i]);
+    return;
+  }
+
+  cg_wlock(&pool->data_lock);
+  stratum_job_refs(pool);
+  nonce2 = pool->nonce2;
+  pool->nonce2 += n;
+
+  /* Downgrade to a read lock to read off the pool variables */
+  cg_dwlock(&pool->data_lock);
+  for (i = 0; i < n; i++)
+    __gen_stratum_work(pool, works[i], nonce2 + i);
+  cg_runlock(&pool->data_lock);
+
+  for (i = 0; i < n; i++)
+    stratum_work_finish(pool, works[i]);
+}
+
+static void gen_stratum_work(struct pool *pool, struct work *work)
+{
+  gen_stratum_works(pool, &work, 1);
+}
+
 static void enable_devices(void)
 {
   int i;
@@ -7435,9 +9125,9 @@ struct work *get_work(struct thr_info *thr, const int thr_id)
 static void submit_work_async(struct work *work)
 {
   struct pool *pool = work->pool;
-  pthread_t submit_thread;
 
   cgtime(&work->tv_work_found);
+  cgtimer_time(&work->t_queued);
 
   if (stale_work(work, true)) {
     if (opt_submit_stale)
@@ -7461,16 +9151,19 @@ static void submit_work_async(struct work *work)
     work->stale = true;
   }
 
-  if (work->stratum) {
+  if (work->stratum && pool->stratum_reactor) {
+    stratum_reactor_submit(pool, work);
+  } else if (work->stratum) {
     applog(LOG_DEBUG, "Pushing %s work to stratum queue", get_pool_name(pool));
+    atomic_add_uint(&pool->sgminer_pool_stats.share_queue, 1);
     if (unlikely(!tq_push(pool->stratum_q, work))) {
       applog(LOG_DEBUG, "Discarding work from removed pool");
+      atomic_add_uint(&pool->sgminer_pool_stats.share_queue, -1);
       free_work(work);
     }
   } else {
-    applog(LOG_DEBUG, "Pushing submit work to work thread");
-    if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)work)))
-      quit(1, "Failed to create submit_work_thread");
+    applog(LOG_DEBUG, "Pushing submit work to submit threads");
+    submit_work_push(work);
   }
 }
 
@@ -7529,7 +9222,7 @@ bool test_nonce(struct work *work, uint32_t nonce)
     return (bswap_64(*(uint64_t*) work->hash) <= target);
   }
   else if (work->pool->algorithm.type == ALGO_CRYPTONIGHT) {
-    return (((uint32_t *)work->hash)[7] <= work->XMRTarget);
+    return (((uint32_t *)work->hash)[7] <= work_cn(work)->XMRTarget);
   }
   else {
     diff1targ = work->pool->algorithm.diff1targ;
@@ -7563,11 +9256,11 @@ static void update_work_stats(struct thr_info *thr, struct work *work)
   mutex_unlock(&stats_lock);
 }
 
-/* To be used once the work has been tested to be meet diff1 and has had its
- * nonce adjusted. Returns true if the work target is met. */
-bool submit_tested_work(struct thr_info *thr, struct work *work)
+static bool __submit_tested_work(struct thr_info *thr, struct work *work)
 {
   struct work *work_out;
+
+  cgtimer_time(&work->t_tested);
   update_work_stats(thr, work);
 
   if (work->pool->algorithm.type == ALGO_ETHASH) {
@@ -7596,12 +9289,23 @@ bool submit_tested_work(struct thr_info *thr, struct work *work)
   return true;
 }
 
+/* To be used once the work has been tested to be meet diff1 and has had its
+ * nonce adjusted. Returns true if the work target is met. */
+bool submit_tested_work(struct thr_info *thr, struct work *work)
+{
+  cgtimer_time(&work->t_found);
+  return __submit_tested_work(thr, work);
+}
+
 /* Returns true if nonce for work was a valid share */
 bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 {
+  cgtimer_time(&work->t_found);
+
   //temporary
   if (work->pool->algorithm.type == ALGO_EQUIHASH) {
     struct work *work_out;
+    cgtimer_time(&work->t_tested);
     update_work_stats(thr, work);
     work_out = copy_work(work);
     submit_work_async(work_out);
@@ -7609,7 +9313,7 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
   }
 
   if (test_nonce(work, nonce)) {
-    submit_tested_work(thr, work);
+    __submit_tested_work(thr, work);
     return true;
   }
 
@@ -7679,6 +9383,7 @@ static void hash_sole_work(struct thr_info *mythr)
       break;
     }
     work->device_diff = MIN(drv->working_diff, work->work_difficulty);
+    thr_restart_done(mythr);
 
     /* Dynamically adjust the working diff even if the target
      * diff is very high to ensure we can still validate scrypt is
@@ -7817,6 +9522,160 @@ static void hash_sole_work(struct thr_info *mythr)
   cgpu->deven = DEV_DISABLED;
 }
 
+/* Make sure the driver always has an unqueued work item to pick up and keep
+ * offering it until the driver says its queue is full. */
+static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu, struct device_drv *drv, const int thr_id)
+{
+  do {
+    bool need_work;
+
+    /* Do this lockless just to know if we need more unqueued work. */
+    need_work = (!cgpu->unqueued_work);
+
+    /* get_work is a blocking function so do it outside of lock
+     * to prevent deadlocks with other locks. */
+    if (need_work) {
+      struct work *work = get_work(mythr, thr_id);
+
+      wr_lock(&cgpu->qlock);
+      /* Check we haven't grabbed work somehow between
+       * checking and picking up the lock. */
+      if (likely(!cgpu->unqueued_work))
+        cgpu->unqueued_work = work;
+      else
+        need_work = false;
+      wr_unlock(&cgpu->qlock);
+
+      if (unlikely(!need_work))
+        discard_work(work);
+    }
+    /* The queue_full function should be used by the driver to
+     * actually place work items on the physical device if it
+     * does have a queue. */
+  } while (!drv->queue_full(cgpu));
+}
+
+/* Add a work item to a cgpu's queued hashlist */
+static void __add_queued(struct cgpu_info *cgpu, struct work *work)
+{
+  cgpu->queued_count++;
+  HASH_ADD_INT(cgpu->queued_work, id, work);
+}
+
+/* This function is for retrieving one work item from the unqueued pointer and
+ * adding it to the hashtable of queued work. Code using this function must be
+ * able to handle NULL as a return which implies there is no work available. */
+struct work *get_queued(struct cgpu_info *cgpu)
+{
+  struct work *work = NULL;
+
+  wr_lock(&cgpu->qlock);
+  if (cgpu->unqueued_work) {
+    work = cgpu->unqueued_work;
+    if (unlikely(stale_work(work, false))) {
+      discard_work(work);
+      work = NULL;
+    } else
+      __add_queued(cgpu, work);
+    cgpu->unqueued_work = NULL;
+    wake_gws();
+  }
+  wr_unlock(&cgpu->qlock);
+
+  return work;
+}
+
+/* This function should be used by queued device drivers when they're sure
+ * the work struct is no longer in use. */
+void work_completed(struct cgpu_info *cgpu, struct work *work)
+{
+  wr_lock(&cgpu->qlock);
+  cgpu->queued_count--;
+  HASH_DEL(cgpu->queued_work, work);
+  wr_unlock(&cgpu->qlock);
+
+  free_work(work);
+}
+
+/* Drop the unqueued work item on a block change, anything already queued is
+ * the driver's to flush in its flush_work. */
+static void flush_queue(struct cgpu_info *cgpu)
+{
+  struct work *work = NULL;
+
+  if (unlikely(!cgpu))
+    return;
+
+  /* Use only a trylock in case we get into a deadlock with a queueing
+   * function holding the read lock when we're called. */
+  if (wr_trylock(&cgpu->qlock))
+    return;
+  work = cgpu->unqueued_work;
+  cgpu->unqueued_work = NULL;
+  wr_unlock(&cgpu->qlock);
+
+  if (work) {
+    free_work(work);
+    applog(LOG_DEBUG, "Discarded queued work item");
+  }
+}
+
+/* This version of hash work is for devices that always work on whole work
+ * items and need a queue to keep the device busy. Work creation and
+ * destruction is not done from within this function directly, the driver
+ * takes work with get_queued() in queue_full and hands it back with
+ * work_completed() from scanwork. */
+void hash_queued_work(struct thr_info *mythr)
+{
+  struct timeval tv_start = {0, 0}, tv_end;
+  struct cgpu_info *cgpu = mythr->cgpu;
+  struct device_drv *drv = cgpu->drv;
+  const int thr_id = mythr->id;
+  int64_t hashes_done = 0;
+
+  while (likely(!cgpu->shutdown)) {
+    struct timeval diff;
+    int64_t hashes;
+
+    fill_queue(mythr, cgpu, drv, thr_id);
+
+    thread_reportin(mythr);
+    hashes = drv->scanwork(mythr);
+    thread_reportout(mythr);
+
+    /* Reset the bool here in case the driver looks for it
+     * synchronously in the scanwork loop. */
+    mythr->work_restart = false;
+
+    if (unlikely(hashes == -1)) {
+      applog(LOG_ERR, "%s %d failure, disabling!", drv->name, cgpu->device_id);
+      cgpu->deven = DEV_DISABLED;
+      dev_error(cgpu, REASON_THREAD_ZERO_HASH);
+      break;
+    }
+
+    hashes_done += hashes;
+    cgtime(&tv_end);
+    timersub(&tv_end, &tv_start, &diff);
+    /* Update the hashmeter at most 5 times per second */
+    if ((hashes_done && (diff.tv_sec > 0 || diff.tv_usec > 200000)) ||
+        diff.tv_sec >= opt_log_interval) {
+      hashmeter(thr_id, &diff, hashes_done);
+      hashes_done = 0;
+      copy_time(&tv_start, &tv_end);
+    }
+
+    if (unlikely(mythr->pause || cgpu->deven != DEV_ENABLED))
+      mt_disable(mythr, thr_id, drv);
+
+    if (mythr->work_update) {
+      drv->update_work(cgpu);
+      mythr->work_update = false;
+    }
+  }
+  cgpu->deven = DEV_DISABLED;
+}
+
 void *miner_thread(void *userdata)
 {
   struct thr_info *mythr = (struct thr_info *)userdata;
@@ -7837,7 +9696,11 @@ void *miner_thread(void *userdata)
   applog(LOG_DEBUG, "Waiting on sem in miner thread");
   cgsem_wait(&mythr->sem);
 
-  set_highprio();
+  /* Host hashing must not starve the threads feeding the devices */
+  if (drv->drv_id == DRIVER_cpu)
+    set_lowprio();
+  else
+    set_highprio();
   drv->hash_work(mythr);
 out:
   drv->thread_shutdown(mythr);
@@ -7929,9 +9792,7 @@ static struct pool *select_longpoll_pool(struct pool *cp)
  */
 static void wait_lpcurrent(struct pool *pool)
 {
-  while (!cnx_needed(pool) && (pool->state == POOL_DISABLED ||
-         (pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
-         pool_strategy != POOL_BALANCE))) {
+  while (!pool_lpcurrent(pool)) {
     mutex_lock(&lp_lock);
     pthread_cond_wait(&lp_cond, &lp_lock);
     mutex_unlock(&lp_lock);
@@ -8221,10 +10082,51 @@ static void *watchpool_thread(void __maybe_unused *userdata)
 #define WATCHDOG_SICK_COUNT   (WATCHDOG_SICK_TIME/WATCHDOG_INTERVAL)
 #define WATCHDOG_DEAD_COUNT   (WATCHDOG_DEAD_TIME/WATCHDOG_INTERVAL)
 
+/* One line per pool with the average and longest time its answered shares
+ * have spent in each stage */
+static void log_share_latency(void)
+{
+  int i, j;
+
+  for (i = 0; i < total_pools; i++) {
+    struct pool *pool = pools[i];
+    char buf[256];
+    size_t len = 0;
+
+    if (pool->removed || !pool->share_lat[SHARE_STAGE_TOTAL].count)
+      continue;
+
+    mutex_lock(&stats_lock);
+    for (j = 0; j < SHARE_STAGES; j++) {
+      struct lat_hist *hist = &pool->share_lat[j];
+
+      len += snprintf(buf + len, sizeof(buf) - len, " %s %.1f/%.1f", share_stage_names[j],
+          hist->count ? hist->total_ms / hist->count : 0, hist->max_ms);
+    }
+    mutex_unlock(&stats_lock);
+
+    applog(LOG_NOTICE, "%s share latency ms avg/max:%s over %llu shares", get_pool_name(pool),
+           buf, (unsigned long long)pool->share_lat[SHARE_STAGE_TOTAL].count);
+  }
+}
+
+static void update_stale_check_rate(struct timeval *now)
+{
+  static struct timeval last_tv;
+  static unsigned int last_checks;
+  unsigned int checks = atomic_load_uint(&stale_checks);
+  double secs = tdiff(now, &last_tv);
+
+  if (last_tv.tv_sec && secs > 0)
+    stale_check_rate = (checks - last_checks) / secs;
+  last_checks = checks;
+  copy_time(&last_tv, now);
+}
+
 static void *watchdog_thread(void __maybe_unused *userdata)
 {
   const unsigned int interval = WATCHDOG_INTERVAL;
-  struct timeval zero_tv;
+  struct timeval zero_tv, latency_tv;
 
   pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
@@ -8233,6 +10135,7 @@ static void *watchdog_thread(void __maybe_unused *userdata)
   set_lowprio();
   memset(&zero_tv, 0, sizeof(struct timeval));
   cgtime(&rotate_tv);
+  cgtime(&latency_tv);
 
   while (1) {
     int i;
@@ -8272,6 +10175,12 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 #endif
 
     cgtime(&now);
+    update_stale_check_rate(&now);
+
+    if (opt_latency_log && now.tv_sec - latency_tv.tv_sec >= opt_latency_log) {
+      log_share_latency();
+      copy_time(&latency_tv, &now);
+    }
 
     // check last getwork time if greater than 10 mins, declare idle...
     if ((time(NULL) - last_getwork) >= 600) {
@@ -8507,6 +10416,8 @@ static void clean_up(bool restarting)
     print_summary();
 
   curl_global_cleanup();
+  sharelog_flush();
+  log_stop();
 }
 
 void _quit(int status)
@@ -8942,6 +10853,9 @@ bool add_cgpu(struct cgpu_info *cgpu)
   cgpu->eth_dag.current_epoch = 0xffffffffU;
   cglock_init(&cgpu->eth_dag.lock);
 
+  rwlock_init(&cgpu->qlock);
+  cgpu->queued_work = NULL;
+
   adjust_mostdevs();
   return true;
 }
@@ -9007,6 +10921,7 @@ static void restart_mining_threads(unsigned int new_n_threads)
     rd_unlock(&devices_lock);
 
     for (i = 0; i < mining_threads; i++) {
+      thr_restart_close(mining_thr[i]);
       free(mining_thr[i]);
     }
 
@@ -9060,6 +10975,7 @@ static void restart_mining_threads(unsigned int new_n_threads)
       applog(LOG_DEBUG, "Thread %d set pool = %d (%s)", k, thr->pool_no, isnull(get_pool_name(pools[thr->pool_no]), ""));
       thr->cgpu = cgpu;
       thr->device_thread = j;
+      thr_restart_init(thr);
 
       cgtime(&thr->last);
       cgpu->thr[j] = thr;
@@ -9121,8 +11037,10 @@ int main(int argc, char *argv[])
   int i;
   char *s;
 
-  for(i=0;i<8;i++)
-	  memset(devpath[i], 0, 512);
+  for (i = 0; i < MAX_FPGA_DEVICES; i++) {
+    memset(devpath[i], 0, 512);
+    devbaud[i] = FPGA_DEFAULT_BAUD;
+  }
 
   /* This dangerous function tramples random dynamically allocated
    * variables so do it before anything at all */
@@ -9184,12 +11102,17 @@ int main(int argc, char *argv[])
   if (unlikely(pthread_cond_init(&gws_cond, NULL)))
     quit(1, "Failed to pthread_cond_init gws_cond");
 
-  /* Create a unique get work queue */
-  getq = tq_new();
-  if (!getq)
-    quit(1, "Failed to create getq");
-  /* We use the getq mutex as the staged lock */
-  stgd_lock = &getq->mutex;
+  mutex_init(&stgd_lock);
+  if (unlikely(pthread_cond_init(&staged_cond, NULL)))
+    quit(1, "Failed to pthread_cond_init staged_cond");
+
+  staged_q = rq_new(STAGED_QUEUE_SIZE);
+  rollable_q = rq_new(STAGED_QUEUE_SIZE);
+  if (!staged_q || !rollable_q)
+    quit(1, "Failed to create staged work queues");
+  work_depot = rq_new(WORK_DEPOT_SIZE);
+  if (!work_depot)
+    quit(1, "Failed to create work depot");
 
   snprintf(packagename, sizeof(packagename), "%s %s", PACKAGE, CGMINER_VERSION);
 
@@ -9262,7 +11185,7 @@ int main(int argc, char *argv[])
   load_default_profile();
 
 #ifdef HAVE_CURSES
-  if (opt_realquiet || opt_display_devs)
+  if (opt_realquiet || opt_display_devs || opt_stratum_bench)
     use_curses = false;
 
   if (use_curses)
@@ -9290,6 +11213,11 @@ int main(int argc, char *argv[])
     cnfbuf = NULL;
   }
 
+  if (opt_stratum_bench) {
+    stratum_bench(opt_stratum_bench);
+    quit(0, "Stratum bench done");
+  }
+
   if (want_per_device_stats)
     opt_verbose = true;
 
@@ -9306,6 +11234,7 @@ int main(int argc, char *argv[])
 
   // this will set total_devices
   opencl_drv.drv_detect();
+  cpu_drv.drv_detect();
 
   if (opt_display_devs) {
     applog(LOG_ERR, "Devices detected:");
@@ -9421,6 +11350,9 @@ int main(int argc, char *argv[])
       fork_monitor();
   #endif // defined(unix)
 
+  log_start();
+  sharelog_start();
+
   /* Set pool state */
   for (i = 0; i < total_pools; i++) {
     struct pool *pool = pools[i];
@@ -9447,6 +11379,9 @@ int main(int argc, char *argv[])
     pool->idle = true;
   }
 
+  stratum_reactor_init();
+  submit_workers_init();
+
   applog(LOG_NOTICE, "Probing for an alive pool");
   int slept = 0;
   do {
@@ -9566,25 +11501,30 @@ int main(int argc, char *argv[])
 
     /* If the primary pool is a getwork pool and cannot roll work,
      * try to stage one extra work per mining thread */
-    if (!pool_localgen(cp) && !staged_rollable)
+    if (!pool_localgen(cp) && !rq_count(rollable_q))
       max_staged += mining_threads;
 
     cgtime(&now);
     then.tv_sec = now.tv_sec + 2;
     then.tv_nsec = now.tv_usec * 1000;
 
-    mutex_lock(stgd_lock);
-    ts = __total_staged();
+    ts = total_staged();
 
     if (!pool_localgen(cp) && !ts && !opt_fail_only)
       lagging = true;
 
     /* Wait until hash_pop tells us we need to create more work */
     if (ts > max_staged) {
-      pthread_cond_timedwait(&gws_cond, stgd_lock, &then);
-      ts = __total_staged();
+      mutex_lock(&stgd_lock);
+      atomic_xchg_uint(&gws_waiting, 1);
+      ts = total_staged();
+      if (ts > max_staged) {
+        pthread_cond_timedwait(&gws_cond, &stgd_lock, &then);
+        ts = total_staged();
+      }
+      atomic_store_uint(&gws_waiting, 0);
+      mutex_unlock(&stgd_lock);
     }
-    mutex_unlock(stgd_lock);
 
     if (ts > max_staged) {
       // Keeps slowly generating work even if it's not being
@@ -9634,9 +11574,20 @@ retry:
           gen_stratum_work_cn(pool, work);
           break;
           
-        default:
-           gen_stratum_work(pool, work);
-		   break;
+        default: {
+          struct work *works[STRATUM_WORK_BATCH];
+          int n = 1;
+
+          /* Top the queue up with one pass over the pool lock */
+          works[0] = work;
+          while (n < STRATUM_WORK_BATCH && ts + n <= max_staged)
+            works[n++] = make_work();
+          gen_stratum_works(pool, works, n);
+          for (i = 0; i < n - 1; i++)
+            stage_work(works[i]);
+          work = works[n - 1];
+          break;
+        }
       }
  
       applog(LOG_DEBUG, "Generated stratum work");
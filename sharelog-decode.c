@@ -0,0 +1,190 @@
+/*
+ * Copyright 2014 sgminer developers (see AUTHORS.md)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Turns a share log written with --sharelog-binary back into the CSV lines
+ * that --sharelog writes:
+ *
+ *   timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
+ *
+ * Build with "make sharelog-decode", then:
+ *   ./sharelog-decode shares.bin > shares.csv
+ *
+ * Files are read in order, or stdin when none are given. */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "sharelog.h"
+
+/* URL of each pool number, from the pool records of the current run */
+static char **pool_urls;
+static uint32_t pool_count;
+
+static void hex(char *s, const unsigned char *p, size_t len)
+{
+  static const char digits[16] = "0123456789abcdef";
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    *s++ = digits[p[i] >> 4];
+    *s++ = digits[p[i] & 0xF];
+  }
+  *s = '\0';
+}
+
+static void clear_pools(void)
+{
+  uint32_t i;
+
+  for (i = 0; i < pool_count; i++)
+    free(pool_urls[i]);
+  free(pool_urls);
+  pool_urls = NULL;
+  pool_count = 0;
+}
+
+static bool set_pool(uint32_t pool_no, const char *url, size_t len)
+{
+  if (pool_no >= pool_count) {
+    char **urls = (char **)realloc(pool_urls, (pool_no + 1) * sizeof(char *));
+
+    if (!urls)
+      return false;
+    memset(urls + pool_count, 0, (pool_no + 1 - pool_count) * sizeof(char *));
+    pool_urls = urls;
+    pool_count = pool_no + 1;
+  }
+  free(pool_urls[pool_no]);
+  pool_urls[pool_no] = (char *)malloc(len + 1);
+  if (!pool_urls[pool_no])
+    return false;
+  memcpy(pool_urls[pool_no], url, len);
+  pool_urls[pool_no][len] = '\0';
+  return true;
+}
+
+static void print_share(const struct sharelog_rec *rec)
+{
+  const struct sharelog_share *share = &rec->u.share;
+  char target[sizeof(share->target) * 2 + 1];
+  char hash[sizeof(share->hash) * 2 + 1];
+  char data[sizeof(share->data) * 2 + 1];
+  const char *url = "";
+
+  if (rec->pool_no < pool_count && pool_urls[rec->pool_no])
+    url = pool_urls[rec->pool_no];
+
+  hex(target, share->target, sizeof(share->target));
+  hex(hash, share->hash, sizeof(share->hash));
+  hex(data, share->data, sizeof(share->data));
+
+  printf("%lu,%.*s,%s,%s,%.*s%u,%u,%s,%s\n", (unsigned long int)share->time,
+         (int)strnlen(share->disposition, sizeof(share->disposition)), share->disposition,
+         target, url, (int)strnlen(share->dev, sizeof(share->dev)), share->dev,
+         share->device_id, share->thr_id, hash, data);
+}
+
+static bool decode(FILE *f, const char *name)
+{
+  struct sharelog_rec rec;
+  bool header = false;
+  long int n = 0;
+  size_t len;
+
+  while ((len = fread(&rec, 1, sizeof(rec), f)) == sizeof(rec)) {
+    n++;
+    if (!header && rec.type != SHARELOG_HEADER) {
+      fprintf(stderr, "%s: not a binary share log\n", name);
+      return false;
+    }
+
+    switch (rec.type) {
+      case SHARELOG_HEADER:
+        if (rec.u.header.magic != SHARELOG_MAGIC) {
+          fprintf(stderr, "%s: record %ld: bad magic, written with a different byte order?\n", name, n);
+          return false;
+        }
+        if (rec.u.header.version != SHARELOG_VERSION) {
+          fprintf(stderr, "%s: record %ld: unknown version %u\n", name, n, rec.u.header.version);
+          return false;
+        }
+        /* A new sgminer run, its pool numbers start over */
+        clear_pools();
+        header = true;
+        break;
+      case SHARELOG_POOL:
+        if (!set_pool(rec.pool_no, rec.u.url, strnlen(rec.u.url, sizeof(rec.u.url)))) {
+          fprintf(stderr, "%s: out of memory\n", name);
+          return false;
+        }
+        break;
+      case SHARELOG_SHARE:
+        print_share(&rec);
+        break;
+      default:
+        fprintf(stderr, "%s: record %ld: unknown type %u\n", name, n, rec.type);
+        return false;
+    }
+  }
+
+  if (ferror(f)) {
+    fprintf(stderr, "%s: read error\n", name);
+    return false;
+  }
+  /* sgminer stopped in the middle of a write */
+  if (len) {
+    fprintf(stderr, "%s: %lu bytes of a partial record at the end\n", name, (unsigned long int)len);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  bool ok = true;
+  int i;
+
+  if (argc < 2) {
+#ifdef WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    return decode(stdin, "stdin") ? 0 : 1;
+  }
+
+  for (i = 1; i < argc; i++) {
+    FILE *f;
+
+    if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+      fprintf(stderr, "Usage: %s [binary share log...]\n", argv[0]);
+      return 1;
+    }
+    f = fopen(argv[i], "rb");
+    if (!f) {
+      perror(argv[i]);
+      ok = false;
+      continue;
+    }
+    if (!decode(f, argv[i]))
+      ok = false;
+    fclose(f);
+    clear_pools();
+  }
+
+  return ok ? 0 : 1;
+}
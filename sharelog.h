@@ -0,0 +1,49 @@
+#ifndef SHARELOG_H
+#define SHARELOG_H
+
+#include <stdint.h>
+
+/* Binary share log, written instead of CSV with --sharelog-binary. The file
+ * is a run of fixed-size records in host byte order. Each sgminer run starts
+ * with a header record. A pool record names a pool number before the first
+ * share from it, and again whenever the pool at that number changes.
+ * sharelog-decode turns the records back into the CSV lines --sharelog
+ * writes. */
+
+/* "SGSL" when read little endian, a mismatch means the wrong byte order */
+#define SHARELOG_MAGIC 0x4c534753
+#define SHARELOG_VERSION 1
+
+enum sharelog_type {
+  SHARELOG_HEADER = 1,
+  SHARELOG_POOL,
+  SHARELOG_SHARE,
+};
+
+struct sharelog_share {
+  uint64_t time;
+  uint32_t device_id;
+  uint32_t thr_id;
+  /* Driver name and disposition, NUL padded */
+  char dev[8];
+  char disposition[40];
+  unsigned char target[32];
+  unsigned char hash[32];
+  unsigned char data[256];
+};
+
+struct sharelog_rec {
+  uint32_t type;
+  uint32_t pool_no;
+  union {
+    struct {
+      uint32_t magic;
+      uint32_t version;
+    } header;
+    /* Pool URL, NUL padded and truncated to fit */
+    char url[sizeof(struct sharelog_share)];
+    struct sharelog_share share;
+  } u;
+};
+
+#endif /* SHARELOG_H */
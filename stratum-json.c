@@ -0,0 +1,295 @@
+/*
+ * Copyright 2014 sgminer developers (see AUTHORS.md)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stratum-json.h"
+
+struct sjson_parser {
+  const char *p;
+  const char *end;
+  struct sjson_tok *tok;
+  int ntok;
+  int depth;
+};
+
+static bool sjson_value(struct sjson_parser *sp);
+
+static void sjson_ws(struct sjson_parser *sp)
+{
+  while (sp->p < sp->end && (*sp->p == ' ' || *sp->p == '\t' || *sp->p == '\r' || *sp->p == '\n'))
+    sp->p++;
+}
+
+static struct sjson_tok *sjson_new(struct sjson_parser *sp, enum sjson_type type)
+{
+  struct sjson_tok *tok;
+
+  if (sp->ntok == STRATUM_MSG_TOKENS)
+    return NULL;
+  tok = &sp->tok[sp->ntok++];
+  tok->type = type;
+  tok->s = sp->p;
+  tok->len = 0;
+  tok->size = 0;
+  tok->next = sp->ntok;
+  return tok;
+}
+
+/* Plain ASCII strings only, escapes and UTF-8 are left to jansson */
+static bool sjson_string(struct sjson_parser *sp)
+{
+  struct sjson_tok *tok;
+  const char *start = ++sp->p;
+
+  while (sp->p < sp->end && *sp->p != '"') {
+    unsigned char c = *sp->p;
+
+    if (c < 0x20 || c >= 0x80 || c == '\\')
+      return false;
+    sp->p++;
+  }
+  if (sp->p == sp->end)
+    return false;
+
+  tok = sjson_new(sp, SJSON_STRING);
+  if (!tok)
+    return false;
+  tok->s = start;
+  tok->len = sp->p++ - start;
+  return true;
+}
+
+static bool sjson_digits(struct sjson_parser *sp)
+{
+  const char *start = sp->p;
+
+  while (sp->p < sp->end && *sp->p >= '0' && *sp->p <= '9')
+    sp->p++;
+  return sp->p > start;
+}
+
+static bool sjson_numeral(struct sjson_parser *sp)
+{
+  enum sjson_type type = SJSON_INTEGER;
+  const char *start = sp->p;
+  struct sjson_tok *tok;
+
+  if (*sp->p == '-')
+    sp->p++;
+  if (sp->p < sp->end && *sp->p == '0')
+    sp->p++;
+  else if (!sjson_digits(sp))
+    return false;
+  if (sp->p < sp->end && *sp->p == '.') {
+    sp->p++;
+    if (!sjson_digits(sp))
+      return false;
+    type = SJSON_REAL;
+  }
+  if (sp->p < sp->end && (*sp->p == 'e' || *sp->p == 'E')) {
+    sp->p++;
+    if (sp->p < sp->end && (*sp->p == '+' || *sp->p == '-'))
+      sp->p++;
+    if (!sjson_digits(sp))
+      return false;
+    type = SJSON_REAL;
+  }
+
+  tok = sjson_new(sp, type);
+  if (!tok)
+    return false;
+  tok->s = start;
+  tok->len = sp->p - start;
+  return true;
+}
+
+static bool sjson_literal(struct sjson_parser *sp, const char *word, enum sjson_type type)
+{
+  size_t len = strlen(word);
+  struct sjson_tok *tok;
+
+  if ((size_t)(sp->end - sp->p) < len || memcmp(sp->p, word, len))
+    return false;
+  tok = sjson_new(sp, type);
+  if (!tok)
+    return false;
+  tok->len = len;
+  sp->p += len;
+  return true;
+}
+
+/* Arrays and objects, the opening bracket is at sp->p */
+static bool sjson_container(struct sjson_parser *sp, enum sjson_type type)
+{
+  char close = type == SJSON_OBJECT ? '}' : ']';
+  struct sjson_tok *tok;
+  int t;
+
+  if (++sp->depth > SJSON_MAX_DEPTH)
+    return false;
+  tok = sjson_new(sp, type);
+  if (!tok)
+    return false;
+  t = sp->ntok - 1;
+  sp->p++;
+
+  sjson_ws(sp);
+  if (sp->p < sp->end && *sp->p == close)
+    goto done;
+
+  for (;;) {
+    if (type == SJSON_OBJECT) {
+      if (sp->p == sp->end || *sp->p != '"' || !sjson_string(sp))
+        return false;
+      sjson_ws(sp);
+      if (sp->p == sp->end || *sp->p++ != ':')
+        return false;
+      sjson_ws(sp);
+    }
+    if (!sjson_value(sp))
+      return false;
+    sp->tok[t].size++;
+
+    sjson_ws(sp);
+    if (sp->p == sp->end)
+      return false;
+    if (*sp->p == close)
+      break;
+    if (*sp->p++ != ',')
+      return false;
+    sjson_ws(sp);
+  }
+
+done:
+  sp->p++;
+  sp->tok[t].len = sp->p - sp->tok[t].s;
+  sp->tok[t].next = sp->ntok;
+  sp->depth--;
+  return true;
+}
+
+static bool sjson_value(struct sjson_parser *sp)
+{
+  if (sp->p == sp->end)
+    return false;
+
+  switch (*sp->p) {
+    case '{':
+      return sjson_container(sp, SJSON_OBJECT);
+    case '[':
+      return sjson_container(sp, SJSON_ARRAY);
+    case '"':
+      return sjson_string(sp);
+    case 't':
+      return sjson_literal(sp, "true", SJSON_TRUE);
+    case 'f':
+      return sjson_literal(sp, "false", SJSON_FALSE);
+    case 'n':
+      return sjson_literal(sp, "null", SJSON_NULL);
+    default:
+      return sjson_numeral(sp);
+  }
+}
+
+/* Tokenizes one stratum line, which must be a single object. Returns false
+ * for anything that needs jansson. */
+bool stratum_msg_parse(struct stratum_msg *msg, const char *s, size_t len)
+{
+  struct sjson_parser sp;
+  int t;
+
+  sp.p = s;
+  sp.end = s + len;
+  sp.tok = msg->tok;
+  sp.ntok = 0;
+  sp.depth = 0;
+
+  sjson_ws(&sp);
+  if (sp.p == sp.end || *sp.p != '{' || !sjson_container(&sp, SJSON_OBJECT))
+    return false;
+  sjson_ws(&sp);
+  if (sp.p != sp.end)
+    return false;
+  msg->ntok = sp.ntok;
+
+  msg->id = msg->method = msg->params = msg->result = msg->error = -1;
+  msg->other = false;
+  /* Members are key, value pairs. A repeated key takes the last value as
+   * jansson does. */
+  for (t = 1; t < msg->ntok; t = msg->tok[t + 1].next) {
+    const struct sjson_tok *key = &msg->tok[t];
+
+    if (key->len == 2 && !memcmp(key->s, "id", 2))
+      msg->id = t + 1;
+    else if (key->len == 6 && !memcmp(key->s, "method", 6))
+      msg->method = t + 1;
+    else if (key->len == 6 && !memcmp(key->s, "params", 6))
+      msg->params = t + 1;
+    else if (key->len == 6 && !memcmp(key->s, "result", 6))
+      msg->result = t + 1;
+    else if (key->len == 5 && !memcmp(key->s, "error", 5))
+      msg->error = t + 1;
+    else
+      msg->other = true;
+  }
+  return true;
+}
+
+/* Index of element i of the array at token arr, -1 if there is none */
+int sjson_array_get(const struct stratum_msg *msg, int arr, int i)
+{
+  int t;
+
+  if (arr < 0 || msg->tok[arr].type != SJSON_ARRAY || i < 0 || i >= msg->tok[arr].size)
+    return -1;
+  for (t = arr + 1; i > 0; i--)
+    t = msg->tok[t].next;
+  return t;
+}
+
+bool sjson_is(const struct stratum_msg *msg, int t, enum sjson_type type)
+{
+  return t >= 0 && msg->tok[t].type == type;
+}
+
+/* Case insensitive prefix match, as parse_method() compares method names */
+bool sjson_prefix(const struct sjson_tok *tok, const char *str)
+{
+  size_t len = strlen(str);
+
+  return tok->type == SJSON_STRING && tok->len >= len && !strncasecmp(tok->s, str, len);
+}
+
+/* The token ends at a delimiter, so strtod stops there */
+double sjson_number(const struct sjson_tok *tok)
+{
+  if (tok->type != SJSON_INTEGER && tok->type != SJSON_REAL)
+    return 0;
+  return strtod(tok->s, NULL);
+}
+
+bool sjson_int(const struct sjson_tok *tok, int *val)
+{
+  long long ll;
+
+  if (tok->type != SJSON_INTEGER)
+    return false;
+  errno = 0;
+  ll = strtoll(tok->s, NULL, 10);
+  if (errno || ll < INT_MIN || ll > INT_MAX)
+    return false;
+  *val = (int)ll;
+  return true;
+}
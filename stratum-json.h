@@ -0,0 +1,59 @@
+#ifndef STRATUM_JSON_H
+#define STRATUM_JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Tokenizer for the common stratum messages, used ahead of jansson on the
+ * receive path. It splits a line into tokens pointing back into the line,
+ * with no allocation and no copying. Anything it does not cover (string
+ * escapes, non-ASCII, deep nesting, more tokens than fit) fails the parse so
+ * the caller can hand the line to jansson instead. */
+
+#define STRATUM_MSG_TOKENS 128
+#define SJSON_MAX_DEPTH 8
+
+enum sjson_type {
+  SJSON_OBJECT,
+  SJSON_ARRAY,
+  SJSON_STRING,
+  SJSON_INTEGER,
+  SJSON_REAL,
+  SJSON_TRUE,
+  SJSON_FALSE,
+  SJSON_NULL,
+};
+
+struct sjson_tok {
+  enum sjson_type type;
+  /* Strings exclude the quotes and are not NUL terminated */
+  const char *s;
+  size_t len;
+  /* Elements of an array, members of an object */
+  int size;
+  /* Index of the token after this value and everything inside it */
+  int next;
+};
+
+/* A message with the members stratum uses picked out, -1 when absent */
+struct stratum_msg {
+  struct sjson_tok tok[STRATUM_MSG_TOKENS];
+  int ntok;
+
+  int id;
+  int method;
+  int params;
+  int result;
+  int error;
+  /* Some other member is present, such as reject-reason */
+  bool other;
+};
+
+extern bool stratum_msg_parse(struct stratum_msg *msg, const char *s, size_t len);
+extern int sjson_array_get(const struct stratum_msg *msg, int arr, int i);
+extern bool sjson_is(const struct stratum_msg *msg, int t, enum sjson_type type);
+extern bool sjson_prefix(const struct sjson_tok *tok, const char *str);
+extern double sjson_number(const struct sjson_tok *tok);
+extern bool sjson_int(const struct sjson_tok *tok, int *val);
+
+#endif /* STRATUM_JSON_H */
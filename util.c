@@ -12,6 +12,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <stdarg.h>
 #include <string.h>
@@ -45,6 +46,7 @@
 #include "compat.h"
 #include "util.h"
 #include "pool.h"
+#include "stratum-json.h"
 
 #define DEFAULT_SOCKWAIT 60
 extern double opt_diff_mult;
@@ -300,29 +302,37 @@ static int curl_debug_cb(__maybe_unused CURL *handle, curl_infotype type,
   return 0;
 }
 
-json_t *json_rpc_call(CURL *curl, char *curl_err_str, const char *url,
+/* A JSON-RPC request set up on an easy handle, which stays in use until
+ * json_rpc_finish. rpc_req must last as long. */
+struct rpc_call {
+  CURL *curl;
+  struct pool *pool;
+  struct data_buffer all_data;
+  struct header_info hi;
+  struct curl_slist *headers;
+  struct upload_buffer upload_data;
+  bool probing;
+};
+
+struct rpc_call *json_rpc_start(CURL *curl, char *curl_err_str, const char *url,
           const char *userpass, const char *rpc_req,
-          bool probe, bool longpoll, int *rolltime,
-          struct pool *pool, bool share)
+          bool probe, bool longpoll, struct pool *pool, bool share)
 {
   long timeout = longpoll ? (60 * 60) : 60;
-  struct data_buffer all_data = {NULL, 0};
-  struct header_info hi = {NULL, 0, NULL, NULL, false, false, false};
   char len_hdr[64], user_agent_hdr[128];
   struct curl_slist *headers = NULL;
-  struct upload_buffer upload_data;
-  json_t *val, *err_val, *res_val;
-  bool probing = false;
-  double byte_count;
-  json_error_t err;
-  int rc;
+  struct rpc_call *call;
 
-  memset(&err, 0, sizeof(err));
+  call = (struct rpc_call *)calloc(sizeof(struct rpc_call), 1);
+  if (unlikely(!call))
+    quit(1, "Failed to calloc rpc_call in json_rpc_start");
+  call->curl = curl;
+  call->pool = pool;
 
   /* it is assumed that 'curl' is freshly [re]initialized at this pt */
 
   if (probe)
-    probing = !pool->probed;
+    call->probing = !pool->probed;
   curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 
   // CURLOPT_VERBOSE won't write to stderr if we use CURLOPT_DEBUGFUNCTION
@@ -340,13 +350,13 @@ json_t *json_rpc_call(CURL *curl, char *curl_err_str, const char *url,
   if (!opt_delaynet || share)
     curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &call->all_data);
   curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-  curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
+  curl_easy_setopt(curl, CURLOPT_READDATA, &call->upload_data);
   curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &call->hi);
   curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
   if (pool->rpc_proxy) {
     curl_easy_setopt(curl, CURLOPT_PROXY, pool->rpc_proxy);
@@ -366,10 +376,10 @@ json_t *json_rpc_call(CURL *curl, char *curl_err_str, const char *url,
   if (opt_protocol)
     applog(LOG_DEBUG, "JSON protocol request:\n%s", rpc_req);
 
-  upload_data.buf = rpc_req;
-  upload_data.len = strlen(rpc_req);
+  call->upload_data.buf = rpc_req;
+  call->upload_data.len = strlen(rpc_req);
   sprintf(len_hdr, "Content-Length: %lu",
-    (unsigned long) upload_data.len);
+    (unsigned long) call->upload_data.len);
   sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
 
   headers = curl_slist_append(headers,
@@ -389,6 +399,7 @@ json_t *json_rpc_call(CURL *curl, char *curl_err_str, const char *url,
   headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
 
   curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  call->headers = headers;
 
   if (opt_delaynet) {
     /* Don't delay share submission, but still track the nettime */
@@ -413,7 +424,26 @@ json_t *json_rpc_call(CURL *curl, char *curl_err_str, const char *url,
     set_nettime();
   }
 
-  rc = curl_easy_perform(curl);
+  return call;
+}
+
+/* Takes the response once the transfer is done, rc being its result, and
+ * frees the call */
+json_t *json_rpc_finish(struct rpc_call *call, char *curl_err_str, int rc, int *rolltime)
+{
+  struct data_buffer all_data = call->all_data;
+  struct header_info hi = call->hi;
+  struct curl_slist *headers = call->headers;
+  struct pool *pool = call->pool;
+  bool probing = call->probing;
+  CURL *curl = call->curl;
+  json_t *val, *err_val, *res_val;
+  double byte_count;
+  json_error_t err;
+
+  free(call);
+  memset(&err, 0, sizeof(err));
+
   if (rc) {
     applog(LOG_INFO, "HTTP request failed: %s", curl_err_str);
     goto err_out;
@@ -519,6 +549,17 @@ err_out:
   curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
   return NULL;
 }
+
+json_t *json_rpc_call(CURL *curl, char *curl_err_str, const char *url,
+          const char *userpass, const char *rpc_req,
+          bool probe, bool longpoll, int *rolltime,
+          struct pool *pool, bool share)
+{
+  struct rpc_call *call;
+
+  call = json_rpc_start(curl, curl_err_str, url, userpass, rpc_req, probe, longpoll, pool, share);
+  return json_rpc_finish(call, curl_err_str, curl_easy_perform(curl), rolltime);
+}
 #define PROXY_HTTP  CURLPROXY_HTTP
 #define PROXY_HTTP_1_0  CURLPROXY_HTTP_1_0
 #define PROXY_SOCKS4  CURLPROXY_SOCKS4
@@ -790,6 +831,9 @@ bool tq_push(struct thread_q *tq, void *data)
   return rc;
 }
 
+/* An absolute time long past, for taking from a queue without waiting */
+const struct timespec tq_nowait;
+
 void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
 {
   struct tq_ent *ent;
@@ -820,6 +864,98 @@ out:
   return rval;
 }
 
+/* size is rounded up to a power of two */
+struct ring_q *rq_new(unsigned int size)
+{
+  struct ring_q *rq;
+  unsigned int i, n = 2;
+
+  while (n < size)
+    n <<= 1;
+
+  rq = (struct ring_q *)calloc(1, sizeof(*rq));
+  if (!rq)
+    return NULL;
+  rq->cells = (struct ring_cell *)calloc(n, sizeof(struct ring_cell));
+  if (!rq->cells) {
+    free(rq);
+    return NULL;
+  }
+  rq->mask = n - 1;
+  for (i = 0; i < n; i++)
+    rq->cells[i].seq = i;
+
+  return rq;
+}
+
+void rq_free(struct ring_q *rq)
+{
+  if (!rq)
+    return;
+  free(rq->cells);
+  free(rq);
+}
+
+/* Returns false when the queue is full */
+bool rq_push(struct ring_q *rq, void *data)
+{
+  unsigned int pos = atomic_load_uint(&rq->tail);
+  struct ring_cell *cell;
+
+  for (;;) {
+    int dif;
+
+    cell = &rq->cells[pos & rq->mask];
+    dif = (int)(atomic_load_uint(&cell->seq) - pos);
+    if (!dif) {
+      if (atomic_cas_uint(&rq->tail, pos, pos + 1))
+        break;
+    } else if (dif < 0)
+      return false;
+    pos = atomic_load_uint(&rq->tail);
+  }
+
+  cell->data = data;
+  atomic_store_uint(&cell->seq, pos + 1);
+  return true;
+}
+
+/* Returns NULL when the queue is empty */
+void *rq_pop(struct ring_q *rq)
+{
+  unsigned int pos = atomic_load_uint(&rq->head);
+  struct ring_cell *cell;
+  void *data;
+
+  for (;;) {
+    int dif;
+
+    cell = &rq->cells[pos & rq->mask];
+    dif = (int)(atomic_load_uint(&cell->seq) - (pos + 1));
+    if (!dif) {
+      if (atomic_cas_uint(&rq->head, pos, pos + 1))
+        break;
+    } else if (dif < 0)
+      return NULL;
+    pos = atomic_load_uint(&rq->head);
+  }
+
+  data = cell->data;
+  atomic_store_uint(&cell->seq, pos + rq->mask + 1);
+  return data;
+}
+
+/* Only a snapshot while other threads push and pop */
+unsigned int rq_count(struct ring_q *rq)
+{
+  unsigned int head = atomic_load_uint(&rq->head);
+  int count = (int)(atomic_load_uint(&rq->tail) - head);
+
+  if (count < 0)
+    return 0;
+  return (unsigned int)count > rq->mask + 1 ? rq->mask + 1 : (unsigned int)count;
+}
+
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
 {
   cgsem_init(&thr->sem);
@@ -1192,6 +1328,19 @@ double tdiff(struct timeval *end, struct timeval *start)
   return end->tv_sec - start->tv_sec + (end->tv_usec - start->tv_usec) / 1000000.0;
 }
 
+/* Returns the milliseconds between two cgtimer times as a double */
+double cgtimer_tdiff_ms(cgtimer_t *end, cgtimer_t *start)
+{
+  cgtimer_t res;
+
+  cgtimer_sub(end, start, &res);
+#ifdef WIN32
+  return res.QuadPart / 10000.0;
+#else
+  return res.tv_sec * 1000.0 + res.tv_nsec / 1000000.0;
+#endif
+}
+
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port)
 {
   char *url_begin, *url_end, *ipv6_begin, *ipv6_end, *port_start = NULL;
@@ -1289,6 +1438,7 @@ retry:
 #else
     sent = send(pool->sock, s + ssent, len, MSG_NOSIGNAL);
 #endif
+    pool->sgminer_pool_stats.send_calls++;
     if (sent < 0) {
       if (!sock_blocks())
         return SEND_SENDFAIL;
@@ -1304,13 +1454,96 @@ retry:
   return SEND_OK;
 }
 
+/* Send as much of the pool's output queue as the socket takes without
+ * blocking. Under stratum lock. */
+static enum send_ret __stratum_flush(struct pool *pool)
+{
+  size_t ssent = 0;
+
+  while (ssent < pool->sendbuf_len) {
+    ssize_t sent;
+
+#ifdef __APPLE__
+    sent = send(pool->sock, pool->sendbuf + ssent, pool->sendbuf_len - ssent, SO_NOSIGPIPE);
+#elif WIN32
+    sent = send(pool->sock, pool->sendbuf + ssent, pool->sendbuf_len - ssent, 0);
+#else
+    sent = send(pool->sock, pool->sendbuf + ssent, pool->sendbuf_len - ssent, MSG_NOSIGNAL);
+#endif
+    pool->sgminer_pool_stats.send_calls++;
+    if (sent < 0) {
+      if (!sock_blocks())
+        return SEND_SENDFAIL;
+      break;
+    }
+    ssent += sent;
+  }
+
+  pool->sgminer_pool_stats.net_bytes_sent += ssent;
+  pool->sendbuf_len -= ssent;
+  if (pool->sendbuf_len)
+    memmove(pool->sendbuf, pool->sendbuf + ssent, pool->sendbuf_len);
+  return SEND_OK;
+}
+
+/* Once a pool is attached to the stratum reactor its socket never blocks.
+ * Commands are appended to an output queue, and whatever the socket doesn't
+ * take straight away is sent by the reactor when it is writable again. */
+static enum send_ret __stratum_queue(struct pool *pool, const char *s, ssize_t len)
+{
+  bool backlog = pool->sendbuf_len > 0;
+
+  if (opt_protocol) {
+    applog(LOG_DEBUG, "SEND: %s", s);
+  }
+
+  if (pool->sendbuf_len + len + 1 > pool->sendbuf_size) {
+    size_t newlen = pool->sendbuf_size ? pool->sendbuf_size : RBUFSIZE;
+
+    while (newlen < pool->sendbuf_len + len + 1)
+      newlen *= 2;
+    pool->sendbuf = (char *)realloc(pool->sendbuf, newlen);
+    if (!pool->sendbuf)
+      quithere(1, "Failed to realloc pool sendbuf");
+    pool->sendbuf_size = newlen;
+  }
+  memcpy(pool->sendbuf + pool->sendbuf_len, s, len);
+  pool->sendbuf[pool->sendbuf_len + len] = '\n';
+  pool->sendbuf_len += len + 1;
+
+  pool->sgminer_pool_stats.times_sent++;
+  pool->sgminer_pool_stats.bytes_sent += len + 1;
+  /* With a backlog the socket is full, and this goes out with the rest
+   * when the reactor sees it writable */
+  if (backlog)
+    return SEND_OK;
+  return __stratum_flush(pool);
+}
+
+/* Called from the stratum reactor when the pool's socket is writable */
+bool stratum_flush(struct pool *pool)
+{
+  enum send_ret ret = SEND_OK;
+
+  mutex_lock(&pool->stratum_lock);
+  if (pool->stratum_attached && pool->sendbuf_len)
+    ret = __stratum_flush(pool);
+  mutex_unlock(&pool->stratum_lock);
+
+  if (ret != SEND_OK)
+    applog(LOG_DEBUG, "Failed to send in stratum_flush");
+  return (ret == SEND_OK);
+}
+
 bool stratum_send(struct pool *pool, char *s, ssize_t len)
 {
   enum send_ret ret = SEND_INACTIVE;
+  bool attached;
 
   mutex_lock(&pool->stratum_lock);
+  attached = pool->stratum_attached;
   if (pool->stratum_active)
-    ret = __stratum_send(pool, s, len);
+    ret = attached ? __stratum_queue(pool, s, len) : __stratum_send(pool, s, len);
   mutex_unlock(&pool->stratum_lock);
 
   /* This is to avoid doing applog under stratum_lock */
@@ -1324,7 +1557,11 @@ bool stratum_send(struct pool *pool, char *s, ssize_t len)
       break;
     case SEND_SENDFAIL:
       applog(LOG_DEBUG, "Failed to send in stratum_send");
-      suspend_stratum(pool);
+      /* An attached socket belongs to the reactor, which closes it */
+      if (attached)
+        stratum_reactor_drop(pool);
+      else
+        suspend_stratum(pool);
       break;
     case SEND_INACTIVE:
       applog(LOG_DEBUG, "Stratum send failed due to no pool stratum_active");
@@ -1353,7 +1590,7 @@ static bool socket_full(struct pool *pool, int wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-  if (strlen(pool->sockbuf))
+  if (pool->sockbuf_tail > pool->sockbuf_head)
     return true;
 
   return (socket_full(pool, 0));
@@ -1361,17 +1598,18 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
-  strcpy(pool->sockbuf, "");
+  pool->sockbuf_head = pool->sockbuf_tail = pool->sockbuf_scan = 0;
 }
 
 static void clear_sock(struct pool *pool)
 {
+  char s[RBUFSIZE];
   ssize_t n;
 
   mutex_lock(&pool->stratum_lock);
   do {
     if (pool->sock)
-      n = recv(pool->sock, pool->sockbuf, RECVSIZE, 0);
+      n = recv(pool->sock, s, RECVSIZE, 0);
     else
       n = 0;
   } while (n > 0);
@@ -1380,38 +1618,113 @@ static void clear_sock(struct pool *pool)
   clear_sockbuf(pool);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make room for a full RECVSIZE read plus a \0 after the tail, first by
+ * sliding the unread data back to the start of the buffer and only then by
+ * doubling it, so a long line costs one copy per fill rather than one per
+ * byte received. */
+static void reserve_sockbuf(struct pool *pool)
 {
-  size_t old, newlen;
+  size_t used = pool->sockbuf_tail - pool->sockbuf_head;
+  size_t newlen;
 
-  old = strlen(pool->sockbuf);
-  newlen = old + len + 1;
-  if (newlen < pool->sockbuf_size)
+  if (pool->sockbuf_size - pool->sockbuf_tail > RECVSIZE)
     return;
-  newlen = newlen + (RBUFSIZE - (newlen % RBUFSIZE));
+
+  if (pool->sockbuf_head) {
+    memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_head, used);
+    pool->sockbuf_scan -= pool->sockbuf_head;
+    pool->sockbuf_head = 0;
+    pool->sockbuf_tail = used;
+    if (pool->sockbuf_size - used > RECVSIZE)
+      return;
+  }
+
+  newlen = pool->sockbuf_size * 2;
   // Avoid potentially recursive locking
-  // applog(LOG_DEBUG, "Recallocing pool sockbuf to %d", new);
+  // applog(LOG_DEBUG, "Reallocing pool sockbuf to %d", newlen);
   pool->sockbuf = (char *)realloc(pool->sockbuf, newlen);
   if (!pool->sockbuf)
     quithere(1, "Failed to realloc pool sockbuf");
-  memset(pool->sockbuf + old, 0, newlen - old);
   pool->sockbuf_size = newlen;
 }
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
-char *recv_line(struct pool *pool)
+/* Takes the next complete line off the buffer, searching only bytes that
+ * arrived since the last look. Empty lines are skipped. */
+static char *sockbuf_line(struct pool *pool, size_t *linelen)
 {
-  char *tok, *sret = NULL;
-  ssize_t len, buflen;
-  int waited = 0;
+  char *nl;
 
-  if (!strstr(pool->sockbuf, "\n")) {
-    struct timeval rstart, now;
+  while ((nl = (char *)memchr(pool->sockbuf + pool->sockbuf_scan, '\n',
+                              pool->sockbuf_tail - pool->sockbuf_scan))) {
+    char *line = pool->sockbuf + pool->sockbuf_head;
 
+    *nl = '\0';
+    pool->sockbuf_head = pool->sockbuf_scan = nl + 1 - pool->sockbuf;
+    if (nl > line) {
+      *linelen = nl - line;
+      return line;
+    }
+  }
+  pool->sockbuf_scan = pool->sockbuf_tail;
+
+  return NULL;
+}
+
+/* Returns the next complete line already in the pool's receive buffer, \0
+ * terminated in place, or NULL without reading from the socket. */
+char *recv_line_buffered(struct pool *pool, size_t *linelen)
+{
+  char *line;
+  size_t len;
+
+  line = sockbuf_line(pool, &len);
+  if (!line)
+    return NULL;
+
+  pool->sgminer_pool_stats.times_received++;
+  pool->sgminer_pool_stats.bytes_received += len;
+  if (linelen)
+    *linelen = len;
+  if (opt_protocol)
+    applog(LOG_DEBUG, "RECVD: %s", line);
+  return line;
+}
+
+/* One recv of whatever the pool's nonblocking socket has ready into its
+ * receive buffer, for the stratum reactor. Returns the bytes read, 0 if
+ * the read would block or -1 once the connection has closed or failed. */
+int recv_sock_nonblock(struct pool *pool)
+{
+  ssize_t n;
+
+  if (pool->sockbuf_head == pool->sockbuf_tail)
+    clear_sockbuf(pool);
+  reserve_sockbuf(pool);
+  n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail,
+           pool->sockbuf_size - pool->sockbuf_tail - 1, 0);
+  if (n > 0) {
+    pool->sockbuf_tail += n;
+    pool->sgminer_pool_stats.recv_calls++;
+    pool->sgminer_pool_stats.net_bytes_received += n;
+    return n;
+  }
+  if (n < 0 && sock_blocks())
+    return 0;
+  return -1;
+}
+
+/* Returns the next line from the pool, \0 terminated in place in the pool's
+ * receive buffer. Data is received straight into that buffer, one recv per
+ * time the socket is readable, until a newline turns up. The line is only
+ * valid until the next read from the pool. */
+char *recv_line_view(struct pool *pool, size_t *linelen)
+{
+  struct timeval rstart, now;
+  char *line;
+  int waited = 0;
+
+  line = recv_line_buffered(pool, linelen);
+  if (!line) {
     cgtime(&rstart);
     if (!socket_full(pool, DEFAULT_SOCKWAIT)) {
       applog(LOG_DEBUG, "Timed out waiting for data on socket_full");
@@ -1419,12 +1732,14 @@ char *recv_line(struct pool *pool)
     }
 
     do {
-      char s[RBUFSIZE];
-      size_t slen;
       ssize_t n;
 
-      memset(s, 0, RBUFSIZE);
-      n = recv(pool->sock, s, RECVSIZE, 0);
+      /* Nothing unread, start again at the front */
+      if (pool->sockbuf_head == pool->sockbuf_tail)
+        clear_sockbuf(pool);
+      reserve_sockbuf(pool);
+      n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail,
+               pool->sockbuf_size - pool->sockbuf_tail - 1, 0);
       if (!n) {
         applog(LOG_DEBUG, "Socket closed waiting in recv_line");
         suspend_stratum(pool);
@@ -1439,38 +1754,29 @@ char *recv_line(struct pool *pool)
           break;
         }
       } else {
-        slen = strlen(s);
-        recalloc_sock(pool, slen);
-        strcat(pool->sockbuf, s);
+        pool->sockbuf_tail += n;
+        pool->sgminer_pool_stats.recv_calls++;
+        pool->sgminer_pool_stats.net_bytes_received += n;
+        line = recv_line_buffered(pool, linelen);
       }
-    } while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
+    } while (waited < DEFAULT_SOCKWAIT && !line);
   }
 
-  buflen = strlen(pool->sockbuf);
-
-  if ((tok = strtok(pool->sockbuf, "\n")) == NULL) {
-    applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line: buffer = %s", pool->sockbuf);
-    goto out;
+out:
+  if (!line) {
+    applog(LOG_DEBUG, "Failed to get a \\n terminated string in recv_line");
+    clear_sock(pool);
   }
-  sret = strdup(tok);
-  len = strlen(sret);
+  return line;
+}
 
-  /* Copy what's left in the buffer after the \n, including the
-   * terminating \0 */
-  if (buflen > len + 1)
-    memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-  else
-    strcpy(pool->sockbuf, "");
+/* As recv_line_view but returns a malloced copy for callers that keep the
+ * line across further reads */
+char *recv_line(struct pool *pool)
+{
+  char *line = recv_line_view(pool, NULL);
 
-  pool->sgminer_pool_stats.times_received++;
-  pool->sgminer_pool_stats.bytes_received += len;
-  pool->sgminer_pool_stats.net_bytes_received += len;
-out:
-  if (!sret)
-    clear_sock(pool);
-  else if (opt_protocol)
-    applog(LOG_DEBUG, "RECVD: %s", sret);
-  return sret;
+  return line ? strdup(line) : NULL;
 }
 
 /* Extracts a string value from a json array with error checking. To be used
@@ -1503,6 +1809,16 @@ static char *json_array_string(json_t *val, unsigned int entry)
   return NULL;
 }
 
+/* Moves the pool's job generation on if the job_id about to replace
+ * swork.job_id differs from it, which makes work from earlier jobs stale.
+ * Needs the data_lock write lock. */
+static void stratum_job_gen(struct pool *pool, const char *job_id, size_t len)
+{
+  const char *cur = pool->swork.job_id;
+
+  if (!cur || strlen(cur) != len || memcmp(cur, job_id, len))
+    atomic_add_uint(&pool->job_gen, 1);
+}
 
 static bool parse_notify_equihash(struct pool *pool, json_t *val)
 {
@@ -1533,6 +1849,7 @@ static bool parse_notify_equihash(struct pool *pool, json_t *val)
 
   cg_wlock(&pool->data_lock);
   
+  stratum_job_gen(pool, job_id, strlen(job_id));
   free(pool->swork.job_id);
   free(pool->swork.prev_hash);
   free(pool->swork.bbversion);
@@ -1662,111 +1979,105 @@ out:
 
 static char *blank_merkel = "0000000000000000000000000000000000000000000000000000000000000000";
 
-static bool parse_notify(struct pool *pool, json_t *val)
-{
+/* A string in a stratum message. Those from the streaming parser point into
+ * the line and are not NUL terminated. */
+struct msg_str {
+	const char *s;
+	size_t len;
+};
 
-	if (pool->algorithm.type == ALGO_EQUIHASH) {
-		return parse_notify_equihash(pool, val);
-	}
+/* The fields of a mining.notify */
+struct notify_fields {
+	struct msg_str job_id, prev_hash, trie, coinbase1, coinbase2;
+	struct msg_str bbversion, nbit, ntime;
+	const char **merkle;
+	int merkles;
+	bool clean;
+};
 
-	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit,
-		*ntime, *header, *trie = NULL;
-	size_t cb1_len, cb2_len, alloc_len, header_len;
-	unsigned char *cb1, *cb2;
-	bool clean, ret = false, has_trie = false;
-	int merkles, i = 0;
-	json_t *arr;
+static bool set_msg_str(struct msg_str *str, const char *s)
+{
+	str->s = s;
+	str->len = s ? strlen(s) : 0;
+	return s != NULL;
+}
 
-	has_trie = json_array_size(val) == 10;
+static bool msg_str_tok(struct msg_str *str, const struct stratum_msg *msg, int t)
+{
+	if (!sjson_is(msg, t, SJSON_STRING))
+		return false;
+	str->s = msg->tok[t].s;
+	str->len = msg->tok[t].len;
+	return true;
+}
 
-	job_id = json_array_string(val, i++);
-	prev_hash = json_array_string(val, i++);
-	if (has_trie) {
-		trie = json_array_string(val, i++);
+/* Copies str into a pool string. The old string's storage is reused when it
+ * is long enough, which it is for every notify after the first in practice. */
+static void pool_strset(char **buf, const struct msg_str *str)
+{
+	if (!*buf || strlen(*buf) < str->len) {
+		free(*buf);
+		*buf = (char *)malloc(str->len + 1);
+		if (unlikely(!*buf))
+			quithere(1, "Failed to malloc pool string");
 	}
-	coinbase1 = json_array_string(val, i++);
-	coinbase2 = json_array_string(val, i++);
+	memcpy(*buf, str->s, str->len);
+	(*buf)[str->len] = '\0';
+}
 
-	arr = json_array_get(val, i++);
-	if (!arr || !json_is_array(arr))
-		goto out;
+/* Makes a mining.notify the pool's current job, for either parser. Buffers
+ * of the previous job are reused where the sizes allow. */
+static bool stratum_notify(struct pool *pool, const struct notify_fields *nf)
+{
+	size_t cb1_len, cb2_len, alloc_len, header_len;
+	char *header;
+	int i;
 
-	merkles = json_array_size(arr);
-
-	bbversion = json_array_string(val, i++);
-	nbit = json_array_string(val, i++);
-	ntime = json_array_string(val, i++);
-	clean = json_is_true(json_array_get(val, i));
-
-	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime || (has_trie && !trie)) {
-		/* Annoying but we must not leak memory */
-		if (job_id)
-			free(job_id);
-		if (prev_hash)
-			free(prev_hash);
-		if (trie)
-			free(trie);
-		if (coinbase1)
-			free(coinbase1);
-		if (coinbase2)
-			free(coinbase2);
-		if (bbversion)
-			free(bbversion);
-		if (nbit)
-			free(nbit);
-		if (ntime)
-			free(ntime);
-		goto out;
-	}
+	cb1_len = nf->coinbase1.len / 2;
+	cb2_len = nf->coinbase2.len / 2;
 
 	cg_wlock(&pool->data_lock);
-	free(pool->swork.job_id);
-	free(pool->swork.prev_hash);
-	free(pool->swork.bbversion);
-	free(pool->swork.nbit);
-	free(pool->swork.ntime);
-	pool->swork.job_id = job_id;
-	pool->swork.prev_hash = prev_hash;
-	cb1_len = strlen(coinbase1) / 2;
-	cb2_len = strlen(coinbase2) / 2;
-	pool->swork.bbversion = bbversion;
-	pool->swork.nbit = nbit;
-	pool->swork.ntime = ntime;
-	pool->swork.clean = clean;
+	stratum_job_gen(pool, nf->job_id.s, nf->job_id.len);
+	pool_strset(&pool->swork.job_id, &nf->job_id);
+	pool_strset(&pool->swork.prev_hash, &nf->prev_hash);
+	pool_strset(&pool->swork.bbversion, &nf->bbversion);
+	pool_strset(&pool->swork.nbit, &nf->nbit);
+	pool_strset(&pool->swork.ntime, &nf->ntime);
+	pool->swork.clean = nf->clean;
 	if (pool->next_diff > 0) {
 		pool->swork.diff = pool->next_diff;
 	}
 	alloc_len = pool->swork.cb_len = cb1_len + pool->n1_len + pool->n2size + cb2_len;
 	pool->nonce2_offset = cb1_len + pool->n1_len;
 
-	for (i = 0; i < pool->swork.merkles; i++)
+	/* Branch buffers are all 32 bytes, keep the ones already there */
+	for (i = nf->merkles; i < pool->swork.merkles; i++)
 		free(pool->swork.merkle_bin[i]);
-	if (merkles) {
+	if (nf->merkles > pool->swork.merkles) {
 		pool->swork.merkle_bin = (unsigned char **)realloc(pool->swork.merkle_bin,
-			sizeof(char *) * merkles + 1);
-		for (i = 0; i < merkles; i++) {
-			char *merkle = json_array_string(arr, i);
-
+			sizeof(char *) * nf->merkles);
+		if (unlikely(!pool->swork.merkle_bin))
+			quit(1, "Failed to realloc pool swork merkle_bin");
+		for (i = pool->swork.merkles; i < nf->merkles; i++) {
 			pool->swork.merkle_bin[i] = (unsigned char *)malloc(32);
 			if (unlikely(!pool->swork.merkle_bin[i]))
 				quit(1, "Failed to malloc pool swork merkle_bin");
-			hex2bin(pool->swork.merkle_bin[i], merkle, 32);
-			free(merkle);
 		}
 	}
-	pool->swork.merkles = merkles;
-	if (clean)
+	for (i = 0; i < nf->merkles; i++)
+		hex2bin(pool->swork.merkle_bin[i], nf->merkle[i], 32);
+	pool->swork.merkles = nf->merkles;
+	if (nf->clean)
 		pool->nonce2 = 0;
-	pool->merkle_offset = strlen(pool->swork.bbversion) +
-		strlen(pool->swork.prev_hash);
+	pool->merkle_offset = nf->bbversion.len + nf->prev_hash.len;
 	pool->merkle_offset /= 2;
 	header = (char *)alloca(257);
 	snprintf(header, 257,
-		"%s%s%s%s%s%s%s",
+		"%s%s%s%.*s%s%s%s",
 		pool->swork.bbversion,
 		pool->swork.prev_hash,
 		blank_merkel,
-		has_trie ? trie : "",
+		(int)nf->trie.len, nf->trie.s,
 		pool->swork.ntime,
 		pool->swork.nbit,
 		"00000000" /* nonce */
@@ -1775,64 +2086,100 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	memset(header + header_len, '0', 256 - header_len);
 	header[256] = '\0';
 	if (unlikely(!hex2bin(pool->header_bin, header, 128))) {
+		cg_wunlock(&pool->data_lock);
 		applog(LOG_WARNING, "%s: Failed to convert header to header_bin, got %s", __func__, header);
 		pool_failed(pool);
-		// TODO: memory leaks? goto out, clean up there?
 		return false;
 	}
 
-	cb1 = (unsigned char *)calloc(cb1_len, 1);
-	if (unlikely(!cb1))
-		quithere(1, "Failed to calloc cb1 in parse_notify");
-	hex2bin(cb1, coinbase1, cb1_len);
-
-	cb2 = (unsigned char *)calloc(cb2_len, 1);
-	if (unlikely(!cb2))
-		quithere(1, "Failed to calloc cb2 in parse_notify");
-	hex2bin(cb2, coinbase2, cb2_len);
-
-	free(pool->coinbase);
+	/* The same size as the last job's in the steady state, so realloc
+	 * keeps the buffer where it is */
 	align_len(&alloc_len);
-	pool->coinbase = (unsigned char *)calloc(alloc_len, 1);
+	pool->coinbase = (unsigned char *)realloc(pool->coinbase, alloc_len);
 	if (unlikely(!pool->coinbase))
-		quit(1, "Failed to calloc pool coinbase in parse_notify");
-	memcpy(pool->coinbase, cb1, cb1_len);
+		quit(1, "Failed to realloc pool coinbase in parse_notify");
+	memset(pool->coinbase, 0, alloc_len);
+	hex2bin(pool->coinbase, nf->coinbase1.s, cb1_len);
 	memcpy(pool->coinbase + cb1_len, pool->nonce1bin, pool->n1_len);
 	// NOTE: gap for nonce2, filled at work generation time
-	memcpy(pool->coinbase + cb1_len + pool->n1_len + pool->n2size, cb2, cb2_len);
+	hex2bin(pool->coinbase + cb1_len + pool->n1_len + pool->n2size, nf->coinbase2.s, cb2_len);
+
+	/* Work generation then only hashes nonce2 and coinbase2 */
+	pool->swork.cb_mid_valid = pool->algorithm.gen_hash == gen_hash || pool->algorithm.gen_hash == sha256;
+	if (pool->swork.cb_mid_valid) {
+		sph_sha256_init(&pool->swork.cb_mid);
+		sph_sha256(&pool->swork.cb_mid, pool->coinbase, pool->nonce2_offset);
+	}
 	cg_wunlock(&pool->data_lock);
 
 	if (opt_protocol) {
-		applog(LOG_DEBUG, "job_id: %s", job_id);
-		applog(LOG_DEBUG, "prev_hash: %s", prev_hash);
-		applog(LOG_DEBUG, "coinbase1: %s", coinbase1);
-		applog(LOG_DEBUG, "coinbase2: %s", coinbase2);
-		applog(LOG_DEBUG, "bbversion: %s", bbversion);
-		applog(LOG_DEBUG, "nbit: %s", nbit);
-		applog(LOG_DEBUG, "ntime: %s", ntime);
-		applog(LOG_DEBUG, "clean: %s", clean ? "yes" : "no");
+		applog(LOG_DEBUG, "job_id: %.*s", (int)nf->job_id.len, nf->job_id.s);
+		applog(LOG_DEBUG, "prev_hash: %.*s", (int)nf->prev_hash.len, nf->prev_hash.s);
+		applog(LOG_DEBUG, "coinbase1: %.*s", (int)nf->coinbase1.len, nf->coinbase1.s);
+		applog(LOG_DEBUG, "coinbase2: %.*s", (int)nf->coinbase2.len, nf->coinbase2.s);
+		applog(LOG_DEBUG, "bbversion: %.*s", (int)nf->bbversion.len, nf->bbversion.s);
+		applog(LOG_DEBUG, "nbit: %.*s", (int)nf->nbit.len, nf->nbit.s);
+		applog(LOG_DEBUG, "ntime: %.*s", (int)nf->ntime.len, nf->ntime.s);
+		applog(LOG_DEBUG, "clean: %s", nf->clean ? "yes" : "no");
 	}
-	free(coinbase1);
-	free(coinbase2);
-	free(cb1);
-	free(cb2);
 
 	/* A notify message is the closest stratum gets to a getwork */
 	pool->getwork_requested++;
 	total_getworks++;
-	ret = true;
 	if (pool == current_pool())
 		opt_work_update = true;
-out:
-	return ret;
+	return true;
 }
 
+static bool parse_notify(struct pool *pool, json_t *val)
+{
 
+	if (pool->algorithm.type == ALGO_EQUIHASH) {
+		return parse_notify_equihash(pool, val);
+	}
 
+	struct notify_fields nf;
+	bool ret = false, has_trie;
+	int i = 0, m;
+	json_t *arr;
 
+	has_trie = json_array_size(val) == 10;
 
+	memset(&nf, 0, sizeof(nf));
+	set_msg_str(&nf.trie, "");
+	if (!set_msg_str(&nf.job_id, __json_array_string(val, i++)) ||
+	    !set_msg_str(&nf.prev_hash, __json_array_string(val, i++)) ||
+	    (has_trie && !set_msg_str(&nf.trie, __json_array_string(val, i++))) ||
+	    !set_msg_str(&nf.coinbase1, __json_array_string(val, i++)) ||
+	    !set_msg_str(&nf.coinbase2, __json_array_string(val, i++)))
+		goto out;
 
+	arr = json_array_get(val, i++);
+	if (!arr || !json_is_array(arr))
+		goto out;
 
+	if (!set_msg_str(&nf.bbversion, __json_array_string(val, i++)) ||
+	    !set_msg_str(&nf.nbit, __json_array_string(val, i++)) ||
+	    !set_msg_str(&nf.ntime, __json_array_string(val, i++)))
+		goto out;
+	nf.clean = json_is_true(json_array_get(val, i));
+
+	nf.merkles = json_array_size(arr);
+	if (nf.merkles) {
+		nf.merkle = (const char **)malloc(sizeof(char *) * nf.merkles);
+		if (unlikely(!nf.merkle))
+			quithere(1, "Failed to malloc merkle list");
+		for (m = 0; m < nf.merkles; m++) {
+			if (!(nf.merkle[m] = __json_array_string(arr, m)))
+				goto out;
+		}
+	}
+
+	ret = stratum_notify(pool, &nf);
+out:
+	free(nf.merkle);
+	return ret;
+}
 
 static bool parse_notify_old(struct pool *pool, json_t *val)
 {
@@ -1883,6 +2230,7 @@ static bool parse_notify_old(struct pool *pool, json_t *val)
   }
 
   cg_wlock(&pool->data_lock);
+  stratum_job_gen(pool, job_id, strlen(job_id));
   free(pool->swork.job_id);
   free(pool->swork.prev_hash);
   free(pool->swork.bbversion);
@@ -2067,6 +2415,7 @@ static bool parse_notify_ethash(struct pool *pool, json_t *val)
   
   cg_wlock(&pool->data_lock);
   
+  stratum_job_gen(pool, job_id, strlen(job_id));
   if (pool->swork.job_id != NULL)
     free(pool->swork.job_id);
   pool->swork.job_id = strdup(job_id);
@@ -2161,6 +2510,7 @@ bool parse_notify_cn(struct pool *pool, json_t *val)
 
   cg_wlock(&pool->data_lock);
   
+  stratum_job_gen(pool, job_id, strlen(job_id));
   if (pool->swork.job_id != NULL) {
     free(pool->swork.job_id);
   }
@@ -2194,14 +2544,14 @@ out:
   return ret;
 }
 
-static bool parse_diff(struct pool *pool, json_t *val)
+static bool set_pool_diff(struct pool *pool, double value)
 {
   double old_diff, diff;
 
   if (opt_diff_mult == 0.0)
-    diff = json_number_value(json_array_get(val, 0)) * pool->algorithm.diff_multiplier1;
+    diff = value * pool->algorithm.diff_multiplier1;
   else
-    diff = json_number_value(json_array_get(val, 0)) * opt_diff_mult;
+    diff = value * opt_diff_mult;
 
   if (diff == 0)
     return false;
@@ -2233,6 +2583,11 @@ static bool parse_diff(struct pool *pool, json_t *val)
   return true;
 }
 
+static bool parse_diff(struct pool *pool, json_t *val)
+{
+  return set_pool_diff(pool, json_number_value(json_array_get(val, 0)));
+}
+
 static bool parse_target(struct pool *pool, json_t *val)
 {
   uint8_t oldtarget[32], target[32], *str;
@@ -2288,45 +2643,54 @@ static bool parse_extranonce_equihash(struct pool *pool, json_t *val)
   return true;
 }
 
+static bool set_pool_extranonce(struct pool *pool, const struct msg_str *nonce1, int n2size)
+{
+  size_t n1_len = nonce1->len / 2;
+
+  cg_wlock(&pool->data_lock);
+  pool_strset(&pool->nonce1, nonce1);
+  if (!pool->nonce1bin || pool->n1_len != n1_len) {
+    free(pool->nonce1bin);
+    pool->nonce1bin = (unsigned char *)calloc(n1_len, 1);
+    if (unlikely(!pool->nonce1bin))
+      quithere(1, "Failed to calloc pool->nonce1bin");
+  }
+  pool->n1_len = n1_len;
+  hex2bin(pool->nonce1bin, pool->nonce1, pool->n1_len);
+  pool->n2size = n2size;
+  /* The coinbase is laid out for the old sizes until the next notify */
+  pool->swork.cb_mid_valid = false;
+  cg_wunlock(&pool->data_lock);
+
+  applog(LOG_NOTICE, "%s extranonce change requested", get_pool_name(pool));
+
+  return true;
+}
+
 static bool parse_extranonce(struct pool *pool, json_t *val)
 {
   if (pool->algorithm.type == ALGO_EQUIHASH) {
     return parse_extranonce_equihash(pool, val);
   }
 
-  char *nonce1;
+  struct msg_str nonce1;
   int n2size;
 
-  nonce1 = json_array_string(val, 0);
-  if (!nonce1) {
+  if (!set_msg_str(&nonce1, __json_array_string(val, 0))) {
     return false;
   }
   n2size = json_integer_value(json_array_get(val, 1));
   if (!n2size) {
-    free(nonce1);
     return false;
   }
 
-  cg_wlock(&pool->data_lock);
-  free(pool->nonce1);
-  pool->nonce1 = nonce1;
-  pool->n1_len = strlen(nonce1) / 2;
-  free(pool->nonce1bin);
-  pool->nonce1bin = (unsigned char *)calloc(pool->n1_len, 1);
-  if (unlikely(!pool->nonce1bin))
-    quithere(1, "Failed to calloc pool->nonce1bin");
-  hex2bin(pool->nonce1bin, pool->nonce1, pool->n1_len);
-  pool->n2size = n2size;
-  cg_wunlock(&pool->data_lock);
-
-  applog(LOG_NOTICE, "%s extranonce change requested", get_pool_name(pool));
-
-  return true;
+  return set_pool_extranonce(pool, &nonce1, n2size);
 }
 
 static void __suspend_stratum(struct pool *pool)
 {
   clear_sockbuf(pool);
+  pool->sendbuf_len = 0;
   pool->stratum_active = pool->stratum_notify = false;
   if (pool->sock)
     CLOSESOCKET(pool->sock);
@@ -2342,6 +2706,7 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 
   char *url, *port, address[256];
   char *sockaddr_url, *stratum_port, *tmp; /* Tempvars. */
+  bool attached;
 
   url = (char *)json_string_value(json_array_get(val, 0));
   if (!url)
@@ -2360,7 +2725,9 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
   clear_pool_work(pool);
 
   mutex_lock(&pool->stratum_lock);
-  __suspend_stratum(pool);
+  attached = pool->stratum_attached;
+  if (!attached)
+    __suspend_stratum(pool);
   tmp = pool->sockaddr_url;
   pool->sockaddr_url = sockaddr_url;
   pool->stratum_url = pool->sockaddr_url;
@@ -2370,6 +2737,13 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
   free(tmp);
   mutex_unlock(&pool->stratum_lock);
 
+  /* Connecting would hold up the reactor thread this runs on, the new
+   * connection is made by the reactor's connect thread instead */
+  if (attached) {
+    stratum_reactor_reconnect(pool);
+    return true;
+  }
+
   if (!restart_stratum(pool)) {
     pool_failed(pool);
     return false;
@@ -2518,6 +2892,92 @@ done:
   return ret;
 }
 
+/* Fills a notify straight from the tokens, -1 if the message needs the
+ * jansson parse_notify() */
+static int parse_notify_msg(struct pool *pool, const struct stratum_msg *msg)
+{
+  const char *merkle[STRATUM_MSG_TOKENS];
+  struct notify_fields nf;
+  int i = 0, m, arr, t;
+
+  if (msg->tok[msg->params].size != 9 && msg->tok[msg->params].size != 10)
+    return -1;
+
+  memset(&nf, 0, sizeof(nf));
+  set_msg_str(&nf.trie, "");
+  if (!msg_str_tok(&nf.job_id, msg, sjson_array_get(msg, msg->params, i++)) ||
+      !msg_str_tok(&nf.prev_hash, msg, sjson_array_get(msg, msg->params, i++)) ||
+      (msg->tok[msg->params].size == 10 && !msg_str_tok(&nf.trie, msg, sjson_array_get(msg, msg->params, i++))) ||
+      !msg_str_tok(&nf.coinbase1, msg, sjson_array_get(msg, msg->params, i++)) ||
+      !msg_str_tok(&nf.coinbase2, msg, sjson_array_get(msg, msg->params, i++)))
+    return -1;
+
+  arr = sjson_array_get(msg, msg->params, i++);
+  if (!sjson_is(msg, arr, SJSON_ARRAY))
+    return -1;
+  nf.merkles = msg->tok[arr].size;
+  for (m = 0, t = arr + 1; m < nf.merkles; m++, t = msg->tok[t].next) {
+    if (!sjson_is(msg, t, SJSON_STRING) || msg->tok[t].len != 64)
+      return -1;
+    merkle[m] = msg->tok[t].s;
+  }
+  nf.merkle = merkle;
+
+  if (!msg_str_tok(&nf.bbversion, msg, sjson_array_get(msg, msg->params, i++)) ||
+      !msg_str_tok(&nf.nbit, msg, sjson_array_get(msg, msg->params, i++)) ||
+      !msg_str_tok(&nf.ntime, msg, sjson_array_get(msg, msg->params, i++)))
+    return -1;
+  nf.clean = sjson_is(msg, sjson_array_get(msg, msg->params, i), SJSON_TRUE);
+
+  return stratum_notify(pool, &nf);
+}
+
+/* The streaming parser's side of parse_method(), for the messages a pool
+ * sends many of. Returns whether the message was handled as parse_method()
+ * does, or -1 to pass the line to parse_method(). */
+int parse_method_msg(struct pool *pool, const struct stratum_msg *msg)
+{
+  const struct sjson_tok *method;
+  struct msg_str nonce1;
+  int n2size, ret;
+
+  /* Cryptonight and ethash carry their jobs in their own formats */
+  if (msg->method < 0 || pool->algorithm.type == ALGO_CRYPTONIGHT || pool->algorithm.type == ALGO_ETHASH)
+    return -1;
+  if (!sjson_is(msg, msg->params, SJSON_ARRAY) || (msg->error >= 0 && !sjson_is(msg, msg->error, SJSON_NULL)))
+    return -1;
+  method = &msg->tok[msg->method];
+
+  if (sjson_prefix(method, "mining.notify")) {
+    if (pool->algorithm.type == ALGO_EQUIHASH)
+      return -1;
+    ret = parse_notify_msg(pool, msg);
+    if (ret >= 0)
+      pool->stratum_notify = ret;
+    return ret;
+  }
+
+  if (sjson_prefix(method, "mining.set_difficulty")) {
+    int t = sjson_array_get(msg, msg->params, 0);
+
+    if (!sjson_is(msg, t, SJSON_INTEGER) && !sjson_is(msg, t, SJSON_REAL))
+      return -1;
+    return set_pool_diff(pool, sjson_number(&msg->tok[t]));
+  }
+
+  if (sjson_prefix(method, "mining.set_extranonce")) {
+    int t = sjson_array_get(msg, msg->params, 1);
+
+    if (pool->algorithm.type == ALGO_EQUIHASH ||
+        !msg_str_tok(&nonce1, msg, sjson_array_get(msg, msg->params, 0)) ||
+        t < 0 || !sjson_int(&msg->tok[t], &n2size) || !n2size)
+      return -1;
+    return set_pool_extranonce(pool, &nonce1, n2size);
+  }
+
+  return -1;
+}
+
 bool subscribe_extranonce(struct pool *pool)
 {
   json_t *val = NULL, *res_val, *err_val;
@@ -2886,7 +3346,7 @@ static bool socks4_negotiate(struct pool *pool, int sockd, bool socks4a)
   return true;
 }
 
-static void noblock_socket(SOCKETTYPE fd)
+void noblock_socket(SOCKETTYPE fd)
 {
 #ifndef WIN32
   int flags = fcntl(fd, F_GETFL, 0);
@@ -3388,6 +3848,87 @@ void *realloc_strcat(char *ptr, char *s)
   return ret;
 }
 
+/* Reference counted strings. The count sits just before the characters so
+ * holders keep using a plain char *, and copies share one allocation. */
+struct rstr {
+  volatile unsigned int refs;
+  char s[1];
+};
+
+#define rstr_of(_s) ((struct rstr *)((_s) - offsetof(struct rstr, s)))
+
+unsigned int total_rstr_allocs;
+
+char *rstr_newn(const char *s, size_t len)
+{
+  struct rstr *r = (struct rstr *)malloc(offsetof(struct rstr, s) + len + 1);
+
+  if (unlikely(!r))
+    quithere(1, "Failed to malloc");
+  r->refs = 1;
+  memcpy(r->s, s, len);
+  r->s[len] = '\0';
+  atomic_add_uint(&total_rstr_allocs, 1);
+  return r->s;
+}
+
+char *rstr_new(const char *s)
+{
+  return s ? rstr_newn(s, strlen(s)) : NULL;
+}
+
+char *rstr_get(char *s)
+{
+  if (s)
+    atomic_add_uint(&rstr_of(s)->refs, 1);
+  return s;
+}
+
+void rstr_put(char *s)
+{
+  if (s && !atomic_add_uint(&rstr_of(s)->refs, -1))
+    free(rstr_of(s));
+}
+
+/* Points *ref at a counted copy of s, keeping the one it has if it matches */
+void rstr_set(char **ref, const char *s)
+{
+  if (*ref && s && !strcmp(*ref, s))
+    return;
+  rstr_put(*ref);
+  *ref = rstr_new(s);
+}
+
+void lat_hist_add(struct lat_hist *hist, double ms)
+{
+  int i;
+
+  for (i = 0; i < LAT_HIST_BUCKETS - 1 && ms >= (double)(1 << i); i++)
+    ;
+  hist->bucket[i]++;
+  hist->count++;
+  hist->total_ms += ms;
+  if (ms > hist->max_ms)
+    hist->max_ms = ms;
+}
+
+/* The buckets as space separated "limit:count" pairs for the API, limits in
+ * ms and "inf" for the last */
+char *lat_hist_str(const struct lat_hist *hist, char *buf, size_t size)
+{
+  size_t len = 0;
+  int i;
+
+  buf[0] = '\0';
+  for (i = 0; i < LAT_HIST_BUCKETS && len < size; i++) {
+    if (i < LAT_HIST_BUCKETS - 1)
+      len += snprintf(buf + len, size - len, "%s%d:%u", i ? " " : "", 1 << i, hist->bucket[i]);
+    else
+      len += snprintf(buf + len, size - len, " inf:%u", hist->bucket[i]);
+  }
+  return buf;
+}
+
 void RenameThread(const char* name)
 {
   char buf[16];
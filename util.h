@@ -96,6 +96,17 @@ typedef struct cgsem cgsem_t;
 #else
 typedef sem_t cgsem_t;
 #endif
+/* Latencies in power of 2 millisecond buckets, bucket i counting those
+ * under 2^i ms and the last everything longer */
+#define LAT_HIST_BUCKETS 16
+
+struct lat_hist {
+  uint64_t count;
+  double total_ms;
+  double max_ms;
+  uint32_t bucket[LAT_HIST_BUCKETS];
+};
+
 #ifdef WIN32
 typedef LARGE_INTEGER cgtimer_t;
 #else
@@ -104,6 +115,7 @@ typedef struct timespec cgtimer_t;
 
 struct thr_info;
 struct pool;
+struct stratum_msg;
 enum dev_reason;
 struct cgpu_info;
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg);
@@ -131,10 +143,16 @@ void cgtimer_sub(cgtimer_t *a, cgtimer_t *b, cgtimer_t *res);
 double us_tdiff(struct timeval *end, struct timeval *start);
 int ms_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
+double cgtimer_tdiff_ms(cgtimer_t *end, cgtimer_t *start);
 bool stratum_send(struct pool *pool, char *s, ssize_t len);
+bool stratum_flush(struct pool *pool);
 bool sock_full(struct pool *pool);
+char *recv_line_buffered(struct pool *pool, size_t *linelen);
+int recv_sock_nonblock(struct pool *pool);
+char *recv_line_view(struct pool *pool, size_t *linelen);
 char *recv_line(struct pool *pool);
 bool parse_method(struct pool *pool, char *s);
+int parse_method_msg(struct pool *pool, const struct stratum_msg *msg);
 bool parse_notify_cn(struct pool *pool, json_t *val);
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port);
 bool auth_stratum(struct pool *pool);
@@ -142,8 +160,17 @@ bool subscribe_extranonce(struct pool *pool);
 bool initiate_stratum(struct pool *pool);
 bool restart_stratum(struct pool *pool);
 void suspend_stratum(struct pool *pool);
+void noblock_socket(SOCKETTYPE fd);
 void dev_error(struct cgpu_info *dev, enum dev_reason reason);
 void *realloc_strcat(char *ptr, char *s);
+extern unsigned int total_rstr_allocs;
+char *rstr_newn(const char *s, size_t len);
+char *rstr_new(const char *s);
+char *rstr_get(char *s);
+void rstr_put(char *s);
+void rstr_set(char **ref, const char *s);
+void lat_hist_add(struct lat_hist *hist, double ms);
+char *lat_hist_str(const struct lat_hist *hist, char *buf, size_t size);
 void RenameThread(const char* name);
 void _cgsem_init(cgsem_t *cgsem, const char *file, const char *func, const int line);
 void _cgsem_post(cgsem_t *cgsem, const char *file, const char *func, const int line);